@@ -0,0 +1,1360 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * A benchmark for the ujson reader and writer.
+ *
+ * Synthetic corpora are generated with the ujson writer into memory, then
+ * each of them is traversed, skipped, filtered and written again. Each
+ * benchmark is run a few times to warm up and then repeated, the median and
+ * 99th percentile of the run times are reported on stdout and written as JSON
+ * into a results file.
+ *
+ * Optionally hardware performance counters are read for the measured runs and
+ * reported per byte and per value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <ujson.h>
+#include <ujson_utf.h>
+
+#include "perf.h"
+
+#define DEFAULT_REPS 15
+#define DEFAULT_WARMUP 3
+
+/* A sink that only counts bytes, used for the writer benchmarks. */
+static int out_null(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	size_t *cnt = self->out_priv;
+
+	(void)buf;
+	*cnt += buf_len;
+
+	return 0;
+}
+
+static uint64_t rnd_state;
+
+static uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+
+	return rnd_state;
+}
+
+static unsigned int rnd_range(unsigned int min, unsigned int max)
+{
+	return min + rnd() % (max - min + 1);
+}
+
+static const char *rnd_str(char *buf, unsigned int min, unsigned int max, int esc)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJ0123456789";
+	unsigned int i, len = rnd_range(min, max);
+
+	for (i = 0; i < len; i++) {
+		buf[i] = chars[rnd() % (sizeof(chars) - 1)];
+
+		if (!esc)
+			continue;
+
+		switch (rnd() % 64) {
+		case 0:
+			buf[i] = '\n';
+		break;
+		case 1:
+			buf[i] = '"';
+		break;
+		case 2:
+			if (i + 1 < len) {
+				/* U+00E9 */
+				buf[i++] = 0xc3;
+				buf[i] = 0xa9;
+			}
+		break;
+		}
+	}
+
+	buf[len] = 0;
+
+	return buf;
+}
+
+/*
+ * Corpus generators, each returns number of values written. The scale is
+ * roughly number of records.
+ */
+static size_t gen_strings(ujson_writer *w, unsigned int scale)
+{
+	unsigned int i, j;
+	size_t values = 1;
+	char buf[512];
+
+	rnd_state = 0x1234;
+
+	ujson_arr_start(w, NULL);
+
+	for (i = 0; i < scale; i++) {
+		ujson_obj_start(w, NULL);
+		ujson_int_add(w, "id", i);
+		ujson_str_add(w, "name", rnd_str(buf, 8, 32, 0));
+		ujson_str_add(w, "text", rnd_str(buf, 64, 256, 1));
+		ujson_arr_start(w, "tags");
+		for (j = 0; j < 3; j++)
+			ujson_str_add(w, NULL, rnd_str(buf, 3, 10, 0));
+		ujson_arr_finish(w);
+		ujson_obj_finish(w);
+		values += 8;
+	}
+
+	ujson_arr_finish(w);
+	ujson_writer_finish(w);
+
+	return values;
+}
+
+static size_t gen_numbers(ujson_writer *w, unsigned int scale)
+{
+	unsigned int i, j;
+	size_t values = 1;
+
+	rnd_state = 0x2345;
+
+	ujson_arr_start(w, NULL);
+
+	for (i = 0; i < scale; i++) {
+		ujson_arr_start(w, NULL);
+		for (j = 0; j < 8; j++) {
+			if (j % 2)
+				ujson_float_add(w, NULL, (double)(rnd() % 1000000) / 1000);
+			else
+				ujson_int_add(w, NULL, (long)(rnd() % 2000000000) - 1000000000);
+		}
+		ujson_arr_finish(w);
+		values += 9;
+	}
+
+	ujson_arr_finish(w);
+	ujson_writer_finish(w);
+
+	return values;
+}
+
+static size_t gen_nested(ujson_writer *w, unsigned int scale)
+{
+	unsigned int i, j, depth = 100;
+	size_t values = 1;
+
+	rnd_state = 0x3456;
+
+	ujson_arr_start(w, NULL);
+
+	for (i = 0; i < scale / 64; i++) {
+		for (j = 0; j < depth; j++) {
+			if (j % 2) {
+				ujson_obj_start(w, NULL);
+			} else {
+				ujson_arr_start(w, j ? "arr" : NULL);
+				ujson_int_add(w, NULL, j);
+			}
+		}
+
+		for (j = depth; j > 0; j--) {
+			if ((j - 1) % 2) {
+				ujson_bool_add(w, "last", j == depth);
+				ujson_obj_finish(w);
+			} else {
+				ujson_arr_finish(w);
+			}
+		}
+
+		values += depth * 2;
+	}
+
+	ujson_arr_finish(w);
+	ujson_writer_finish(w);
+
+	return values;
+}
+
+static size_t gen_wide(ujson_writer *w, unsigned int scale)
+{
+	unsigned int i, j;
+	size_t values = 1;
+	char key[32], buf[64];
+
+	rnd_state = 0x4567;
+
+	ujson_arr_start(w, NULL);
+
+	for (i = 0; i < scale / 128; i++) {
+		ujson_obj_start(w, NULL);
+		ujson_int_add(w, "id", i);
+		for (j = 0; j < 512; j++) {
+			snprintf(key, sizeof(key), "key_%05u", j);
+			if (j % 2)
+				ujson_int_add(w, key, rnd() % 100000);
+			else
+				ujson_str_add(w, key, rnd_str(buf, 4, 16, 0));
+		}
+		ujson_obj_finish(w);
+		values += 514;
+	}
+
+	ujson_arr_finish(w);
+	ujson_writer_finish(w);
+
+	return values;
+}
+
+static size_t gen_ndjson(ujson_writer *w, unsigned int scale)
+{
+	unsigned int i;
+	size_t values = 0;
+	char buf[64];
+
+	rnd_state = 0x5678;
+
+	for (i = 0; i < scale; i++) {
+		ujson_obj_start(w, NULL);
+		ujson_int_add(w, "id", i);
+		ujson_str_add(w, "name", rnd_str(buf, 8, 24, 0));
+		ujson_float_add(w, "value", (double)(rnd() % 100000) / 100);
+		ujson_bool_add(w, "ok", rnd() % 2);
+		ujson_null_add(w, "tags");
+		ujson_obj_finish(w);
+		ujson_writer_finish(w);
+		values += 6;
+	}
+
+	return values;
+}
+
+struct corpus {
+	const char *name;
+	size_t (*gen)(ujson_writer *w, unsigned int scale);
+	char *json;
+	size_t len;
+	/* The same data encoded as CBOR */
+	char *cbor;
+	size_t cbor_len;
+	size_t values;
+};
+
+static struct corpus corpora[] = {
+	{.name = "strings", .gen = gen_strings},
+	{.name = "numbers", .gen = gen_numbers},
+	{.name = "nested", .gen = gen_nested},
+	{.name = "wide", .gen = gen_wide},
+	{.name = "ndjson", .gen = gen_ndjson},
+};
+
+static int gen_corpus(struct corpus *corpus, unsigned int scale)
+{
+	ujson_writer *w = ujson_writer_mem_open(0);
+
+	if (!w)
+		return 1;
+
+	corpus->values = corpus->gen(w, scale);
+
+	if (ujson_writer_mem_close(w, &corpus->json, &corpus->len))
+		return 1;
+
+	w = ujson_writer_mem_open(0);
+	if (!w)
+		return 1;
+
+	/* The generators seed the random generator, the data are the same */
+	w->flags |= UJSON_WRITER_CBOR;
+	corpus->gen(w, scale);
+
+	return ujson_writer_mem_close(w, &corpus->cbor, &corpus->cbor_len);
+}
+
+/*
+ * Reader benchmarks, each returns number of values parsed.
+ */
+static size_t walk_arr(ujson_reader *reader, ujson_val *val);
+
+static size_t walk_obj(ujson_reader *reader, ujson_val *val)
+{
+	size_t cnt = 0;
+
+	UJSON_OBJ_FOREACH(reader, val) {
+		cnt++;
+
+		switch (val->type) {
+		case UJSON_OBJ:
+			cnt += walk_obj(reader, val);
+		break;
+		case UJSON_ARR:
+			cnt += walk_arr(reader, val);
+		break;
+		default:
+		break;
+		}
+	}
+
+	return cnt;
+}
+
+static size_t walk_arr(ujson_reader *reader, ujson_val *val)
+{
+	size_t cnt = 0;
+
+	UJSON_ARR_FOREACH(reader, val) {
+		cnt++;
+
+		switch (val->type) {
+		case UJSON_OBJ:
+			cnt += walk_obj(reader, val);
+		break;
+		case UJSON_ARR:
+			cnt += walk_arr(reader, val);
+		break;
+		default:
+		break;
+		}
+	}
+
+	return cnt;
+}
+
+static const ujson_obj_attr filter_attrs[] = {
+	UJSON_OBJ_ATTR("arr", UJSON_ARR),
+	UJSON_OBJ_ATTR("id", UJSON_INT),
+	UJSON_OBJ_ATTR("name", UJSON_STR),
+	UJSON_OBJ_ATTR("value", UJSON_FLOAT),
+};
+
+static const ujson_obj filter_obj = {
+	.attrs = filter_attrs,
+	.attr_cnt = UJSON_ARRAY_SIZE(filter_attrs),
+};
+
+static size_t filter_arr(ujson_reader *reader, ujson_val *val);
+
+static size_t filter_obj_walk(ujson_reader *reader, ujson_val *val)
+{
+	size_t cnt = 0;
+
+	UJSON_OBJ_FOREACH_FILTER(reader, val, &filter_obj, NULL) {
+		cnt++;
+
+		if (val->type == UJSON_ARR)
+			cnt += filter_arr(reader, val);
+	}
+
+	return cnt;
+}
+
+static size_t filter_arr(ujson_reader *reader, ujson_val *val)
+{
+	size_t cnt = 0;
+
+	UJSON_ARR_FOREACH(reader, val) {
+		cnt++;
+
+		switch (val->type) {
+		case UJSON_OBJ:
+			cnt += filter_obj_walk(reader, val);
+		break;
+		case UJSON_ARR:
+			cnt += filter_arr(reader, val);
+		break;
+		default:
+		break;
+		}
+	}
+
+	return cnt;
+}
+
+enum read_mode {
+	READ_TRAVERSE,
+	READ_SKIP,
+	READ_FILTER,
+};
+
+static size_t read_reader(ujson_reader *reader, ujson_val *val, enum read_mode mode)
+{
+	size_t cnt = 0;
+
+	/* Loops over documents for NDJSON, runs once otherwise */
+	while (!ujson_reader_consumed(reader)) {
+		switch (ujson_reader_start(reader)) {
+		case UJSON_ARR:
+			if (mode == READ_SKIP)
+				ujson_arr_skip(reader);
+			else if (mode == READ_FILTER)
+				cnt += filter_arr(reader, val);
+			else
+				cnt += walk_arr(reader, val);
+		break;
+		case UJSON_OBJ:
+			if (mode == READ_SKIP)
+				ujson_obj_skip(reader);
+			else if (mode == READ_FILTER)
+				cnt += filter_obj_walk(reader, val);
+			else
+				cnt += walk_obj(reader, val);
+		break;
+		default:
+		break;
+		}
+
+		cnt++;
+
+		if (ujson_reader_err(reader)) {
+			ujson_err_print(reader);
+			exit(1);
+		}
+	}
+
+	return cnt;
+}
+
+static size_t read_corpus(struct corpus *corpus, ujson_val *val, enum read_mode mode,
+                          int cbor)
+{
+	ujson_reader reader = UJSON_READER_INIT(corpus->json, corpus->len, 0);
+	ujson_cbor_stack stack;
+
+	if (cbor) {
+		reader.json = corpus->cbor;
+		reader.len = corpus->cbor_len;
+		reader.flags |= UJSON_READER_CBOR;
+		reader.cbor_left = stack;
+	}
+
+	return read_reader(&reader, val, mode);
+}
+
+static unsigned int scale = 20000;
+
+enum write_mode {
+	WRITE_NONE,
+	WRITE_NULL,
+	WRITE_FILE,
+	WRITE_FILE_URING,
+	WRITE_TRANSCODE,
+};
+
+enum load_mode {
+	LOAD_NONE,
+	LOAD_PLAIN,
+	LOAD_INDEXED,
+	LOAD_STREAM,
+	LOAD_STREAM_URING,
+};
+
+struct bench {
+	const char *name;
+	enum read_mode mode;
+	enum write_mode write;
+	/* Reads or writes CBOR instead of JSON, transcoding converts to it */
+	int cbor;
+	/* Loads the corpus from a file before reading it */
+	enum load_mode load;
+};
+
+static const struct bench benches[] = {
+	{.name = "traverse", .mode = READ_TRAVERSE},
+	{.name = "skip", .mode = READ_SKIP},
+	{.name = "filter", .mode = READ_FILTER},
+	{.name = "write", .write = WRITE_NULL},
+	{.name = "file", .write = WRITE_FILE},
+	{.name = "uring", .write = WRITE_FILE_URING},
+	{.name = "transcode", .write = WRITE_TRANSCODE},
+	{.name = "cbor_read", .mode = READ_TRAVERSE, .cbor = 1},
+	{.name = "cbor_skip", .mode = READ_SKIP, .cbor = 1},
+	{.name = "cbor_gen", .write = WRITE_NULL, .cbor = 1},
+	{.name = "to_cbor", .write = WRITE_TRANSCODE, .cbor = 1},
+	{.name = "load", .mode = READ_SKIP, .load = LOAD_PLAIN},
+	{.name = "indexed", .mode = READ_SKIP, .load = LOAD_INDEXED},
+	{.name = "stream", .mode = READ_SKIP, .load = LOAD_STREAM},
+	{.name = "rd_uring", .mode = READ_SKIP, .load = LOAD_STREAM_URING},
+};
+
+#define BENCH_FILE "bench.out"
+#define BENCH_INDEX "bench.out.idx"
+
+static void save_corpus(struct corpus *corpus)
+{
+	FILE *f = fopen(BENCH_FILE, "w");
+
+	if (!f || fwrite(corpus->json, corpus->len, 1, f) != 1 || fclose(f)) {
+		fprintf(stderr, "Failed to write '%s'\n", BENCH_FILE);
+		exit(1);
+	}
+
+	unlink(BENCH_INDEX);
+}
+
+/*
+ * Loads the corpus file and reads it, the first indexed load builds and saves
+ * the index which is then used by the following ones.
+ */
+static size_t load_corpus(ujson_val *val, const struct bench *bench)
+{
+	ujson_reader *reader;
+	size_t cnt;
+
+	switch (bench->load) {
+	case LOAD_INDEXED:
+		reader = ujson_reader_load_indexed(BENCH_FILE, BENCH_INDEX, 0);
+	break;
+	case LOAD_STREAM:
+		reader = ujson_reader_stream_open(BENCH_FILE, 0, 0);
+	break;
+	case LOAD_STREAM_URING:
+		reader = ujson_reader_stream_open(BENCH_FILE, 0, UJSON_READER_STREAM_IO_URING);
+	break;
+	default:
+		reader = ujson_reader_load(BENCH_FILE);
+	break;
+	}
+
+	if (!reader) {
+		fprintf(stderr, "Failed to load '%s'\n", BENCH_FILE);
+		exit(1);
+	}
+
+	cnt = read_reader(reader, val, bench->mode);
+
+	ujson_reader_free(reader);
+
+	return cnt;
+}
+
+/*
+ * Writes the corpus into a file, the time includes waiting for the writes but
+ * not for the data to reach the disk.
+ */
+static size_t write_file(struct corpus *corpus, enum write_mode mode)
+{
+	ujson_writer *w;
+	size_t values;
+
+	w = ujson_writer_file_open_ex(BENCH_FILE, 0, mode == WRITE_FILE_URING ?
+	                              UJSON_WRITER_FILE_IO_URING : 0);
+	if (!w) {
+		fprintf(stderr, "Failed to open '%s'\n", BENCH_FILE);
+		exit(1);
+	}
+
+	w->flags |= UJSON_WRITER_FINISH_NO_FLUSH;
+
+	values = corpus->gen(w, scale);
+
+	if (ujson_writer_file_close(w)) {
+		fprintf(stderr, "Failed to write '%s'\n", BENCH_FILE);
+		exit(1);
+	}
+
+	return values;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+struct result {
+	size_t bytes;
+	size_t values;
+	uint64_t min_ns;
+	uint64_t median_ns;
+	uint64_t p99_ns;
+	/* Performance counters averaged over the repetitions */
+	double perf[PERF_CNT_MAX];
+};
+
+static struct perf perf;
+static int use_perf;
+
+static void run_bench(struct corpus *corpus, const struct bench *bench,
+                      unsigned int warmup, unsigned int reps, struct result *res)
+{
+	ujson_val *val = ujson_val_alloc(0);
+	uint64_t times[reps];
+	unsigned int i;
+
+	memset(perf.vals, 0, sizeof(perf.vals));
+
+	if (bench->load)
+		save_corpus(corpus);
+
+	for (i = 0; i < warmup + reps; i++) {
+		int measure = i >= warmup;
+
+		if (use_perf && measure)
+			perf_start(&perf);
+
+		uint64_t start = now_ns();
+
+		if (bench->write == WRITE_NULL) {
+			ujson_writer w = UJSON_WRITER_INIT(out_null, &res->bytes);
+
+			if (bench->cbor)
+				w.flags |= UJSON_WRITER_CBOR;
+
+			res->bytes = 0;
+			res->values = corpus->gen(&w, scale);
+		} else if (bench->write == WRITE_TRANSCODE) {
+			ujson_reader reader = UJSON_READER_INIT(corpus->json, corpus->len, 0);
+			ujson_writer w = UJSON_WRITER_INIT(out_null, &res->bytes);
+
+			w.flags = UJSON_WRITER_COMPACT | UJSON_WRITER_FINISH_NO_FLUSH;
+
+			if (bench->cbor)
+				w.flags |= UJSON_WRITER_CBOR;
+
+			res->bytes = 0;
+
+			if (ujson_transcode(&reader, &w, NULL)) {
+				ujson_err_print(&reader);
+				exit(1);
+			}
+
+			res->values = corpus->values;
+			res->bytes = corpus->len;
+		} else if (bench->write) {
+			res->values = write_file(corpus, bench->write);
+			res->bytes = corpus->len;
+		} else if (bench->load) {
+			res->values = load_corpus(val, bench);
+			res->bytes = corpus->len;
+		} else {
+			res->values = read_corpus(corpus, val, bench->mode, bench->cbor);
+			res->bytes = bench->cbor ? corpus->cbor_len : corpus->len;
+		}
+
+		if (measure)
+			times[i - warmup] = now_ns() - start;
+
+		if (use_perf && measure)
+			perf_stop(&perf);
+	}
+
+	for (i = 0; i < PERF_CNT_MAX; i++)
+		res->perf[i] = (double)perf.vals[i] / reps;
+
+	/*
+	 * Skipping and filtering do not visit all values, report time per
+	 * value in the input for all reader benchmarks so that they compare.
+	 */
+	if (!bench->write)
+		res->values = corpus->values;
+
+	qsort(times, reps, sizeof(*times), cmp_u64);
+
+	res->min_ns = times[0];
+	res->median_ns = times[reps/2];
+	res->p99_ns = times[(reps * 99 + 99) / 100 - 1];
+
+	ujson_val_free(val);
+}
+
+static double mb_per_s(struct result *res)
+{
+	return (double)res->bytes / res->median_ns * 1000;
+}
+
+static double ns_per_value(struct result *res)
+{
+	return res->values ? (double)res->median_ns / res->values : 0;
+}
+
+static void print_perf(struct result *res)
+{
+	int i;
+
+	printf("%-19s", "");
+
+	for (i = 0; i < PERF_CNT_MAX; i++) {
+		if (!perf_avail(&perf, i))
+			continue;
+
+		printf(" %s %.3f/B %.2f/value", perf_name(i),
+		       res->perf[i] / res->bytes,
+		       res->values ? res->perf[i] / res->values : 0);
+	}
+
+	printf("\n");
+}
+
+static void write_perf(ujson_writer *out, struct result *res)
+{
+	char id[UJSON_ID_MAX];
+	int i;
+
+	ujson_obj_start(out, "perf");
+
+	for (i = 0; i < PERF_CNT_MAX; i++) {
+		if (!perf_avail(&perf, i))
+			continue;
+
+		snprintf(id, sizeof(id), "%s_per_byte", perf_name(i));
+		ujson_float_add(out, id, res->perf[i] / res->bytes);
+		snprintf(id, sizeof(id), "%s_per_value", perf_name(i));
+		ujson_float_add(out, id, res->values ? res->perf[i] / res->values : 0);
+	}
+
+	ujson_obj_finish(out);
+}
+
+/*
+ * Microbenchmarks, each of them runs an operation on MICRO_OPS inputs and
+ * returns a number of bytes produced so that the work is not optimized out.
+ */
+#define MICRO_OPS 100000
+
+static int64_t micro_ints[MICRO_OPS];
+
+static void micro_ints_init(void)
+{
+	unsigned int i;
+
+	rnd_state = 0x6789;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		micro_ints[i] = (int64_t)rnd() >> (rnd() % 64);
+}
+
+static size_t micro_int_ujson(void)
+{
+	char buf[UJSON_INT_STR_MAX];
+	size_t i, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		ret += ujson_i64_to_str(micro_ints[i], buf);
+
+	return ret;
+}
+
+static size_t micro_int_snprintf(void)
+{
+	char buf[64];
+	size_t i, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		ret += snprintf(buf, sizeof(buf), "%" PRIi64, micro_ints[i]);
+
+	return ret;
+}
+
+static double micro_doubles[MICRO_OPS];
+
+static void micro_doubles_init(void)
+{
+	unsigned int i;
+
+	rnd_state = 0x789a;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		micro_doubles[i] = (double)rnd() / (rnd() | 1);
+}
+
+static size_t micro_double_ujson(void)
+{
+	char buf[UJSON_FLOAT_STR_MAX];
+	size_t i, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		ret += ujson_double_to_str(micro_doubles[i], buf);
+
+	return ret;
+}
+
+/* Seventeen digits are needed for a round trip with printf() */
+static size_t micro_double_snprintf(void)
+{
+	char buf[64];
+	size_t i, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		ret += snprintf(buf, sizeof(buf), "%.17g", micro_doubles[i]);
+
+	return ret;
+}
+
+/* Writes a record per op, the keys are either escaped each time or prepared */
+static const char *const record_ids[] = {
+	"timestamp", "user_id", "event", "duration", "success",
+};
+
+static ujson_key record_keys[UJSON_ARRAY_SIZE(record_ids)];
+
+static void micro_records_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < UJSON_ARRAY_SIZE(record_ids); i++)
+		record_keys[i] = ujson_key_prepare(record_ids[i]);
+}
+
+static size_t micro_record_id(void)
+{
+	size_t i, ret = 0;
+	ujson_writer w = UJSON_WRITER_INIT(out_null, &ret);
+
+	w.flags = UJSON_WRITER_COMPACT | UJSON_WRITER_FINISH_NO_FLUSH;
+
+	for (i = 0; i < MICRO_OPS; i++) {
+		ujson_obj_start(&w, NULL);
+		ujson_int_add(&w, record_ids[0], 1700000000 + i);
+		ujson_int_add(&w, record_ids[1], i % 1000);
+		ujson_str_add(&w, record_ids[2], "click");
+		ujson_int_add(&w, record_ids[3], i % 100);
+		ujson_bool_add(&w, record_ids[4], i % 2);
+		ujson_obj_finish(&w);
+		ujson_writer_finish(&w);
+	}
+
+	ujson_writer_flush(&w);
+
+	return ret;
+}
+
+static size_t micro_record_key(void)
+{
+	size_t i, ret = 0;
+	ujson_writer w = UJSON_WRITER_INIT(out_null, &ret);
+
+	w.flags = UJSON_WRITER_COMPACT | UJSON_WRITER_FINISH_NO_FLUSH;
+
+	for (i = 0; i < MICRO_OPS; i++) {
+		ujson_obj_start(&w, NULL);
+		ujson_int_add_key(&w, &record_keys[0], 1700000000 + i);
+		ujson_int_add_key(&w, &record_keys[1], i % 1000);
+		ujson_str_add_key(&w, &record_keys[2], "click");
+		ujson_int_add_key(&w, &record_keys[3], i % 100);
+		ujson_bool_add_key(&w, &record_keys[4], i % 2);
+		ujson_obj_finish(&w);
+		ujson_writer_finish(&w);
+	}
+
+	ujson_writer_flush(&w);
+
+	return ret;
+}
+
+/*
+ * UTF-8 helpers on text that is either plain ASCII or mixed with two, three
+ * and four byte characters, compared to the character at a time versions.
+ */
+#define MICRO_TEXTS 64
+#define MICRO_TEXT_MAX 1024
+
+static char micro_texts[MICRO_TEXTS][MICRO_TEXT_MAX];
+
+static void micro_texts_init(int mixed)
+{
+	static const char *const chars[] = {"\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80"};
+	unsigned int i, len;
+
+	rnd_state = 0x89ab;
+
+	for (i = 0; i < MICRO_TEXTS; i++) {
+		char *text = micro_texts[i];
+		unsigned int max = rnd_range(256, MICRO_TEXT_MAX - 8);
+
+		for (len = 0; len < max;) {
+			if (mixed && !(rnd() % 8)) {
+				const char *ch = chars[rnd() % 3];
+
+				strcpy(text + len, ch);
+				len += strlen(ch);
+			} else {
+				text[len++] = 'a' + rnd() % 26;
+			}
+		}
+
+		text[len] = 0;
+	}
+}
+
+static void micro_ascii_init(void)
+{
+	micro_texts_init(0);
+}
+
+static void micro_mixed_init(void)
+{
+	micro_texts_init(1);
+}
+
+__attribute__((noinline))
+static int8_t ref_utf8_next_chsz(const char *str, size_t off)
+{
+	char ch = str[off];
+	uint8_t len = 0;
+
+	if (!ch)
+		return 0;
+
+	if (UJSON_UTF8_IS_ASCII(ch))
+		return 1;
+
+	if (UJSON_UTF8_IS_2BYTE(ch))
+		len = 2;
+	else if (UJSON_UTF8_IS_3BYTE(ch))
+		len = 3;
+	else if (UJSON_UTF8_IS_4BYTE(ch))
+		len = 4;
+	else
+		return -1;
+
+	if (!UJSON_UTF8_IS_NBYTE(str[off+1]))
+		return -1;
+
+	if (len > 2 && !UJSON_UTF8_IS_NBYTE(str[off+2]))
+		return -1;
+
+	if (len > 3 && !UJSON_UTF8_IS_NBYTE(str[off+3]))
+		return -1;
+
+	return len;
+}
+
+__attribute__((noinline))
+static size_t ref_utf8_strlen(const char *str)
+{
+	size_t cnt = 0;
+
+	while (ujson_utf8_next(&str))
+		cnt++;
+
+	return cnt;
+}
+
+static size_t micro_strlen_ujson(void)
+{
+	size_t i, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		ret += ujson_utf8_strlen(micro_texts[i % MICRO_TEXTS]);
+
+	return ret;
+}
+
+static size_t micro_strlen_ref(void)
+{
+	size_t i, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++)
+		ret += ref_utf8_strlen(micro_texts[i % MICRO_TEXTS]);
+
+	return ret;
+}
+
+static size_t micro_chsz_ujson(void)
+{
+	size_t i, off, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++) {
+		const char *text = micro_texts[i % MICRO_TEXTS];
+
+		for (off = 0; text[off]; ret++)
+			off += ujson_utf8_next_chsz(text, off);
+	}
+
+	return ret;
+}
+
+static size_t micro_chsz_ref(void)
+{
+	size_t i, off, ret = 0;
+
+	for (i = 0; i < MICRO_OPS; i++) {
+		const char *text = micro_texts[i % MICRO_TEXTS];
+
+		for (off = 0; text[off]; ret++)
+			off += ref_utf8_next_chsz(text, off);
+	}
+
+	return ret;
+}
+
+struct micro {
+	const char *name;
+	void (*init)(void);
+	size_t (*run)(void);
+};
+
+static const struct micro micros[] = {
+	{"int_ujson", micro_ints_init, micro_int_ujson},
+	{"int_snprintf", micro_ints_init, micro_int_snprintf},
+	{"double_ujson", micro_doubles_init, micro_double_ujson},
+	{"double_snprintf", micro_doubles_init, micro_double_snprintf},
+	{"record_id", micro_records_init, micro_record_id},
+	{"record_key", micro_records_init, micro_record_key},
+	{"strlen_ascii", micro_ascii_init, micro_strlen_ujson},
+	{"strlen_ascii_ref", micro_ascii_init, micro_strlen_ref},
+	{"strlen_mixed", micro_mixed_init, micro_strlen_ujson},
+	{"strlen_mixed_ref", micro_mixed_init, micro_strlen_ref},
+	{"chsz_mixed", micro_mixed_init, micro_chsz_ujson},
+	{"chsz_mixed_ref", micro_mixed_init, micro_chsz_ref},
+};
+
+static void run_micro(ujson_writer *out, unsigned int warmup, unsigned int reps)
+{
+	uint64_t times[reps];
+	unsigned int i, j;
+	size_t bytes = 0;
+
+	ujson_arr_start(out, "micro");
+
+	printf("\n%-16s %10s %10s %10s\n", "micro", "median ns", "p99 ns", "B/op");
+
+	for (i = 0; i < UJSON_ARRAY_SIZE(micros); i++) {
+		const struct micro *micro = &micros[i];
+		double median, p99;
+
+		micro->init();
+
+		for (j = 0; j < warmup + reps; j++) {
+			uint64_t start = now_ns();
+
+			bytes = micro->run();
+
+			if (j >= warmup)
+				times[j - warmup] = now_ns() - start;
+		}
+
+		qsort(times, reps, sizeof(*times), cmp_u64);
+
+		median = (double)times[reps/2] / MICRO_OPS;
+		p99 = (double)times[(reps * 99 + 99) / 100 - 1] / MICRO_OPS;
+
+		printf("%-16s %10.2f %10.2f %10.2f\n", micro->name, median, p99,
+		       (double)bytes / MICRO_OPS);
+
+		ujson_obj_start(out, NULL);
+		ujson_str_add(out, "name", micro->name);
+		ujson_int_add(out, "ops", MICRO_OPS);
+		ujson_float_add(out, "median_ns_per_op", median);
+		ujson_float_add(out, "p99_ns_per_op", p99);
+		ujson_obj_finish(out);
+	}
+
+	ujson_arr_finish(out);
+}
+
+/*
+ * Parallel serialization of a large array, slices of the array are written by
+ * worker threads into fragments that are joined into the output in order.
+ */
+#define PARALLEL_RECORDS_PER_SCALE 10
+
+static unsigned int max_threads;
+
+static void write_record(ujson_writer *w, size_t i)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "user-%zu", i);
+
+	ujson_obj_start(w, NULL);
+	ujson_int_add(w, "id", i);
+	ujson_str_add(w, "name", name);
+	ujson_float_add(w, "score", (double)(i % 10000) / 7);
+	ujson_bool_add(w, "active", i % 3);
+	ujson_arr_start(w, "tags");
+	ujson_str_add(w, NULL, "a");
+	ujson_str_add(w, NULL, "b");
+	ujson_arr_finish(w);
+	ujson_obj_finish(w);
+}
+
+struct slice {
+	pthread_t thread;
+	ujson_writer *frag;
+	size_t start;
+	size_t end;
+};
+
+static void *write_slice(void *arg)
+{
+	struct slice *slice = arg;
+	size_t i;
+
+	for (i = slice->start; i < slice->end; i++)
+		write_record(slice->frag, i);
+
+	return NULL;
+}
+
+static size_t write_parallel(size_t records, unsigned int threads)
+{
+	struct slice slices[threads];
+	size_t bytes = 0;
+	unsigned int i;
+	ujson_writer w = UJSON_WRITER_INIT(out_null, &bytes);
+
+	ujson_arr_start(&w, NULL);
+
+	for (i = 0; i < threads; i++) {
+		slices[i].start = records * i / threads;
+		slices[i].end = records * (i + 1) / threads;
+		slices[i].frag = ujson_writer_fragment_open(&w, 0);
+
+		if (!slices[i].frag ||
+		    pthread_create(&slices[i].thread, NULL, write_slice, &slices[i])) {
+			fprintf(stderr, "Failed to start a writer thread\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(slices[i].thread, NULL);
+		ujson_writer_fragment_join(&w, slices[i].frag);
+	}
+
+	ujson_arr_finish(&w);
+
+	if (ujson_writer_finish(&w))
+		exit(1);
+
+	return bytes;
+}
+
+/* Doubles the number of threads up to max_threads, returns 0 when done */
+static unsigned int next_threads(unsigned int threads)
+{
+	if (threads >= max_threads)
+		return 0;
+
+	threads *= 2;
+
+	return threads > max_threads ? max_threads : threads;
+}
+
+static void run_parallel(ujson_writer *out, unsigned int warmup, unsigned int reps)
+{
+	size_t records = (size_t)scale * PARALLEL_RECORDS_PER_SCALE;
+	uint64_t times[reps], base_ns = 0;
+	unsigned int threads, j;
+	size_t bytes = 0;
+
+	ujson_arr_start(out, "parallel");
+
+	printf("\n%-16s %10s %10s %10s %10s\n", "parallel", "MB",
+	       "median ms", "MB/s", "speedup");
+
+	for (threads = 1; threads; threads = next_threads(threads)) {
+		uint64_t median;
+
+		for (j = 0; j < warmup + reps; j++) {
+			uint64_t start = now_ns();
+
+			bytes = write_parallel(records, threads);
+
+			if (j >= warmup)
+				times[j - warmup] = now_ns() - start;
+		}
+
+		qsort(times, reps, sizeof(*times), cmp_u64);
+
+		median = times[reps/2];
+
+		if (threads == 1)
+			base_ns = median;
+
+		printf("%2u %-13s %10.2f %10.3f %10.1f %10.2f\n", threads, "threads",
+		       (double)bytes / 1000000, (double)median / 1000000,
+		       (double)bytes / median * 1000, (double)base_ns / median);
+
+		ujson_obj_start(out, NULL);
+		ujson_int_add(out, "threads", threads);
+		ujson_int_add(out, "records", records);
+		ujson_int_add(out, "bytes", bytes);
+		ujson_int_add(out, "median_ns", median);
+		ujson_float_add(out, "speedup", (double)base_ns / median);
+		ujson_obj_finish(out);
+	}
+
+	ujson_arr_finish(out);
+}
+
+static void usage(const char *self)
+{
+	printf("usage: %s [-r reps] [-w warmup] [-s scale] [-o results.json]"
+	       " [-c corpus] [-b bench] [-t threads] [-p]\n\n"
+	       "  -p  read hardware performance counters\n"
+	       "  -t  maximal number of threads for the parallel benchmark\n"
+	       "  -b micro runs only the microbenchmarks\n"
+	       "  -b parallel runs only the parallel writer benchmark\n", self);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int reps = DEFAULT_REPS, warmup = DEFAULT_WARMUP;
+	const char *out_path = "bench.json";
+	const char *only_corpus = NULL, *only_bench = NULL;
+	ujson_writer *out;
+	unsigned int i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:w:s:o:c:b:t:ph")) != -1) {
+		switch (opt) {
+		case 'r':
+			reps = atoi(optarg);
+		break;
+		case 'w':
+			warmup = atoi(optarg);
+		break;
+		case 's':
+			scale = atoi(optarg);
+		break;
+		case 'o':
+			out_path = optarg;
+		break;
+		case 'c':
+			only_corpus = optarg;
+		break;
+		case 'b':
+			only_bench = optarg;
+		break;
+		case 't':
+			max_threads = atoi(optarg);
+		break;
+		case 'p':
+			use_perf = 1;
+		break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!max_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		max_threads = cpus > 0 ? cpus : 1;
+	}
+
+	if (!reps || !scale) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (use_perf && !perf_open(&perf)) {
+		fprintf(stderr, "Performance counters not available, "
+		        "check /proc/sys/kernel/perf_event_paranoid\n");
+		perf_close(&perf);
+		use_perf = 0;
+	}
+
+	out = ujson_writer_file_open(out_path);
+	if (!out) {
+		fprintf(stderr, "Failed to open '%s'\n", out_path);
+		return 1;
+	}
+
+	ujson_obj_start(out, NULL);
+	ujson_int_add(out, "reps", reps);
+	ujson_int_add(out, "warmup", warmup);
+	ujson_int_add(out, "scale", scale);
+	ujson_arr_start(out, "results");
+
+	printf("%-8s %-9s %10s %10s %10s %10s %10s\n", "corpus", "bench",
+	       "MB", "median ms", "p99 ms", "MB/s", "ns/value");
+
+	for (i = 0; i < UJSON_ARRAY_SIZE(corpora); i++) {
+		struct corpus *corpus = &corpora[i];
+
+		if (only_corpus && strcmp(only_corpus, corpus->name))
+			continue;
+
+		if (gen_corpus(corpus, scale)) {
+			fprintf(stderr, "Failed to generate '%s'\n", corpus->name);
+			return 1;
+		}
+
+		for (j = 0; j < UJSON_ARRAY_SIZE(benches); j++) {
+			const struct bench *bench = &benches[j];
+			struct result res;
+
+			if (only_bench && strcmp(only_bench, bench->name))
+				continue;
+
+			run_bench(corpus, bench, warmup, reps, &res);
+
+			printf("%-8s %-9s %10.2f %10.3f %10.3f %10.1f %10.2f\n",
+			       corpus->name, bench->name, (double)res.bytes / 1000000,
+			       (double)res.median_ns / 1000000,
+			       (double)res.p99_ns / 1000000,
+			       mb_per_s(&res), ns_per_value(&res));
+
+			if (use_perf)
+				print_perf(&res);
+
+			ujson_obj_start(out, NULL);
+			ujson_str_add(out, "corpus", corpus->name);
+			ujson_str_add(out, "bench", bench->name);
+			ujson_int_add(out, "bytes", res.bytes);
+			ujson_int_add(out, "values", res.values);
+			ujson_int_add(out, "min_ns", res.min_ns);
+			ujson_int_add(out, "median_ns", res.median_ns);
+			ujson_int_add(out, "p99_ns", res.p99_ns);
+			ujson_float_add(out, "mb_per_s", mb_per_s(&res));
+			ujson_float_add(out, "ns_per_value", ns_per_value(&res));
+			if (use_perf)
+				write_perf(out, &res);
+			ujson_obj_finish(out);
+		}
+
+		free(corpus->json);
+		free(corpus->cbor);
+	}
+
+	ujson_arr_finish(out);
+
+	if (!only_corpus && (!only_bench || !strcmp(only_bench, "micro")))
+		run_micro(out, warmup, reps);
+
+	if (!only_corpus && (!only_bench || !strcmp(only_bench, "parallel")))
+		run_parallel(out, warmup, reps);
+
+	ujson_obj_finish(out);
+	ujson_writer_finish(out);
+
+	if (use_perf)
+		perf_close(&perf);
+
+	if (ujson_writer_file_close(out)) {
+		fprintf(stderr, "Failed to write '%s'\n", out_path);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+#endif
+
+#include "perf.h"
+
+#ifdef __linux__
+
+#define CACHE_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+	 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct perf_desc {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} descs[PERF_CNT_MAX] = {
+	[PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	[PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	[PERF_BRANCH_MISSES] = {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	[PERF_L1D_MISSES] = {"l1d_misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+	[PERF_LLC_MISSES] = {"llc_misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+};
+
+static int perf_event_open(struct perf_event_attr *attr)
+{
+	return syscall(__NR_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+int perf_open(struct perf *self)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < PERF_CNT_MAX; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+
+		attr.size = sizeof(attr);
+		attr.type = descs[i].type;
+		attr.config = descs[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		self->fds[i] = perf_event_open(&attr);
+		self->vals[i] = 0;
+
+		if (self->fds[i] >= 0)
+			ret++;
+	}
+
+	return ret;
+}
+
+void perf_start(struct perf *self)
+{
+	int i;
+
+	for (i = 0; i < PERF_CNT_MAX; i++) {
+		if (self->fds[i] < 0)
+			continue;
+
+		ioctl(self->fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(self->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void perf_stop(struct perf *self)
+{
+	uint64_t val;
+	int i;
+
+	for (i = 0; i < PERF_CNT_MAX; i++) {
+		if (self->fds[i] < 0)
+			continue;
+
+		ioctl(self->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+		if (read(self->fds[i], &val, sizeof(val)) == sizeof(val))
+			self->vals[i] += val;
+	}
+}
+
+const char *perf_name(enum perf_cnt cnt)
+{
+	return descs[cnt].name;
+}
+
+#else
+
+int perf_open(struct perf *self)
+{
+	int i;
+
+	for (i = 0; i < PERF_CNT_MAX; i++)
+		self->fds[i] = -1;
+
+	return 0;
+}
+
+void perf_start(struct perf *self)
+{
+	(void)self;
+}
+
+void perf_stop(struct perf *self)
+{
+	(void)self;
+}
+
+const char *perf_name(enum perf_cnt cnt)
+{
+	static const char *names[PERF_CNT_MAX] = {
+		"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"
+	};
+
+	return names[cnt];
+}
+
+#endif
+
+void perf_close(struct perf *self)
+{
+	int i;
+
+	for (i = 0; i < PERF_CNT_MAX; i++) {
+		if (self->fds[i] >= 0)
+			close(self->fds[i]);
+	}
+}
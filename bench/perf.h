@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Hardware performance counters for the benchmark.
+ *
+ * The counters are read with perf_event_open(), if a counter cannot be opened,
+ * e.g. because perf events are not permitted or supported by the hardware, it
+ * is marked as unavailable and the rest of the benchmark runs unaffected.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+enum perf_cnt {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_CNT_MAX,
+};
+
+struct perf {
+	int fds[PERF_CNT_MAX];
+	uint64_t vals[PERF_CNT_MAX];
+};
+
+/*
+ * Opens the counters, returns number of counters that were opened.
+ */
+int perf_open(struct perf *self);
+
+void perf_close(struct perf *self);
+
+/*
+ * Resets and starts the counters.
+ */
+void perf_start(struct perf *self);
+
+/*
+ * Stops the counters and adds the counter values to self->vals.
+ */
+void perf_stop(struct perf *self);
+
+/*
+ * Returns non-zero if the counter was opened successfully.
+ */
+static inline int perf_avail(struct perf *self, enum perf_cnt cnt)
+{
+	return self->fds[cnt] >= 0;
+}
+
+const char *perf_name(enum perf_cnt cnt);
+
+#endif /* PERF_H */
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Converts a JSON file to CBOR, prints the CBOR in hex and converts it back
+ * to JSON on stdout.
+ *
+ * If the file name contains 'hex' the file is an array of hex encoded CBOR
+ * documents that are converted to JSON instead, 'trunc' drops the last byte
+ * of the CBOR before it's converted back and 'drop' drops the password key
+ * when converting back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ujson.h>
+
+static int out_stdout(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	(void)self;
+
+	return fwrite(buf, buf_len, 1, stdout) != 1;
+}
+
+static const ujson_obj_attr drop_attrs[] = {
+	UJSON_OBJ_ATTR("password", UJSON_VOID),
+};
+
+static const ujson_obj drop_obj = {
+	.attrs = drop_attrs,
+	.attr_cnt = UJSON_ARRAY_SIZE(drop_attrs),
+};
+
+static struct ujson_transcode_opts opts;
+
+static void print_hex(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		printf("%02x", (unsigned char)buf[i]);
+
+		if (i % 32 == 31 || i + 1 == len)
+			printf("\n");
+	}
+}
+
+/*
+ * Readers allocated by the library allocate the CBOR container stack on
+ * demand, which is exercised by transcoding with a cursor forked from the
+ * stack reader when fork is set.
+ */
+static int cbor_to_json(const char *cbor, size_t len, int fork)
+{
+	ujson_writer writer = UJSON_WRITER_INIT(out_stdout, NULL);
+	ujson_cbor_stack stack;
+	ujson_reader reader = UJSON_READER_CBOR_INIT(cbor, len, 0, stack);
+	ujson_reader *cursor = &reader;
+	int ret;
+
+	writer.flags |= UJSON_WRITER_NONFINITE_NULL;
+
+	if (fork) {
+		cursor = ujson_reader_fork(&reader, ujson_reader_state_save(&reader));
+		if (!cursor)
+			return 1;
+	}
+
+	ret = ujson_transcode(cursor, &writer, &opts);
+
+	if (ujson_reader_err(cursor))
+		ujson_err_print(cursor);
+
+	if (fork)
+		ujson_reader_free(cursor);
+
+	return ret;
+}
+
+static int hex_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+static int hex_docs(ujson_reader *reader)
+{
+	char hex[1024], cbor[512];
+	ujson_val val = {.buf = hex, .buf_size = sizeof(hex)};
+	size_t i, len;
+	int ret = 0;
+
+	if (ujson_reader_start(reader) != UJSON_ARR)
+		return 1;
+
+	UJSON_ARR_FOREACH(reader, &val) {
+		if (val.type != UJSON_STR) {
+			ujson_err(reader, "Expected hex string");
+			break;
+		}
+
+		len = strlen(hex) / 2;
+
+		for (i = 0; i < len; i++)
+			cbor[i] = hex_val(hex[2*i]) << 4 | hex_val(hex[2*i+1]);
+
+		ret |= cbor_to_json(cbor, len, 0);
+	}
+
+	if (ujson_reader_err(reader)) {
+		ujson_err_print(reader);
+		return 1;
+	}
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	ujson_reader *reader;
+	ujson_writer *writer;
+	char *cbor;
+	size_t len;
+	int ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
+		return 1;
+	}
+
+	if (strstr(argv[1], "drop"))
+		opts.drop = &drop_obj;
+
+	reader = ujson_reader_load(argv[1]);
+	if (!reader)
+		return 1;
+
+	if (strstr(argv[1], "hex")) {
+		ret = hex_docs(reader);
+		ujson_reader_free(reader);
+		return ret;
+	}
+
+	writer = ujson_writer_mem_open(0);
+	if (!writer) {
+		ujson_reader_free(reader);
+		return 1;
+	}
+
+	writer->flags |= UJSON_WRITER_CBOR;
+
+	ret = ujson_transcode(reader, writer, NULL);
+
+	if (ujson_reader_err(reader))
+		ujson_err_print(reader);
+
+	ujson_reader_free(reader);
+
+	if (ujson_writer_mem_close(writer, &cbor, &len) || ret)
+		return 1;
+
+	print_hex(cbor, len);
+
+	if (strstr(argv[1], "trunc"))
+		len--;
+
+	ret = cbor_to_json(cbor, len, 1);
+
+	free(cbor);
+
+	return ret;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <stdio.h>
+#include <ujson.h>
+
+static struct ujson_obj_attr diag_attrs[] = {
+	UJSON_OBJ_ATTR("int", UJSON_INT),
+	UJSON_OBJ_ATTR("str", UJSON_STR),
+};
+
+static struct ujson_obj diag_obj = {
+	.attrs = diag_attrs,
+	.attr_cnt = UJSON_ARRAY_SIZE(diag_attrs)
+};
+
+int main(int argc, char *argv[])
+{
+	struct ujson_diag_entry entries[2];
+	struct ujson_diag diag = UJSON_DIAG_INIT(entries, UJSON_ARRAY_SIZE(entries));
+	struct ujson_reader *reader;
+	char sbuf[128];
+	struct ujson_val json = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
+		return 1;
+	}
+
+	reader = ujson_reader_load(argv[1]);
+	if (!reader)
+		return 1;
+
+	reader->diag = &diag;
+
+	if (ujson_reader_start(reader) == UJSON_OBJ) {
+		UJSON_OBJ_FOREACH_FILTER(reader, &json, &diag_obj, ujson_empty_obj) {
+			switch (json.type) {
+			case UJSON_INT:
+				printf("%s: %lli\n", json.id, json.val_int);
+			break;
+			case UJSON_STR:
+				printf("%s: %s\n", json.id, json.val_str);
+			break;
+			default:
+			break;
+			}
+		}
+	}
+
+	ujson_reader_finish(reader);
+	ujson_diag_print(reader);
+
+	printf("unexpected keys: %zu\n", diag.cnt[UJSON_DIAG_UNEXPECTED_KEY]);
+	printf("wrong types: %zu\n", diag.cnt[UJSON_DIAG_WRONG_TYPE]);
+
+	ujson_reader_free(reader);
+
+	return 0;
+}
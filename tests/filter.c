@@ -4,6 +4,8 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "../ujson.h"
 
 static struct ujson_obj_attr filter_attrs[] = {
@@ -126,13 +128,33 @@ static void dump_arr(struct ujson_reader *reader, unsigned int padd, const char
 int main(int argc, char *argv[])
 {
 	struct ujson_reader *reader;
+	char index_path[1024];
 
 	if (argc != 2) {
 		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
 		return 1;
 	}
 
-	reader = ujson_reader_load(argv[1]);
+	/*
+	 * Builds and saves the index on the first load and uses the saved one
+	 * on the second, all containers are indexed.
+	 */
+	if (strstr(argv[1], "index")) {
+		snprintf(index_path, sizeof(index_path), "%s.idx", argv[1]);
+		unlink(index_path);
+
+		reader = ujson_reader_load_indexed(argv[1], index_path, 1);
+		if (!reader)
+			return 1;
+
+		ujson_reader_free(reader);
+
+		reader = ujson_reader_load_indexed(argv[1], index_path, 1);
+		unlink(index_path);
+	} else {
+		reader = ujson_reader_load(argv[1]);
+	}
+
 	if (!reader)
 		return 1;
 
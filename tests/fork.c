@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Forks a cursor for each object and array in the top level container, walks
+ * the cursors concurrently from threads and checks that the result is the
+ * same as when a plain reader walks the same containers sequentially. The
+ * same is done for cursors forked from a segmented reader, which has to save
+ * the same states as the plain reader.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ujson.h>
+
+#define STATES_MAX 64
+
+static void copy_arr(ujson_reader *reader, ujson_writer *writer, const char *id);
+
+static void copy_obj(ujson_reader *reader, ujson_writer *writer, const char *id);
+
+static void copy_val(ujson_reader *reader, ujson_writer *writer,
+                     struct ujson_val *val, const char *id)
+{
+	switch (val->type) {
+	case UJSON_OBJ:
+		copy_obj(reader, writer, id);
+	break;
+	case UJSON_ARR:
+		copy_arr(reader, writer, id);
+	break;
+	case UJSON_STR:
+		ujson_str_add(writer, id, val->val_str);
+	break;
+	case UJSON_INT:
+		ujson_int64_add(writer, id, val->val_int);
+	break;
+	case UJSON_FLOAT:
+		ujson_float_add(writer, id, val->val_float);
+	break;
+	case UJSON_BOOL:
+		ujson_bool_add(writer, id, val->val_bool);
+	break;
+	case UJSON_NULL:
+		ujson_null_add(writer, id);
+	break;
+	case UJSON_VOID:
+	break;
+	}
+}
+
+static void copy_obj(ujson_reader *reader, ujson_writer *writer, const char *id)
+{
+	char sbuf[128];
+	struct ujson_val val = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+
+	ujson_obj_start(writer, id);
+
+	UJSON_OBJ_FOREACH(reader, &val)
+		copy_val(reader, writer, &val, val.id);
+
+	ujson_obj_finish(writer);
+}
+
+static void copy_arr(ujson_reader *reader, ujson_writer *writer, const char *id)
+{
+	char sbuf[128];
+	struct ujson_val val = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+
+	ujson_arr_start(writer, id);
+
+	UJSON_ARR_FOREACH(reader, &val)
+		copy_val(reader, writer, &val, NULL);
+
+	ujson_arr_finish(writer);
+}
+
+struct walk {
+	ujson_reader *reader;
+	pthread_t thread;
+	char *out;
+	size_t len;
+	char err[UJSON_ERR_MAX];
+};
+
+/*
+ * Walks a container the reader is positioned at.
+ */
+static void *walk(void *priv)
+{
+	struct walk *w = priv;
+	ujson_writer *writer = ujson_writer_mem_open(0);
+
+	if (!writer)
+		return NULL;
+
+	switch (ujson_reader_start(w->reader)) {
+	case UJSON_OBJ:
+		copy_obj(w->reader, writer, NULL);
+	break;
+	case UJSON_ARR:
+		copy_arr(w->reader, writer, NULL);
+	break;
+	default:
+	break;
+	}
+
+	ujson_writer_finish(writer);
+
+	strcpy(w->err, w->reader->err);
+
+	ujson_writer_mem_close(writer, &w->out, &w->len);
+
+	return NULL;
+}
+
+/*
+ * Saves states of objects and arrays in the top level container, both right
+ * after the container was returned and after it was skipped, i.e. once the
+ * reader has moved past it.
+ */
+static size_t save_states(ujson_reader *reader, ujson_reader_state *states)
+{
+	int (*first)(ujson_reader *self, struct ujson_val *res) = ujson_obj_first;
+	int (*next)(ujson_reader *self, struct ujson_val *res) = ujson_obj_next;
+	char sbuf[128];
+	struct ujson_val val = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+	size_t cnt = 0;
+
+	switch (ujson_reader_start(reader)) {
+	case UJSON_OBJ:
+	break;
+	case UJSON_ARR:
+		first = ujson_arr_first;
+		next = ujson_arr_next;
+	break;
+	default:
+		return 0;
+	}
+
+	for (first(reader, &val); ujson_val_valid(&val); next(reader, &val)) {
+		if (val.type != UJSON_OBJ && val.type != UJSON_ARR)
+			continue;
+
+		if (cnt < STATES_MAX)
+			states[cnt++] = ujson_reader_state_save(reader);
+
+		if (val.type == UJSON_OBJ)
+			ujson_obj_skip(reader);
+		else
+			ujson_arr_skip(reader);
+
+		if (cnt < STATES_MAX)
+			states[cnt++] = ujson_reader_state_save(reader);
+	}
+
+	return cnt;
+}
+
+/*
+ * Walks the containers at the saved states sequentially with the reader, the
+ * reader is reset before each walk so that an error does not carry over.
+ */
+static void walk_states(ujson_reader *reader, ujson_reader_state *states,
+                        size_t cnt, struct walk *exp)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		ujson_reader_reset(reader);
+		ujson_reader_state_load(reader, states[i]);
+		exp[i].reader = reader;
+		walk(&exp[i]);
+	}
+}
+
+/*
+ * Forks cursors from the reader, walks them concurrently and compares the
+ * results with the expected ones.
+ */
+static int check_fork(ujson_reader *reader, const char *type,
+                      const ujson_reader_state *exp_states,
+                      struct walk *exp, size_t exp_cnt)
+{
+	ujson_reader_state states[STATES_MAX];
+	struct walk res[STATES_MAX] = {};
+	size_t i, cnt;
+	int ret = 0;
+
+	cnt = save_states(reader, states);
+
+	if (cnt != exp_cnt) {
+		printf("Saved %zu states with %s reader, expected %zu\n",
+		       cnt, type, exp_cnt);
+		return 1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (states[i].off != exp_states[i].off ||
+		    states[i].depth != exp_states[i].depth) {
+			printf("State %zu:%u of %s reader differs from %zu:%u\n",
+			       states[i].off, states[i].depth, type,
+			       exp_states[i].off, exp_states[i].depth);
+			return 1;
+		}
+	}
+
+	/* Fork all cursors first, the threads then run concurrently */
+	for (i = 0; i < cnt; i++) {
+		res[i].reader = ujson_reader_fork(reader, states[i]);
+		if (!res[i].reader) {
+			printf("Failed to fork a %s reader\n", type);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < cnt; i++)
+		pthread_create(&res[i].thread, NULL, walk, &res[i]);
+
+	for (i = 0; i < cnt; i++) {
+		pthread_join(res[i].thread, NULL);
+
+		if (!res[i].out || exp[i].len != res[i].len ||
+		    memcmp(exp[i].out, res[i].out, exp[i].len)) {
+			printf("Output of %s cursor %zu differs\n", type, i);
+			ret = 1;
+		}
+
+		if (strcmp(exp[i].err, res[i].err)) {
+			printf("Error '%s' of %s cursor %zu differs from '%s'\n",
+			       res[i].err, type, i, exp[i].err);
+			ret = 1;
+		}
+
+		free(res[i].out);
+		ujson_reader_free(res[i].reader);
+	}
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	ujson_reader_state states[STATES_MAX];
+	struct walk exp[STATES_MAX] = {};
+	ujson_reader *reader, *iov_reader;
+	struct iovec iov[16];
+	size_t i, cnt, seg_size;
+	int ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
+		return 1;
+	}
+
+	reader = ujson_reader_load(argv[1]);
+	if (!reader)
+		return 1;
+
+	reader->err_print = NULL;
+
+	/* The expected results are from a sequential walk of a plain reader */
+	cnt = save_states(reader, states);
+	walk_states(reader, states, cnt, exp);
+
+	ujson_reader_reset(reader);
+
+	ret = check_fork(reader, "plain", states, exp, cnt);
+
+	/* Small segments so that the reader moves on while walking */
+	seg_size = reader->len / UJSON_ARRAY_SIZE(iov) + 1;
+
+	for (i = 0; i < UJSON_ARRAY_SIZE(iov); i++) {
+		size_t off = i * seg_size < reader->len ? i * seg_size : reader->len;
+		size_t len = reader->len - off < seg_size ? reader->len - off : seg_size;
+
+		iov[i].iov_base = (void *)(reader->json + off);
+		iov[i].iov_len = len;
+	}
+
+	iov_reader = ujson_reader_iov(iov, UJSON_ARRAY_SIZE(iov));
+	if (!iov_reader)
+		return 1;
+
+	iov_reader->err_print = NULL;
+
+	ret |= check_fork(iov_reader, "segmented", states, exp, cnt);
+
+	for (i = 0; i < cnt; i++)
+		free(exp[i].out);
+
+	ujson_reader_free(iov_reader);
+	ujson_reader_free(reader);
+
+	return ret;
+}
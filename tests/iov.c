@@ -0,0 +1,374 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Splits a JSON file into segments of different sizes, transcodes it with a
+ * segmented reader and checks that the result and errors are the same as for
+ * the file loaded into a single buffer. The same is done for stream readers
+ * reading the file and a pipe with different buffer sizes. Reader states
+ * saved while walking the segmented reader are checked as well.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ujson.h>
+
+struct res {
+	char *out;
+	size_t len;
+	char err[UJSON_ERR_MAX];
+};
+
+static int transcode(ujson_reader *reader, struct res *res)
+{
+	ujson_writer *writer = ujson_writer_mem_open(0);
+
+	if (!writer)
+		return 1;
+
+	ujson_transcode(reader, writer, NULL);
+
+	strcpy(res->err, reader->err);
+
+	return ujson_writer_mem_close(writer, &res->out, &res->len);
+}
+
+static int cmp_res(struct res *exp, struct res *res, size_t seg_size)
+{
+	int ret = 0;
+
+	if (exp->len != res->len || memcmp(exp->out, res->out, exp->len)) {
+		printf("Output differs for %zu byte segments\n", seg_size);
+		ret = 1;
+	}
+
+	if (strcmp(exp->err, res->err)) {
+		printf("Error '%s' differs from '%s' for %zu byte segments\n",
+		       res->err, exp->err, seg_size);
+		ret = 1;
+	}
+
+	free(res->out);
+
+	return ret;
+}
+
+static int state_cmp(ujson_reader *src, ujson_reader *reader,
+                     ujson_reader_state *state, size_t seg_size)
+{
+	ujson_reader_state exp = ujson_reader_state_save(src);
+
+	*state = ujson_reader_state_save(reader);
+
+	if (exp.off == state->off && exp.depth == state->depth)
+		return 0;
+
+	printf("State %zu:%u differs from %zu:%u for %zu byte segments\n",
+	       state->off, state->depth, exp.off, exp.depth, seg_size);
+
+	return 1;
+}
+
+/*
+ * Walks the top level container with the reader and the segmented reader in
+ * lockstep and checks that the saved states are the same after each member,
+ * i.e. after the json buffer has moved on. Then each saved state is loaded
+ * and has to point to an object or an array.
+ */
+static int check_states(ujson_reader *src, ujson_reader *reader, size_t seg_size)
+{
+	char sbuf[128], rbuf[128];
+	struct ujson_val sval = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+	struct ujson_val rval = UJSON_VAL_INIT(rbuf, sizeof(rbuf));
+	int (*first)(ujson_reader *self, struct ujson_val *res) = ujson_obj_first;
+	int (*next)(ujson_reader *self, struct ujson_val *res) = ujson_obj_next;
+	ujson_reader_state states[64];
+	size_t i, cnt = 0;
+	int ret = 0;
+
+	ujson_reader_reset(src);
+	ujson_reader_reset(reader);
+
+	switch (ujson_reader_start(src)) {
+	case UJSON_OBJ:
+	break;
+	case UJSON_ARR:
+		first = ujson_arr_first;
+		next = ujson_arr_next;
+	break;
+	default:
+		return 0;
+	}
+
+	ujson_reader_start(reader);
+
+	for (first(src, &sval), first(reader, &rval);
+	     ujson_val_valid(&sval) && ujson_val_valid(&rval) && !ret;
+	     next(src, &sval), next(reader, &rval)) {
+		if (sval.type == UJSON_OBJ) {
+			ujson_obj_skip(src);
+			ujson_obj_skip(reader);
+		} else if (sval.type == UJSON_ARR) {
+			ujson_arr_skip(src);
+			ujson_arr_skip(reader);
+		}
+
+		ret |= state_cmp(src, reader, &states[cnt], seg_size);
+
+		if (cnt < UJSON_ARRAY_SIZE(states) - 1)
+			cnt++;
+	}
+
+	/* Errors are checked by the transcoding, states can't be loaded then */
+	if (ujson_reader_err(reader))
+		return ret;
+
+	for (i = 0; i < cnt && !ret; i++) {
+		ujson_reader_state_load(reader, states[i]);
+
+		switch (ujson_next_type(reader)) {
+		case UJSON_OBJ:
+		case UJSON_ARR:
+		break;
+		default:
+			printf("State %zu does not point to a container for %zu byte segments\n",
+			       states[i].off, seg_size);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+static int check_iov(ujson_reader *src, struct res *exp, size_t seg_size)
+{
+	size_t i, cnt = (src->len + seg_size - 1) / seg_size;
+	struct iovec iov[cnt + 1];
+	ujson_reader *reader;
+	struct res res;
+	int ret;
+
+	/* Copy each segment so that reads past the segment end are caught */
+	for (i = 0; i < cnt; i++) {
+		size_t len = src->len - i * seg_size;
+
+		if (len > seg_size)
+			len = seg_size;
+
+		iov[i].iov_base = malloc(len);
+		iov[i].iov_len = len;
+		memcpy(iov[i].iov_base, src->json + i * seg_size, len);
+	}
+
+	/* An empty segment at the end has to be skipped */
+	iov[cnt].iov_base = NULL;
+	iov[cnt].iov_len = 0;
+
+	reader = ujson_reader_iov(iov, cnt + 1);
+	if (!reader)
+		return 1;
+
+	reader->err_print = NULL;
+
+	ret = transcode(reader, &res) || cmp_res(exp, &res, seg_size);
+
+	/* And the segments have to be parsed again after a reset */
+	ujson_reader_reset(reader);
+
+	ret |= transcode(reader, &res) || cmp_res(exp, &res, seg_size);
+
+	ret |= check_states(src, reader, seg_size);
+
+	ujson_reader_free(reader);
+
+	for (i = 0; i < cnt; i++)
+		free(iov[i].iov_base);
+
+	return ret;
+}
+
+static int check_reader(ujson_reader *reader, struct res *exp,
+                        size_t buf_size, const char *type)
+{
+	struct res res;
+	int ret;
+
+	if (!reader) {
+		printf("Failed to create %s reader\n", type);
+		return 1;
+	}
+
+	reader->err_print = NULL;
+
+	ret = transcode(reader, &res);
+	if (!ret && cmp_res(exp, &res, buf_size)) {
+		printf("With %s reader\n", type);
+		ret = 1;
+	}
+
+	ujson_reader_free(reader);
+
+	return ret;
+}
+
+static int check_stream(const char *path, ujson_reader *src,
+                        struct res *exp, size_t buf_size)
+{
+	int ret, fds[2];
+
+	ret = check_reader(ujson_reader_stream_open(path, buf_size, 0),
+	                   exp, buf_size, "stream");
+
+	ret |= check_reader(ujson_reader_stream_open(path, buf_size,
+	                                             UJSON_READER_STREAM_IO_URING),
+	                    exp, buf_size, "io_uring stream");
+
+	/* The test files are small enough to fit into the pipe buffer */
+	if (pipe(fds))
+		return 1;
+
+	if (write(fds[1], src->json, src->len) != (ssize_t)src->len)
+		ret = 1;
+
+	close(fds[1]);
+
+	ret |= check_reader(ujson_reader_stream_fd(fds[0], buf_size, 0),
+	                    exp, buf_size, "pipe stream");
+
+	close(fds[0]);
+
+	return ret;
+}
+
+struct scratch_use {
+	const char *doc;
+	size_t doc_len;
+	size_t last_base;
+	size_t values;
+	size_t bytes;
+};
+
+static void scratch_walk(ujson_reader *reader, struct scratch_use *use, enum ujson_type type)
+{
+	int (*first)(ujson_reader *self, struct ujson_val *res) = ujson_obj_first;
+	int (*next)(ujson_reader *self, struct ujson_val *res) = ujson_obj_next;
+	char sbuf[128];
+	struct ujson_val val = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+
+	if (type == UJSON_ARR) {
+		first = ujson_arr_first;
+		next = ujson_arr_next;
+	}
+
+	for (first(reader, &val); ujson_val_valid(&val); next(reader, &val)) {
+		int in_place = reader->json >= use->doc &&
+		               reader->json < use->doc + use->doc_len;
+
+		if (!in_place) {
+			use->values++;
+
+			if (reader->base != use->last_base) {
+				use->bytes += reader->len;
+				use->last_base = reader->base;
+			}
+		}
+
+		if (val.type == UJSON_OBJ || val.type == UJSON_ARR)
+			scratch_walk(reader, use, val.type);
+	}
+}
+
+/*
+ * Only tokens that cross a segment boundary may be parsed from the scratch
+ * buffer, the rest of the segments has to be parsed in place.
+ */
+static int check_scratch(void)
+{
+	static char doc[64 * 1024];
+	size_t i, len = 0, cnt, seg_size = 1000;
+	struct scratch_use use = {.doc = doc, .last_base = (size_t)-1};
+	ujson_reader *reader;
+	int ret = 0;
+
+	len += sprintf(doc, "[");
+
+	for (i = 0; len < sizeof(doc) - 128; i++) {
+		len += sprintf(doc + len, "%s{\"id\": %zu, \"name\": \"item %zu\", "
+		               "\"vals\": [1.5, %zu, true]}", i ? ", " : "", i, i, i * 7);
+	}
+
+	len += sprintf(doc + len, "]");
+	use.doc_len = len;
+
+	cnt = (len + seg_size - 1) / seg_size;
+
+	struct iovec iov[cnt];
+
+	for (i = 0; i < cnt; i++) {
+		iov[i].iov_base = doc + i * seg_size;
+		iov[i].iov_len = len - i * seg_size < seg_size ? len - i * seg_size : seg_size;
+	}
+
+	reader = ujson_reader_iov(iov, cnt);
+	if (!reader)
+		return 1;
+
+	if (ujson_reader_start(reader) == UJSON_ARR)
+		scratch_walk(reader, &use, UJSON_ARR);
+
+	if (ujson_reader_err(reader)) {
+		ujson_err_print(reader);
+		ret = 1;
+	}
+
+	/* At most one value per boundary, each token shorter than 32 bytes */
+	if (use.values > cnt || use.bytes > cnt * 64) {
+		printf("%zu values and %zu bytes parsed from scratch for %zu segments\n",
+		       use.values, use.bytes, cnt);
+		ret = 1;
+	}
+
+	ujson_reader_free(reader);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t seg_sizes[] = {1, 2, 3, 5, 7, 16, 64};
+	ujson_reader *reader;
+	struct res exp;
+	size_t i;
+	int ret = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
+		return 1;
+	}
+
+	if (check_scratch())
+		return 1;
+
+	reader = ujson_reader_load(argv[1]);
+	if (!reader)
+		return 1;
+
+	reader->err_print = NULL;
+
+	if (transcode(reader, &exp))
+		return 1;
+
+	for (i = 0; i < UJSON_ARRAY_SIZE(seg_sizes); i++) {
+		ret |= check_iov(reader, &exp, seg_sizes[i]);
+		ret |= check_stream(argv[1], reader, &exp, seg_sizes[i]);
+	}
+
+	free(exp.out);
+	ujson_reader_free(reader);
+
+	return ret;
+}
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Checks number to string conversions against the libc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <ujson.h>
+
+static uint64_t rnd_state = 0x1234;
+
+static uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+
+	return rnd_state;
+}
+
+static int check_u64(uint64_t val)
+{
+	char buf[UJSON_INT_STR_MAX+1], exp[64];
+	size_t len = ujson_u64_to_str(val, buf);
+
+	buf[len] = 0;
+	snprintf(exp, sizeof(exp), "%" PRIu64, val);
+
+	if (strcmp(buf, exp)) {
+		printf("u64 '%s' expected '%s'\n", buf, exp);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_i64(int64_t val)
+{
+	char buf[UJSON_INT_STR_MAX+1], exp[64];
+	size_t len = ujson_i64_to_str(val, buf);
+
+	buf[len] = 0;
+	snprintf(exp, sizeof(exp), "%" PRIi64, val);
+
+	if (strcmp(buf, exp)) {
+		printf("i64 '%s' expected '%s'\n", buf, exp);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_ints(void)
+{
+	uint64_t pow = 1;
+	int i, fail = 0;
+
+	fail |= check_u64(0);
+	fail |= check_u64(UINT64_MAX);
+	fail |= check_i64(INT64_MIN);
+	fail |= check_i64(INT64_MAX);
+
+	for (i = 0; i < 20; i++) {
+		fail |= check_u64(pow - 1);
+		fail |= check_u64(pow);
+		fail |= check_u64(pow + 1);
+		fail |= check_i64(-(int64_t)pow);
+		pow *= 10;
+	}
+
+	for (i = 0; i < 100000; i++) {
+		uint64_t val = rnd() >> (rnd() % 64);
+
+		fail |= check_u64(val);
+		fail |= check_i64(val);
+		fail |= check_i64(-(int64_t)val);
+	}
+
+	return fail;
+}
+
+static int check_double(double val)
+{
+	char buf[UJSON_FLOAT_STR_MAX+1];
+	size_t len = ujson_double_to_str(val, buf);
+	double back;
+
+	buf[len] = 0;
+	back = strtod(buf, NULL);
+
+	if (memcmp(&back, &val, sizeof(val))) {
+		printf("double '%s' parsed back as %.17g expected %.17g\n",
+		       buf, back, val);
+		return 1;
+	}
+
+	if (len > UJSON_FLOAT_STR_MAX) {
+		printf("double '%s' too long\n", buf);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_doubles(void)
+{
+	static const double vals[] = {
+		0.0, -0.0, 1.0, -1.0, 0.1, 0.2, 0.3, 1.5, 100, 1e21, 1e22, 1e-6,
+		1e-7, 123456.789, 5e-324, 2.2250738585072014e-308,
+		1.7976931348623157e308, 9007199254740993.0, 0.1 + 0.2,
+	};
+	unsigned int i;
+	int fail = 0;
+
+	for (i = 0; i < sizeof(vals)/sizeof(*vals); i++)
+		fail |= check_double(vals[i]);
+
+	for (i = 0; i < 1000000; i++) {
+		uint64_t bits = rnd();
+		double val;
+
+		memcpy(&val, &bits, sizeof(val));
+
+		if (!isfinite(val))
+			continue;
+
+		fail |= check_double(val);
+	}
+
+	return fail;
+}
+
+static int check_double_str(double val, const char *exp)
+{
+	char buf[UJSON_FLOAT_STR_MAX+1];
+	size_t len = ujson_double_to_str(val, buf);
+
+	buf[len] = 0;
+
+	if (strcmp(buf, exp)) {
+		printf("double '%s' expected '%s'\n", buf, exp);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_double_strs(void)
+{
+	int fail = 0;
+
+	fail |= check_double_str(0, "0.0");
+	fail |= check_double_str(-0.0, "-0.0");
+	fail |= check_double_str(1, "1.0");
+	fail |= check_double_str(0.1, "0.1");
+	fail |= check_double_str(-2.5, "-2.5");
+	fail |= check_double_str(0.1 + 0.2, "0.30000000000000004");
+	fail |= check_double_str(1e20, "100000000000000000000.0");
+	fail |= check_double_str(1e21, "1e21");
+	fail |= check_double_str(1e-6, "0.000001");
+	fail |= check_double_str(1e-7, "1e-7");
+	fail |= check_double_str(1.5e300, "1.5e300");
+	fail |= check_double_str(5e-324, "5e-324");
+
+	return fail;
+}
+
+int main(void)
+{
+	int fail = 0;
+
+	fail |= check_ints();
+	fail |= check_double_strs();
+	fail |= check_doubles();
+
+	return fail;
+}
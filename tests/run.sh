@@ -8,6 +8,10 @@ echo "Running tests..."
 for i in *.json; do
 	case $i in
 	filter*) BINARY=filter;;
+	diag*) BINARY=diag;;
+	write*) BINARY=write;;
+	transcode*) BINARY=transcode;;
+	cbor*) BINARY=cbor;;
 	*) BINARY=dump;;
 	esac
 
@@ -53,6 +57,49 @@ for i in arr_obj.json obj_obj.json str_esc.json; do
 	fi
 done
 
+for i in arr_mixed.json obj_obj.json str_esc.json str_esc_ucode.json \
+         num_mixed.json float01.json whitespaces.json err_lit01.json \
+         str_esc_ucode_err01.json transcode_ndjson_drop_compact.json \
+         write_ascii.json; do
+	if ! ./iov $i; then
+		echo "************** iov $i failed ***************"
+		failed=$((failed+1))
+	else
+		passed=$((passed+1))
+	fi
+done
+
+for i in arr_obj.json arr_mixed.json obj_obj.json transcode01.json \
+         write_key.json filter_index01.json; do
+	if ! ./fork $i; then
+		echo "************** fork $i failed ***************"
+		failed=$((failed+1))
+	else
+		passed=$((passed+1))
+	fi
+done
+
+if ./num; then
+	passed=$((passed+1))
+else
+	echo "************** num failed ***************"
+	failed=$((failed+1))
+fi
+
+if ./utf; then
+	passed=$((passed+1))
+else
+	echo "************** utf failed ***************"
+	failed=$((failed+1))
+fi
+
+if ./stats; then
+	passed=$((passed+1))
+else
+	echo "************** stats failed ***************"
+	failed=$((failed+1))
+fi
+
 echo
 
 rm stdout.out stderr.out
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Checks the reader statistics. This test is linked against the library
+ * sources compiled with UJSON_READER_STATS, see the Makefile.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ujson.h>
+
+static const char json[] =
+	"{\"a\": 1, \"esc\": \"x\\ny\\u00e9\", "
+	"\"skip\": {\"b\": [1, \"zz\"], \"c\": 2.5}, "
+	"\"str\": \"hello\", \"z\": null}";
+
+static struct ujson_obj_attr attrs[] = {
+	UJSON_OBJ_ATTR("a", UJSON_INT),
+	UJSON_OBJ_ATTR("esc", UJSON_STR),
+	UJSON_OBJ_ATTR("str", UJSON_STR),
+};
+
+static struct ujson_obj obj = {
+	.attrs = attrs,
+	.attr_cnt = UJSON_ARRAY_SIZE(attrs)
+};
+
+/*
+ * Expected output of ujson_reader_stats_print() for the json above.
+ *
+ * The "skip" and "z" values are parsed while skipped, that is one object, one
+ * array, two integers, one float, one string and a null. Only the "zz" string
+ * is passed, the "x\nyé" and "hello" are copied, the 'é' is two bytes in
+ * UTF-8. The skipped bytes include the space after the colon, that is
+ * ' {"b": [1, "zz"], "c": 2.5}' and ' null'.
+ */
+static const char *const exp_lines[] = {
+	"Bytes consumed: 92",
+	"Values integer: 2",
+	"Values float: 1",
+	"Values boolean: 0",
+	"Values null: 1",
+	"Values string: 3",
+	"Values object: 1",
+	"Values array: 1",
+	"String bytes copied: 10",
+	"String bytes passed: 2",
+	"Escapes decoded: 2",
+	"Keys looked up: 5",
+	"Keys matched: 3",
+	"Keys skipped: 2",
+	"Bytes skipped: 32",
+	"Max depth: 3",
+};
+
+struct lines {
+	size_t cnt;
+	int failed;
+};
+
+static void check_line(void *priv, const char *line)
+{
+	struct lines *lines = priv;
+
+	if (lines->cnt >= UJSON_ARRAY_SIZE(exp_lines)) {
+		printf("Unexpected line '%s'\n", line);
+		lines->failed = 1;
+		return;
+	}
+
+	if (strcmp(line, exp_lines[lines->cnt])) {
+		printf("Line '%s' differs from '%s'\n", line, exp_lines[lines->cnt]);
+		lines->failed = 1;
+	}
+
+	lines->cnt++;
+}
+
+int main(void)
+{
+	ujson_reader reader = UJSON_READER_INIT(json, sizeof(json) - 1, 0);
+	struct lines lines = {};
+	char sbuf[128];
+	struct ujson_val val = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+	int ret = 0;
+
+	if (ujson_reader_start(&reader) != UJSON_OBJ) {
+		printf("Expected an object\n");
+		return 1;
+	}
+
+	UJSON_OBJ_FOREACH_FILTER(&reader, &val, &obj, NULL) {
+		switch (val.idx) {
+		case 0:
+			if (val.val_int != 1) {
+				printf("Wrong value of 'a' %lli\n", val.val_int);
+				ret = 1;
+			}
+		break;
+		case 1:
+			if (strcmp(val.val_str, "x\ny\xc3\xa9")) {
+				printf("Wrong value of 'esc' '%s'\n", val.val_str);
+				ret = 1;
+			}
+		break;
+		case 2:
+			if (strcmp(val.val_str, "hello")) {
+				printf("Wrong value of 'str' '%s'\n", val.val_str);
+				ret = 1;
+			}
+		break;
+		}
+	}
+
+	if (ujson_reader_err(&reader)) {
+		ujson_err_print(&reader);
+		return 1;
+	}
+
+	reader.err_print = check_line;
+	reader.err_print_priv = &lines;
+
+	ujson_reader_stats_print(&reader);
+
+	if (lines.cnt != UJSON_ARRAY_SIZE(exp_lines)) {
+		printf("Got %zu lines, expected %zu\n",
+		       lines.cnt, UJSON_ARRAY_SIZE(exp_lines));
+		ret = 1;
+	}
+
+	return ret | lines.failed;
+}
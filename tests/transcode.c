@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Transcodes a JSON file to stdout.
+ *
+ * Options are enabled based on the file name, 'compact' minifies the output,
+ * 'drop' drops the password and secret keys and 'rename' renames keys.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ujson.h>
+
+static int out_stdout(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	(void)self;
+
+	return fwrite(buf, buf_len, 1, stdout) != 1;
+}
+
+static const ujson_obj_attr drop_attrs[] = {
+	UJSON_OBJ_ATTR("password", UJSON_VOID),
+	UJSON_OBJ_ATTR("secret", UJSON_VOID),
+};
+
+static const ujson_obj drop_obj = {
+	.attrs = drop_attrs,
+	.attr_cnt = UJSON_ARRAY_SIZE(drop_attrs),
+};
+
+static const ujson_rename renames[] = {
+	{"old", "new"},
+	{"usr", "user"},
+};
+
+int main(int argc, char *argv[])
+{
+	ujson_writer writer = UJSON_WRITER_INIT(out_stdout, NULL);
+	struct ujson_transcode_opts opts = {};
+	ujson_reader *reader;
+	int ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
+		return 1;
+	}
+
+	if (strstr(argv[1], "compact"))
+		writer.flags |= UJSON_WRITER_COMPACT;
+
+	if (strstr(argv[1], "drop"))
+		opts.drop = &drop_obj;
+
+	if (strstr(argv[1], "rename")) {
+		opts.rename = renames;
+		opts.rename_cnt = UJSON_ARRAY_SIZE(renames);
+	}
+
+	reader = ujson_reader_load(argv[1]);
+	if (!reader)
+		return 1;
+
+	ret = ujson_transcode(reader, &writer, &opts);
+
+	if (ujson_reader_err(reader))
+		ujson_err_print(reader);
+
+	ujson_reader_free(reader);
+
+	return ret;
+}
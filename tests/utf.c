@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Checks the block at a time UTF-8 functions against a character at a time
+ * reference on random valid and invalid strings at all alignments. Short
+ * strings are checked on exactly sized heap copies as well so that reads past
+ * the terminator are caught by the address sanitizer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ujson_utf.h>
+
+static uint64_t rnd_state = 0x1234;
+
+static uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+
+	return rnd_state;
+}
+
+static int8_t ref_chsz(const char *str)
+{
+	unsigned char ch = str[0];
+	int8_t i, len;
+
+	if (!ch)
+		return 0;
+
+	if (ch < 0x80)
+		return 1;
+
+	if (ch >= 0xc0 && ch < 0xe0)
+		len = 2;
+	else if (ch >= 0xe0 && ch < 0xf0)
+		len = 3;
+	else if (ch >= 0xf0 && ch < 0xf8)
+		len = 4;
+	else
+		return -1;
+
+	for (i = 1; i < len; i++) {
+		if (((unsigned char)str[i] & 0xc0) != 0x80)
+			return -1;
+	}
+
+	return len;
+}
+
+static size_t ref_strlen(const char *str)
+{
+	size_t cnt = 0;
+	int8_t len;
+
+	while ((len = ref_chsz(str)) > 0) {
+		str += len;
+		cnt++;
+	}
+
+	return cnt;
+}
+
+static const char *const pieces[] = {
+	"a", "z", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+	/* Invalid sequences */
+	"\x80", "\xff", "\xc3", "\xe2\x82",
+};
+
+static int check(const char *str, size_t len)
+{
+	size_t i, off, cnt = 0;
+
+	if (ujson_utf8_strlen(str) != ref_strlen(str)) {
+		printf("strlen %zu expected %zu\n",
+		       ujson_utf8_strlen(str), ref_strlen(str));
+		return 1;
+	}
+
+	for (i = 0; i <= len; i++) {
+		if (ujson_utf8_next_chsz(str, i) != ref_chsz(str + i)) {
+			printf("next_chsz at %zu failed\n", i);
+			return 1;
+		}
+	}
+
+	/* Walks back over the valid prefix */
+	for (off = 0; ref_chsz(str + off) > 0; cnt++)
+		off += ref_chsz(str + off);
+
+	while (off) {
+		int8_t chsz = ujson_utf8_prev_chsz(str, off);
+
+		if (chsz <= 0) {
+			printf("prev_chsz at %zu failed\n", off);
+			return 1;
+		}
+
+		off -= chsz;
+		cnt--;
+	}
+
+	if (cnt) {
+		printf("prev_chsz walked over wrong number of characters\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	char buf[1024 + 8];
+	unsigned int i;
+
+	for (i = 0; i < 100000; i++) {
+		size_t align = rnd() % 8, len = 0;
+		unsigned int n = rnd() % 200;
+		int invalid = !(rnd() % 4);
+		int ascii = rnd() % 2;
+
+		while (n-- && len < 1000) {
+			const char *piece = pieces[ascii ? 0 : rnd() % (invalid ? 9 : 5)];
+
+			strcpy(buf + align + len, piece);
+			len += strlen(piece);
+		}
+
+		buf[align + len] = 0;
+
+		if (check(buf + align, len))
+			return 1;
+
+		if (len < 64) {
+			char *dup = strdup(buf + align);
+			int ret;
+
+			if (!dup)
+				return 1;
+
+			ret = check(dup, len);
+			free(dup);
+
+			if (ret)
+				return 1;
+		}
+	}
+
+	return 0;
+}
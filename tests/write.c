@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/*
+ * Parses a JSON file and writes it back with the ujson writer.
+ *
+ * Writer options are enabled based on the file name, e.g. if the file name
+ * contains 'compact' the UJSON_WRITER_COMPACT flag is set.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ujson.h>
+
+static int out_stdout(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	(void)self;
+
+	return fwrite(buf, buf_len, 1, stdout) != 1;
+}
+
+/* Use prepared keys, enabled by 'key' in the file name */
+static int use_keys;
+
+/*
+ * Copy nested objects and arrays as raw JSON, enabled by 'raw' in the file
+ * name, with 'rawstr' strings are written as raw JSON fragments instead.
+ */
+static int use_raw;
+static int use_raw_str;
+
+/*
+ * Write strings with ujson_strn_add() including the null terminator, enabled
+ * by 'strn' in the file name.
+ */
+static int use_strn;
+
+static void write_raw(ujson_reader *reader, ujson_writer *writer,
+                      ujson_val *val, const char *id, const ujson_key *key)
+{
+	size_t start = reader->sub_off, end;
+
+	if (val->type == UJSON_OBJ)
+		ujson_obj_skip(reader);
+	else
+		ujson_arr_skip(reader);
+
+	end = reader->off;
+
+	while (end > start && isspace(reader->json[end - 1]))
+		end--;
+
+	if (key)
+		ujson_raw_add_key(writer, key, reader->json + start, end - start);
+	else
+		ujson_raw_add(writer, id, reader->json + start, end - start);
+}
+
+/*
+ * Write container entries, two at a time, into fragments that are joined into
+ * the parent writer, enabled by 'frag' in the file name.
+ */
+static int use_frag;
+
+static ujson_writer *frag_next(ujson_writer *writer, ujson_writer *frag, size_t cnt)
+{
+	if (!use_frag)
+		return writer;
+
+	if (cnt % 2)
+		return frag;
+
+	if (frag)
+		ujson_writer_fragment_join(writer, frag);
+	else
+		ujson_writer_fragment_join(writer, ujson_writer_fragment_open(writer, 0));
+
+	return ujson_writer_fragment_open(writer, 16);
+}
+
+static void frag_finish(ujson_writer *writer, ujson_writer *frag)
+{
+	if (use_frag && frag)
+		ujson_writer_fragment_join(writer, frag);
+}
+
+static void write_arr(ujson_reader *reader, ujson_writer *writer,
+                      const char *id, const ujson_key *key);
+
+static void write_obj(ujson_reader *reader, ujson_writer *writer,
+                      const char *id, const ujson_key *key);
+
+static void write_val(ujson_reader *reader, ujson_writer *writer,
+                      ujson_val *val, const char *id, const ujson_key *key)
+{
+	if (use_raw && writer->depth &&
+	    (val->type == UJSON_OBJ || val->type == UJSON_ARR)) {
+		write_raw(reader, writer, val, id, key);
+		return;
+	}
+
+	if (use_raw_str && val->type == UJSON_STR) {
+		ujson_raw_add(writer, id, val->val_str, strlen(val->val_str));
+		return;
+	}
+
+	switch (val->type) {
+	case UJSON_ARR:
+		write_arr(reader, writer, id, key);
+	break;
+	case UJSON_OBJ:
+		write_obj(reader, writer, id, key);
+	break;
+	case UJSON_INT:
+		if (key)
+			ujson_int_add_key(writer, key, val->val_int);
+		else
+			ujson_int_add(writer, id, val->val_int);
+	break;
+	case UJSON_FLOAT:
+		if (key)
+			ujson_float_add_key(writer, key, val->val_float);
+		else
+			ujson_float_add(writer, id, val->val_float);
+	break;
+	case UJSON_BOOL:
+		if (key)
+			ujson_bool_add_key(writer, key, val->val_bool);
+		else
+			ujson_bool_add(writer, id, val->val_bool);
+	break;
+	case UJSON_NULL:
+		if (key)
+			ujson_null_add_key(writer, key);
+		else
+			ujson_null_add(writer, id);
+	break;
+	case UJSON_STR:
+		if (use_strn)
+			ujson_strn_add(writer, id, id ? strlen(id) : 0,
+			               val->val_str, strlen(val->val_str) + 1);
+		else if (key)
+			ujson_str_add_key(writer, key, val->val_str);
+		else
+			ujson_str_add(writer, id, val->val_str);
+	break;
+	case UJSON_VOID:
+	break;
+	}
+}
+
+static void write_obj(ujson_reader *reader, ujson_writer *writer,
+                      const char *id, const ujson_key *key)
+{
+	char sbuf[1024];
+	ujson_val json = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+	ujson_writer *frag = NULL;
+	size_t cnt = 0;
+
+	if (key)
+		ujson_obj_start_key(writer, key);
+	else
+		ujson_obj_start(writer, id);
+
+	UJSON_OBJ_FOREACH(reader, &json) {
+		frag = frag_next(writer, frag, cnt++);
+
+		if (use_keys) {
+			ujson_key json_key = ujson_key_prepare(json.id);
+
+			write_val(reader, frag, &json, NULL, &json_key);
+		} else {
+			write_val(reader, frag, &json, json.id, NULL);
+		}
+	}
+
+	frag_finish(writer, frag);
+
+	ujson_obj_finish(writer);
+}
+
+static void write_arr(ujson_reader *reader, ujson_writer *writer,
+                      const char *id, const ujson_key *key)
+{
+	char sbuf[1024];
+	ujson_val json = UJSON_VAL_INIT(sbuf, sizeof(sbuf));
+	ujson_writer *frag = NULL;
+	size_t cnt = 0;
+
+	if (key)
+		ujson_arr_start_key(writer, key);
+	else
+		ujson_arr_start(writer, id);
+
+	UJSON_ARR_FOREACH(reader, &json) {
+		frag = frag_next(writer, frag, cnt++);
+		write_val(reader, frag, &json, NULL, NULL);
+	}
+
+	frag_finish(writer, frag);
+
+	ujson_arr_finish(writer);
+}
+
+static void write_json(ujson_reader *reader, ujson_writer *writer, int flags)
+{
+	ujson_val val = {};
+
+	writer->flags |= flags;
+
+	ujson_reader_reset(reader);
+	val.type = ujson_reader_start(reader);
+	write_val(reader, writer, &val, NULL, NULL);
+	ujson_writer_finish(writer);
+}
+
+/*
+ * Writes the JSON with the memory writers and checks that the measured
+ * length matches.
+ */
+static int write_mem(ujson_reader *reader, int flags)
+{
+	ujson_writer *writer;
+	size_t len, measured_len;
+	char *buf;
+
+	writer = ujson_writer_measure_open();
+	if (!writer)
+		return 1;
+
+	write_json(reader, writer, flags);
+
+	if (ujson_writer_mem_close(writer, NULL, &measured_len))
+		return 1;
+
+	/* Start small so that the buffer has to be grown */
+	writer = ujson_writer_mem_open(16);
+	if (!writer)
+		return 1;
+
+	write_json(reader, writer, flags);
+
+	if (ujson_writer_mem_close(writer, &buf, &len))
+		return 1;
+
+	if (len != measured_len || strlen(buf) != len) {
+		fprintf(stderr, "Measured length %zu, written %zu\n",
+		        measured_len, len);
+		free(buf);
+		return 1;
+	}
+
+	char fixed_buf[len];
+
+	writer = ujson_writer_mem_open_fixed(fixed_buf, len);
+	if (!writer)
+		return 1;
+
+	write_json(reader, writer, flags);
+
+	if (ujson_writer_mem_close(writer, NULL, &len) ||
+	    len != measured_len || memcmp(buf, fixed_buf, len)) {
+		fprintf(stderr, "Fixed buffer writer failed\n");
+		free(buf);
+		return 1;
+	}
+
+	fputs(buf, stdout);
+	free(buf);
+
+	return 0;
+}
+
+/*
+ * Writes the JSON with a file writer with a small buffer so that long strings
+ * are batched with the buffer content and prints the file.
+ */
+static int write_file(ujson_reader *reader, const char *path, int flags,
+                      enum ujson_writer_file_flags file_flags)
+{
+	char tmp_path[strlen(path) + 5];
+	ujson_writer *writer;
+	char buf[1024];
+	size_t len;
+	FILE *f;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	writer = ujson_writer_file_open_ex(tmp_path, 64, file_flags);
+	if (!writer)
+		return 1;
+
+	/* The buffer is flushed on close */
+	write_json(reader, writer, flags | UJSON_WRITER_FINISH_NO_FLUSH);
+
+	if (ujson_writer_file_close(writer))
+		return 1;
+
+	f = fopen(tmp_path, "r");
+	if (!f)
+		return 1;
+
+	while ((len = fread(buf, 1, sizeof(buf), f)))
+		fwrite(buf, 1, len, stdout);
+
+	fclose(f);
+	unlink(tmp_path);
+
+	return 0;
+}
+
+/*
+ * Writes the JSON into a gzip file, which is then loaded and written to
+ * stdout. Uncompressed file is written if gzip support is not compiled in.
+ */
+static int write_gz(ujson_reader *reader, const char *path, int flags)
+{
+	ujson_writer stdout_writer = UJSON_WRITER_INIT(out_stdout, NULL);
+	char tmp_path[strlen(path) + 5];
+	ujson_writer *writer;
+	int gz = 1, ret;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	writer = ujson_writer_gz_open(tmp_path, 9);
+	if (!writer && errno == ENOSYS) {
+		writer = ujson_writer_file_open(tmp_path);
+		gz = 0;
+	}
+
+	if (!writer)
+		return 1;
+
+	write_json(reader, writer, flags);
+
+	ret = gz ? ujson_writer_gz_close(writer) : ujson_writer_file_close(writer);
+	if (ret)
+		return 1;
+
+	reader = ujson_reader_load_gz(tmp_path);
+	unlink(tmp_path);
+	if (!reader)
+		return 1;
+
+	write_json(reader, &stdout_writer, flags);
+	ujson_reader_free(reader);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	ujson_writer writer = UJSON_WRITER_INIT(out_stdout, NULL);
+	ujson_reader *reader;
+	ujson_val val = {};
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s foo.json\n", argv[0]);
+		return 1;
+	}
+
+	if (strstr(argv[1], "compact"))
+		writer.flags |= UJSON_WRITER_COMPACT;
+
+	if (strstr(argv[1], "nospace"))
+		writer.flags |= UJSON_WRITER_NO_COLON_SPACE;
+
+	if (strstr(argv[1], "slash"))
+		writer.flags |= UJSON_WRITER_ESC_SLASH;
+
+	if (strstr(argv[1], "ascii"))
+		writer.flags |= UJSON_WRITER_ASCII;
+
+	if (strstr(argv[1], "tab"))
+		writer.indent_ch = '\t';
+
+	if (strstr(argv[1], "indent4"))
+		writer.indent = 4;
+
+	if (strstr(argv[1], "key"))
+		use_keys = 1;
+
+	if (strstr(argv[1], "strn"))
+		use_strn = 1;
+
+	if (strstr(argv[1], "frag"))
+		use_frag = 1;
+
+	if (strstr(argv[1], "rawstr")) {
+		writer.flags |= UJSON_WRITER_RAW_VALIDATE;
+		use_raw_str = 1;
+	} else if (strstr(argv[1], "raw")) {
+		writer.flags |= UJSON_WRITER_RAW_VALIDATE;
+		use_raw = 1;
+	}
+
+	reader = ujson_reader_load(argv[1]);
+	if (!reader)
+		return 1;
+
+	if (strstr(argv[1], "mem")) {
+		int ret = write_mem(reader, writer.flags);
+
+		ujson_reader_free(reader);
+		return ret;
+	}
+
+	if (strstr(argv[1], "gz")) {
+		int ret = write_gz(reader, argv[1], writer.flags);
+
+		ujson_reader_free(reader);
+		return ret;
+	}
+
+	if (strstr(argv[1], "file")) {
+		int ret = write_file(reader, argv[1], writer.flags,
+		                     strstr(argv[1], "uring") ?
+		                     UJSON_WRITER_FILE_IO_URING : 0);
+
+		ujson_reader_free(reader);
+		return ret;
+	}
+
+	val.type = ujson_reader_start(reader);
+	write_val(reader, &writer, &val, NULL, NULL);
+
+	ujson_reader_finish(reader);
+	ujson_writer_finish(&writer);
+	ujson_reader_free(reader);
+
+	return 0;
+}
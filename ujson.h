@@ -7,7 +7,9 @@
 #define UJSON_H
 
 #include <ujson_common.h>
+#include <ujson_num.h>
 #include <ujson_reader.h>
 #include <ujson_writer.h>
+#include <ujson_transcode.h>
 
 #endif /* UJSON_H */
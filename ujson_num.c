@@ -0,0 +1,435 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <string.h>
+#include <math.h>
+#include <ujson_num.h>
+
+static const char digit_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static unsigned int u64_digits(uint64_t val)
+{
+	unsigned int digits = 1;
+
+	for (;;) {
+		if (val < 10)
+			return digits;
+		if (val < 100)
+			return digits + 1;
+		if (val < 1000)
+			return digits + 2;
+		if (val < 10000)
+			return digits + 3;
+
+		val /= 10000;
+		digits += 4;
+	}
+}
+
+size_t ujson_u64_to_str(uint64_t val, char *buf)
+{
+	unsigned int len = u64_digits(val);
+	char *pos = buf + len;
+
+	while (val >= 100) {
+		unsigned int idx = (val % 100) * 2;
+
+		val /= 100;
+		pos -= 2;
+		memcpy(pos, digit_pairs + idx, 2);
+	}
+
+	if (val < 10) {
+		*--pos = '0' + val;
+	} else {
+		pos -= 2;
+		memcpy(pos, digit_pairs + val * 2, 2);
+	}
+
+	return len;
+}
+
+size_t ujson_i64_to_str(int64_t val, char *buf)
+{
+	if (val >= 0)
+		return ujson_u64_to_str(val, buf);
+
+	buf[0] = '-';
+
+	/* Negate in unsigned so that INT64_MIN does not overflow */
+	return ujson_u64_to_str(-(uint64_t)val, buf + 1) + 1;
+}
+
+/*
+ * Shortest round-trip double to string conversion, an implementation of the
+ * Grisu2 algorithm by Florian Loitsch, "Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers", PLDI 2010.
+ *
+ * The output is guaranteed to be parsed back to the same double and is the
+ * shortest such string in the vast majority of cases.
+ */
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3ff + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK 0x7ff0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000fffffffffffffULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+/* A floating point number f * 2^e */
+struct diy_fp {
+	uint64_t f;
+	int e;
+};
+
+/* Normalized 10^k for k = -348, -340, ..., 340 */
+static const uint64_t cached_powers_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+	0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+	0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+	0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+	0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+	0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+	0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+	0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+	0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+	0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+	0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+	0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+	0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+	0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+	0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+	0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+	0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+	0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+	0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+	0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+	0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+	0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+static struct diy_fp diy_fp_from_double(double d)
+{
+	struct diy_fp ret;
+	uint64_t u;
+	int biased_e;
+
+	memcpy(&u, &d, sizeof(u));
+
+	biased_e = (u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE;
+	ret.f = u & DP_SIGNIFICAND_MASK;
+
+	if (biased_e) {
+		ret.f += DP_HIDDEN_BIT;
+		ret.e = biased_e - DP_EXPONENT_BIAS;
+	} else {
+		ret.e = DP_MIN_EXPONENT + 1;
+	}
+
+	return ret;
+}
+
+static struct diy_fp diy_fp_mul(struct diy_fp x, struct diy_fp y)
+{
+	unsigned __int128 p = (unsigned __int128)x.f * y.f;
+	struct diy_fp ret = {
+		.f = p >> 64,
+		.e = x.e + y.e + 64,
+	};
+
+	/* Round */
+	if ((uint64_t)p & (1ULL<<63))
+		ret.f++;
+
+	return ret;
+}
+
+static struct diy_fp diy_fp_normalize(struct diy_fp x)
+{
+	int s = __builtin_clzll(x.f);
+
+	x.f <<= s;
+	x.e -= s;
+
+	return x;
+}
+
+static void diy_fp_boundaries(struct diy_fp v, struct diy_fp *minus,
+                              struct diy_fp *plus)
+{
+	struct diy_fp pl = {.f = (v.f << 1) + 1, .e = v.e - 1};
+	struct diy_fp mi;
+
+	while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+		pl.f <<= 1;
+		pl.e--;
+	}
+
+	pl.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+	pl.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+	/* The lower boundary is closer if v is a power of two */
+	if (v.f == DP_HIDDEN_BIT) {
+		mi.f = (v.f << 2) - 1;
+		mi.e = v.e - 2;
+	} else {
+		mi.f = (v.f << 1) - 1;
+		mi.e = v.e - 1;
+	}
+
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	*plus = pl;
+	*minus = mi;
+}
+
+static struct diy_fp cached_power(int e, int *k)
+{
+	/* dk = (-61 - e) * log10(2) + 347, rounded up */
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int ik = dk;
+	unsigned int idx;
+
+	if (dk - ik > 0.0)
+		ik++;
+
+	idx = (ik >> 3) + 1;
+
+	/* Decimal exponent of the cached power */
+	*k = -(-348 + (int)(idx << 3));
+
+	struct diy_fp ret = {
+		.f = cached_powers_f[idx],
+		.e = cached_powers_e[idx],
+	};
+
+	return ret;
+}
+
+static unsigned int u32_digits(uint32_t n)
+{
+	unsigned int i;
+
+	for (i = 1; i < 10; i++) {
+		if (n < pow10_u64[i])
+			return i;
+	}
+
+	return 10;
+}
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < wp_w ||
+	        wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static int digit_gen(struct diy_fp w, struct diy_fp mp, uint64_t delta,
+                     char *buf, int *k)
+{
+	struct diy_fp one = {.f = 1ULL << -mp.e, .e = mp.e};
+	uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = mp.f >> -one.e;
+	uint64_t p2 = mp.f & (one.f - 1);
+	int kappa = u32_digits(p1);
+	int len = 0;
+
+	while (kappa > 0) {
+		uint32_t d = p1 / pow10_u64[kappa - 1];
+
+		p1 %= pow10_u64[kappa - 1];
+
+		if (d || len)
+			buf[len++] = '0' + d;
+
+		kappa--;
+
+		uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+
+		if (tmp <= delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, tmp,
+			            pow10_u64[kappa] << -one.e, wp_w);
+			return len;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+
+		char d = p2 >> -one.e;
+
+		if (d || len)
+			buf[len++] = '0' + d;
+
+		p2 &= one.f - 1;
+		kappa--;
+
+		if (p2 < delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, p2, one.f,
+			            wp_w * (-kappa < 20 ? pow10_u64[-kappa] : 0));
+			return len;
+		}
+	}
+}
+
+/*
+ * Produces a digit string, usually the shortest one, and a decimal exponent k
+ * so that the value is digits * 10^k.
+ */
+static int grisu2(double val, char *buf, int *k)
+{
+	struct diy_fp v = diy_fp_from_double(val);
+	struct diy_fp w_m, w_p, c_mk, w, wp, wm;
+
+	diy_fp_boundaries(v, &w_m, &w_p);
+
+	c_mk = cached_power(w_p.e, k);
+	w = diy_fp_mul(diy_fp_normalize(v), c_mk);
+	wp = diy_fp_mul(w_p, c_mk);
+	wm = diy_fp_mul(w_m, c_mk);
+
+	wm.f++;
+	wp.f--;
+
+	return digit_gen(w, wp, wp.f - wm.f, buf, k);
+}
+
+static size_t write_exp(int k, char *buf)
+{
+	char *pos = buf;
+
+	if (k < 0) {
+		*pos++ = '-';
+		k = -k;
+	}
+
+	return pos - buf + ujson_u64_to_str(k, pos);
+}
+
+/*
+ * Formats digits * 10^k as a JSON number. Numbers with up to 21 integral
+ * digits and numbers down to 1e-6 are written without exponent.
+ */
+static size_t prettify(char *buf, int len, int k)
+{
+	int kk = len + k;
+	int i;
+
+	if (k >= 0 && kk <= 21) {
+		/* 1234e7 -> 12340000000.0 */
+		for (i = len; i < kk; i++)
+			buf[i] = '0';
+
+		buf[kk] = '.';
+		buf[kk + 1] = '0';
+
+		return kk + 2;
+	}
+
+	if (kk > 0 && kk <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memmove(buf + kk + 1, buf + kk, len - kk);
+		buf[kk] = '.';
+
+		return len + 1;
+	}
+
+	if (kk > -6 && kk <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		int off = 2 - kk;
+
+		memmove(buf + off, buf, len);
+		buf[0] = '0';
+		buf[1] = '.';
+
+		for (i = 2; i < off; i++)
+			buf[i] = '0';
+
+		return len + off;
+	}
+
+	if (len == 1) {
+		/* 1e30 */
+		buf[1] = 'e';
+
+		return 2 + write_exp(kk - 1, buf + 2);
+	}
+
+	/* 1234e30 -> 1.234e33 */
+	memmove(buf + 2, buf + 1, len - 1);
+	buf[1] = '.';
+	buf[len + 1] = 'e';
+
+	return len + 2 + write_exp(kk - 1, buf + len + 2);
+}
+
+size_t ujson_double_to_str(double val, char *buf)
+{
+	size_t sign = 0;
+	int len, k;
+
+	if (signbit(val)) {
+		buf[0] = '-';
+		buf++;
+		sign = 1;
+		val = -val;
+	}
+
+	if (val == 0) {
+		memcpy(buf, "0.0", 3);
+		return sign + 3;
+	}
+
+	len = grisu2(val, buf, &k);
+
+	return sign + prettify(buf, len, k);
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/**
+ * @file ujson_num.h
+ * @brief Number to string conversions.
+ */
+
+#ifndef UJSON_NUM_H
+#define UJSON_NUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** @brief A buffer size large enough for any 64bit integer including sign. */
+#define UJSON_INT_STR_MAX 21
+
+/**
+ * @brief Converts an unsigned integer into a decimal string.
+ *
+ * The digits are produced two at a time with a lookup table. The string is
+ * not null terminated.
+ *
+ * @param val An unsigned integer.
+ * @param buf A buffer at least UJSON_INT_STR_MAX bytes long.
+ * @return Number of bytes written.
+ */
+size_t ujson_u64_to_str(uint64_t val, char *buf);
+
+/**
+ * @brief Converts a signed integer into a decimal string.
+ *
+ * The string is not null terminated.
+ *
+ * @param val A signed integer.
+ * @param buf A buffer at least UJSON_INT_STR_MAX bytes long.
+ * @return Number of bytes written.
+ */
+size_t ujson_i64_to_str(int64_t val, char *buf);
+
+/** @brief A buffer size large enough for any double converted to string. */
+#define UJSON_FLOAT_STR_MAX 32
+
+/**
+ * @brief Converts a double into a string that parses back to the same double.
+ *
+ * The string is usually the shortest one, but that is not guaranteed, e.g.
+ * 1e23 is written as 9.999999999999999e22.
+ *
+ * Numbers with an integral part up to 21 digits and numbers down to 1e-6 are
+ * written in a decimal notation, always with a decimal point so that they are
+ * parsed back as floats, e.g. 1.0, 0.25, 123456.789. Other numbers are
+ * written in exponential notation, e.g. 1e-7, 1.5e300.
+ *
+ * The string is not null terminated.
+ *
+ * @param val A finite double, NaN and infinity cannot be represented.
+ * @param buf A buffer at least UJSON_FLOAT_STR_MAX bytes long.
+ * @return Number of bytes written.
+ */
+size_t ujson_double_to_str(double val, char *buf);
+
+#endif /* UJSON_NUM_H */
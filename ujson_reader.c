@@ -10,36 +10,411 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
 
+#ifdef UJSON_ZLIB
+# include <zlib.h>
+#endif
+
+#include "ujson_uring.h"
 #include "ujson_utf.h"
 #include "ujson_reader.h"
 
+#ifdef UJSON_READER_STATS
+# define STATS_ADD(buf, member, val) ((buf)->stats.member += (val))
+#else
+# define STATS_ADD(buf, member, val) do { (void)(val); } while (0)
+#endif
+
 static const struct ujson_obj empty = {};
 const struct ujson_obj *ujson_empty_obj = &empty;
 
+/*
+ * Stream input, the segments are read into two buffers that alternate.
+ *
+ * A buffer is reused once the parser moved past it, i.e. to the next segment
+ * or to the scratch buffer. With io_uring the next segment is read ahead into
+ * the other buffer while the current one is being parsed.
+ */
+struct iov_stream {
+	int fd;
+	int close_fd;
+	int eof;
+	/* Number of segments read so far */
+	size_t segs;
+	size_t buf_size;
+#ifdef UJSON_IO_URING
+	struct ujson_uring ring;
+	/* Set if a read ahead is in flight */
+	int busy;
+	off_t off;
+	struct iovec rd;
+#endif
+	char buf[];
+};
+
+/*
+ * Segmented input state, the reader json points either into one of the
+ * segments or into the scratch buffer with tokens that cross a segment
+ * boundary.
+ */
+struct ujson_iov {
+	/* Segment and offset in it to continue with once json is consumed */
+	size_t next;
+	size_t next_off;
+	char *scratch;
+	size_t scratch_size;
+	/* Set for stream input, segments are then indexed modulo 2 */
+	struct iov_stream *stream;
+	size_t cnt;
+	struct iovec vec[];
+};
+
+static ssize_t stream_read_fd(ujson_reader *buf, char *dst)
+{
+	struct iov_stream *stream = buf->iov->stream;
+	ssize_t ret;
+
+	do {
+		ret = read(stream->fd, dst, stream->buf_size);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		ujson_err(buf, "Failed to read a file");
+
+	return ret;
+}
+
+#ifdef UJSON_IO_URING
+static int stream_submit(ujson_reader *buf, char *dst)
+{
+	struct iov_stream *stream = buf->iov->stream;
+	struct io_uring_sqe *sqe = ujson_uring_sqe(&stream->ring);
+
+	stream->rd.iov_base = dst;
+	stream->rd.iov_len = stream->buf_size;
+
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = stream->fd;
+	sqe->addr = (uintptr_t)&stream->rd;
+	sqe->len = 1;
+	sqe->off = stream->off;
+
+	if (ujson_uring_submit(&stream->ring)) {
+		ujson_err(buf, "Failed to submit a read");
+		return 1;
+	}
+
+	stream->busy = 1;
+
+	return 0;
+}
+
+static int stream_wait(struct iov_stream *stream, int *res)
+{
+	uint64_t user_data;
+
+	stream->busy = 0;
+
+	if (ujson_uring_wait(&stream->ring, &user_data, res)) {
+		*res = -errno;
+		return 1;
+	}
+
+	return 0;
+}
+
+static ssize_t stream_read_uring(ujson_reader *buf, char *dst, char *next)
+{
+	struct iov_stream *stream = buf->iov->stream;
+	int res;
+
+	if (!stream->busy && stream_submit(buf, dst))
+		return -1;
+
+	if (stream_wait(stream, &res) || res < 0) {
+		errno = -res;
+		ujson_err(buf, "Failed to read a file");
+		return -1;
+	}
+
+	stream->off += res;
+
+	if (res > 0 && stream_submit(buf, next))
+		return -1;
+
+	return res;
+}
+#endif
+
+/*
+ * Returns the segment to continue with or NULL at the end of input, stream
+ * segments are read on demand.
+ */
+static const struct iovec *iov_seg(ujson_reader *buf)
+{
+	struct ujson_iov *iov = buf->iov;
+	struct iov_stream *stream = iov->stream;
+	struct iovec *vec;
+	ssize_t ret;
+
+	if (!stream)
+		return iov->next < iov->cnt ? &iov->vec[iov->next] : NULL;
+
+	vec = &iov->vec[iov->next % 2];
+
+	if (iov->next < stream->segs)
+		return vec;
+
+	if (stream->eof)
+		return NULL;
+
+#ifdef UJSON_IO_URING
+	if (stream->ring.fd >= 0)
+		ret = stream_read_uring(buf, vec->iov_base, iov->vec[(iov->next + 1) % 2].iov_base);
+	else
+#endif
+		ret = stream_read_fd(buf, vec->iov_base);
+
+	if (ret <= 0) {
+		stream->eof = 1;
+		return NULL;
+	}
+
+	vec->iov_len = ret;
+	stream->segs++;
+
+	return vec;
+}
+
 static inline int buf_empty(ujson_reader *buf)
 {
 	return buf->off >= buf->len;
 }
 
-static int eatws(ujson_reader *buf)
+/* Character classes */
+#define CC_WS    0x01
+#define CC_DIGIT 0x02
+#define CC_NUM   0x04
+#define CC_FRAC  0x08
+#define CC_SEP   0x10
+
+static const uint8_t char_class[256] = {
+	[' '] = CC_WS | CC_SEP,
+	['\t'] = CC_WS | CC_SEP,
+	['\n'] = CC_WS | CC_SEP,
+	['\r'] = CC_WS | CC_SEP,
+	[','] = CC_SEP,
+	[':'] = CC_SEP,
+	['['] = CC_SEP,
+	[']'] = CC_SEP,
+	['{'] = CC_SEP,
+	['}'] = CC_SEP,
+	['0' ... '9'] = CC_DIGIT | CC_NUM,
+	['-'] = CC_NUM,
+	['+'] = CC_NUM,
+	['.'] = CC_NUM | CC_FRAC,
+	['e'] = CC_NUM | CC_FRAC,
+	['E'] = CC_NUM | CC_FRAC,
+};
+
+/*
+ * Maps a first character of a value to its type, numbers are mapped to
+ * UJSON_INT and have to be further classified by next_num_type().
+ */
+static const uint8_t first_type[256] = {
+	['{'] = UJSON_OBJ,
+	['['] = UJSON_ARR,
+	['"'] = UJSON_STR,
+	['-'] = UJSON_INT,
+	['0' ... '9'] = UJSON_INT,
+	['f'] = UJSON_BOOL,
+	['t'] = UJSON_BOOL,
+	['n'] = UJSON_NULL,
+};
+
+static inline int char_is(char b, uint8_t class)
 {
-	while (!buf_empty(buf)) {
-		switch (buf->json[buf->off]) {
-		case ' ':
-		case '\t':
-		case '\n':
-		case '\r':
-		break;
-		default:
-			goto ret;
+	return char_class[(unsigned char)b] & class;
+}
+
+struct iov_scan {
+	int str;
+	int esc;
+};
+
+/*
+ * Returns the length of the longest, or the shortest if first is set, prefix
+ * that ends between two tokens, i.e. with a whitespace or a structural
+ * character outside of a string, zero if there is none.
+ */
+static size_t iov_scan(struct iov_scan *scan, const char *str, size_t len,
+                       int first)
+{
+	size_t i, ret = 0;
+
+	for (i = 0; i < len; i++) {
+		char b = str[i];
+
+		if (scan->str) {
+			if (scan->esc)
+				scan->esc = 0;
+			else if (b == '\\')
+				scan->esc = 1;
+			else if (b == '"')
+				scan->str = 0;
+
+			continue;
+		}
+
+		if (b == '"') {
+			scan->str = 1;
+		} else if (char_is(b, CC_SEP)) {
+			ret = i + 1;
+
+			if (first)
+				break;
+		}
+	}
+
+	return ret;
+}
+
+static int iov_scratch_add(ujson_reader *buf, size_t used, const char *str, size_t len)
+{
+	struct ujson_iov *iov = buf->iov;
+
+	if (!len)
+		return 0;
+
+	if (used + len > iov->scratch_size) {
+		size_t size = iov->scratch_size ? iov->scratch_size : 256;
+		char *scratch;
+
+		while (size < used + len)
+			size *= 2;
+
+		scratch = realloc(iov->scratch, size);
+		if (!scratch) {
+			ujson_err(buf, "Out of memory");
+			return 1;
+		}
+
+		iov->scratch = scratch;
+		iov->scratch_size = size;
+	}
+
+	memcpy(iov->scratch + used, str, len);
+
+	return 0;
+}
+
+/*
+ * Switches the json buffer to the next part of the input, returns non-zero at
+ * the end of input.
+ *
+ * The part always ends between two tokens so that the parser never sees a
+ * token cut by the end of the json buffer. A segment tail that does not end
+ * between two tokens is copied into the scratch buffer along with the start
+ * of the following segment(s) up to the first point between two tokens, the
+ * rest of that segment is then parsed in place again.
+ */
+static int iov_next(ujson_reader *buf)
+{
+	struct ujson_iov *iov = buf->iov;
+	size_t pos = buf->base + buf->len, used = 0;
+	struct iov_scan scan = {};
+	const struct iovec *vec;
+
+	while ((vec = iov_seg(buf))) {
+		const char *str = (const char *)vec->iov_base + iov->next_off;
+		size_t len = vec->iov_len - iov->next_off;
+		size_t safe = iov_scan(&scan, str, len, used > 0);
+
+		if (!safe) {
+			if (iov_scratch_add(buf, used, str, len))
+				return 1;
+
+			used += len;
+			iov->next++;
+			iov->next_off = 0;
+			continue;
+		}
+
+		if (used) {
+			if (iov_scratch_add(buf, used, str, safe))
+				return 1;
+
+			buf->json = iov->scratch;
+			buf->off = 0;
+			buf->len = used + safe;
+			buf->base = pos;
+		} else {
+			buf->json = vec->iov_base;
+			buf->off = iov->next_off;
+			buf->len = iov->next_off + safe;
+			buf->base = pos - iov->next_off;
+		}
+
+		iov->next_off += safe;
+
+		if (iov->next_off >= vec->iov_len) {
+			iov->next++;
+			iov->next_off = 0;
 		}
 
-		buf->off += 1;
+		return 0;
+	}
+
+	if (!used)
+		return 1;
+
+	/* The input ends in the middle of a token */
+	buf->json = iov->scratch;
+	buf->off = 0;
+	buf->len = used;
+	buf->base = pos;
+
+	return 0;
+}
+
+/*
+ * Kept out of line so that eatws() stays small enough to be inlined.
+ */
+static __attribute__((noinline)) int iov_eatws(ujson_reader *buf)
+{
+	if (!buf->iov)
+		return 1;
+
+	while (!iov_next(buf)) {
+		while (!buf_empty(buf) && char_is(buf->json[buf->off], CC_WS))
+			buf->off++;
+
+		if (!buf_empty(buf))
+			return 0;
 	}
-ret:
-	return buf_empty(buf);
+
+	return 1;
+}
+
+/*
+ * Segmented input switches to the next part only here since each part ends
+ * between two tokens, see iov_next(). That keeps the rest of the parser
+ * unaware of segments.
+ */
+static int eatws(ujson_reader *buf)
+{
+	while (!buf_empty(buf) && char_is(buf->json[buf->off], CC_WS))
+		buf->off++;
+
+	if (!buf_empty(buf))
+		return 0;
+
+	return iov_eatws(buf);
 }
 
 static char getb(ujson_reader *buf)
@@ -95,6 +470,16 @@ static int eatstr(ujson_reader *buf, const char *str)
 	return 1;
 }
 
+/*
+ * Matches a literal, the memcmp() with a constant length is compiled into a
+ * word compare. On a mismatch the matching prefix is consumed so that errors
+ * point to the offending character.
+ */
+#define EAT_LIT(buf, lit) \
+	(((buf)->len - (buf)->off >= sizeof(lit) - 1 && \
+	  !memcmp((buf)->json + (buf)->off, lit, sizeof(lit) - 1)) ? \
+	 ((buf)->off += sizeof(lit) - 1, 1) : eatstr(buf, lit))
+
 static int hex2val(unsigned char b)
 {
 	switch (b) {
@@ -145,412 +530,357 @@ static unsigned int parse_ucode_esc(ujson_reader *buf, char *str,
 	return ujson_to_utf8(ucode, str+off);
 }
 
-static int copy_str(ujson_reader *buf, char *str, size_t len)
+/*
+ * CBOR (RFC 8949) input.
+ *
+ * The CBOR reader plugs into the same places as the JSON grammar does, each
+ * of any_first(), check_end(), pre_next(), copy_id_str() and get_value()
+ * dispatches to a CBOR variant when UJSON_READER_CBOR is set. Definite length
+ * containers keep the number of remaining items in buf->cbor_left[], the
+ * indefinite ones are terminated by a break byte.
+ */
+#define CBOR_INDEF UINT32_MAX
+#define CBOR_BREAK 0xff
+
+enum cbor_major {
+	CBOR_UINT,
+	CBOR_NINT,
+	CBOR_BYTES,
+	CBOR_TEXT,
+	CBOR_ARR,
+	CBOR_MAP,
+	CBOR_TAG,
+	CBOR_SIMPLE,
+};
+
+static inline int is_cbor(ujson_reader *buf)
 {
-	size_t pos = 0;
-	int esc = 0;
-	unsigned int l;
+	return buf->flags & UJSON_READER_CBOR;
+}
 
-	eatb(buf, '"');
+static inline uint8_t cbor_peek(ujson_reader *buf)
+{
+	return buf->json[buf->off];
+}
 
-	for (;;) {
-		if (buf_empty(buf)) {
-			ujson_err(buf, "Unterminated string");
-			return 1;
-		}
+/*
+ * Parses an item head, returns -1 on an error, 1 for an indefinite length and
+ * 0 otherwise with the argument stored into val.
+ */
+static int cbor_head(ujson_reader *buf, uint8_t *major, uint64_t *val)
+{
+	uint8_t ib, ai;
+	size_t i, n;
 
-		if (!esc && eatb(buf, '"')) {
-			if (str)
-				str[pos] = 0;
-			return 0;
-		}
+	if (buf_empty(buf)) {
+		ujson_err(buf, "Unexpected end");
+		return -1;
+	}
 
-		unsigned char b = getb(buf);
+	ib = buf->json[buf->off++];
+	*major = ib >> 5;
+	ai = ib & 0x1f;
 
-		if (b < 0x20) {
-			if (!peekb(buf))
-				ujson_err(buf, "Unterminated string");
-			else
-				ujson_err(buf, "Invalid string character 0x%02x", b);
-			return 1;
-		}
+	if (ai < 24) {
+		*val = ai;
+		return 0;
+	}
 
-		if (!esc && b == '\\') {
-			esc = 1;
-			continue;
-		}
+	switch (ai) {
+	case 24 ... 27:
+		n = 1 << (ai - 24);
+	break;
+	case 31:
+		return 1;
+	default:
+		ujson_err(buf, "Invalid CBOR additional info %u", ai);
+		return -1;
+	}
 
-		if (esc) {
-			switch (b) {
-			case '"':
-			case '\\':
-			case '/':
-			break;
-			case 'b':
-				b = '\b';
-			break;
-			case 'f':
-				b = '\f';
-			break;
-			case 'n':
-				b = '\n';
-			break;
-			case 'r':
-				b = '\r';
-			break;
-			case 't':
-				b = '\t';
-			break;
-			case 'u':
-				if (!(l = parse_ucode_esc(buf, str, pos, len)))
-					return 1;
-				pos += l;
-				b = 0;
-			break;
-			default:
-				ujson_err(buf, "Invalid escape \\%c", b);
-				return 1;
-			}
-			esc = 0;
-		}
+	if (buf->len - buf->off < n) {
+		ujson_err(buf, "Unexpected end");
+		return -1;
+	}
 
-		if (str && b) {
-			if (pos + 1 >= len) {
-				ujson_err(buf, "String buffer too short!");
-				return 1;
-			}
+	*val = 0;
 
-			str[pos++] = b;
-		}
-	}
+	for (i = 0; i < n; i++)
+		*val = (*val << 8) | (uint8_t)buf->json[buf->off++];
 
-	return 1;
+	return 0;
 }
 
-static int copy_id_str(ujson_reader *buf, char *str, size_t len)
+static int cbor_skip_tags(ujson_reader *buf)
 {
-	size_t pos = 0;
-
-	if (eatws(buf))
-		goto err0;
-
-	if (!eatb(buf, '"'))
-		goto err0;
+	uint8_t major;
+	uint64_t val;
 
 	for (;;) {
 		if (buf_empty(buf)) {
-			ujson_err(buf, "Unterminated ID string");
+			ujson_err(buf, "Unexpected end");
 			return 1;
 		}
 
-		if (eatb(buf, '"')) {
-			str[pos] = 0;
-			break;
-		}
+		if (cbor_peek(buf) >> 5 != CBOR_TAG)
+			return 0;
 
-		if (pos >= len-1) {
-			ujson_err(buf, "ID string too long");
+		switch (cbor_head(buf, &major, &val)) {
+		case -1:
+			return 1;
+		case 1:
+			ujson_err(buf, "Invalid CBOR tag");
 			return 1;
 		}
-
-		str[pos++] = getb(buf);
 	}
+}
 
-	if (eatws(buf))
-		goto err1;
+static enum ujson_type cbor_next_type(ujson_reader *buf)
+{
+	uint8_t b;
 
-	if (!eatb(buf, ':'))
-		goto err1;
+	if (cbor_skip_tags(buf))
+		return UJSON_VOID;
 
-	return 0;
-err0:
-	ujson_err(buf, "Expected ID string");
-	return 1;
-err1:
-	ujson_err(buf, "Expected ':' after ID string");
-	return 1;
-}
+	b = cbor_peek(buf);
+
+	switch (b >> 5) {
+	case CBOR_UINT:
+	case CBOR_NINT:
+		return UJSON_INT;
+	case CBOR_TEXT:
+		return UJSON_STR;
+	case CBOR_ARR:
+		return UJSON_ARR;
+	case CBOR_MAP:
+		return UJSON_OBJ;
+	case CBOR_BYTES:
+		ujson_err(buf, "CBOR byte strings are not supported");
+		return UJSON_VOID;
+	}
 
-static int is_digit(char b)
-{
 	switch (b) {
-	case '0' ... '9':
-		return 1;
+	case 0xf4:
+	case 0xf5:
+		return UJSON_BOOL;
+	case 0xf6:
+	case 0xf7:
+		return UJSON_NULL;
+	case 0xf9 ... 0xfb:
+		return UJSON_FLOAT;
+	case CBOR_BREAK:
+		ujson_err(buf, "Unexpected CBOR break");
+		return UJSON_VOID;
 	default:
-		return 0;
+		ujson_err(buf, "Unsupported CBOR simple value 0x%02x", b);
+		return UJSON_VOID;
 	}
 }
 
-static int get_int(ujson_reader *buf, struct ujson_val *res)
+static int cbor_get_int(ujson_reader *buf, struct ujson_val *res)
 {
-	long val = 0;
-	int sign = 1;
-
-	if (eatb(buf, '-')) {
-		sign = -1;
-		if (!is_digit(peekb(buf))) {
-			ujson_err(buf, "Expected digit(s)");
-			return 1;
-		}
-	}
+	uint8_t major;
+	uint64_t val;
 
-	if (peekb(buf) == '0' && is_digit(peekb_off(buf, 1))) {
-		ujson_err(buf, "Leading zero in number!");
+	if (cbor_head(buf, &major, &val)) {
+		if (!ujson_reader_err(buf))
+			ujson_err(buf, "Invalid CBOR integer");
 		return 1;
 	}
 
-	while (is_digit(peekb(buf))) {
-		val *= 10;
-		val += getb(buf) - '0';
-		//TODO: overflow?
+	if (val > INT64_MAX) {
+		ujson_err(buf, "Integer out of range");
+		return 1;
 	}
 
-	if (sign < 0)
-		val = -val;
-
-	res->val_int = val;
-	res->val_float = val;
+	res->val_int = major == CBOR_NINT ? -1 - (int64_t)val : (int64_t)val;
+	res->val_float = res->val_int;
 
 	return 0;
 }
 
-static int eat_digits(ujson_reader *buf)
+static double cbor_half(uint16_t half)
 {
-	if (!is_digit(peekb(buf))) {
-		ujson_err(buf, "Expected digit(s)");
-		return 1;
+	uint64_t sign = (uint64_t)(half >> 15) << 63;
+	uint64_t exp = (half >> 10) & 0x1f;
+	uint64_t mant = half & 0x3ff;
+	uint64_t bits;
+	double ret;
+
+	if (!exp) {
+		ret = mant / 16777216.0;
+		return sign ? -ret : ret;
 	}
 
-	while (is_digit(peekb(buf)))
-		getb(buf);
+	if (exp == 0x1f)
+		bits = sign | 0x7ff0000000000000ULL | (mant << 42);
+	else
+		bits = sign | ((exp - 15 + 1023) << 52) | (mant << 42);
 
-	return 0;
+	memcpy(&ret, &bits, sizeof(ret));
+
+	return ret;
 }
 
-static int get_float(ujson_reader *buf, struct ujson_val *res)
+static int cbor_get_float(ujson_reader *buf, struct ujson_val *res)
 {
-	off_t start = buf->off;
-
-	eatb(buf, '-');
-
-	if (peekb(buf) == '0' && is_digit(peekb_off(buf, 1))) {
-		ujson_err(buf, "Leading zero in float");
-		return 1;
-	}
+	uint8_t ib = cbor_peek(buf);
+	uint8_t major;
+	uint64_t val;
+	uint32_t val32;
+	float f;
 
-	if (eat_digits(buf))
+	if (cbor_head(buf, &major, &val))
 		return 1;
 
-	switch (getb(buf)) {
-	case '.':
-		if (eat_digits(buf))
-			return 1;
-
-		if (!eatb2(buf, 'e', 'E'))
-			break;
-
-		/* fallthrough */
-	case 'e':
-	case 'E':
-		eatb2(buf, '+', '-');
-
-		if (eat_digits(buf))
-			return 1;
+	switch (ib) {
+	case 0xf9:
+		res->val_float = cbor_half(val);
 	break;
-	}
-
-	size_t len = buf->off - start;
-	char tmp[len+1];
-
-	memcpy(tmp, buf->json + start, len);
-
-	tmp[len] = 0;
-
-	res->val_float = strtod(tmp, NULL);
-
-	return 0;
-}
-
-static int get_bool(ujson_reader *buf, struct ujson_val *res)
-{
-	switch (peekb(buf)) {
-	case 'f':
-		if (!eatstr(buf, "false")) {
-			ujson_err(buf, "Expected 'false'");
-			return 1;
-		}
-
-		res->val_bool = 0;
+	case 0xfa:
+		val32 = val;
+		memcpy(&f, &val32, sizeof(f));
+		res->val_float = f;
 	break;
-	case 't':
-		if (!eatstr(buf, "true")) {
-			ujson_err(buf, "Expected 'true'");
-			return 1;
-		}
-
-		res->val_bool = 1;
+	default:
+		memcpy(&res->val_float, &val, sizeof(res->val_float));
 	break;
 	}
 
 	return 0;
 }
 
-static int get_null(ujson_reader *buf)
+static int cbor_copy_chunk(ujson_reader *buf, char *str, size_t size,
+                           size_t *pos, uint64_t len, const char *too_long)
 {
-	if (!eatstr(buf, "null")) {
-		ujson_err(buf, "Expected 'null'");
+	if (buf->len - buf->off < len) {
+		ujson_err(buf, "Unterminated string");
 		return 1;
 	}
 
-	return 0;
-}
-
-int ujson_obj_skip(ujson_reader *buf)
-{
-	struct ujson_val res = {};
-
-	UJSON_OBJ_FOREACH(buf, &res) {
-		switch (res.type) {
-		case UJSON_OBJ:
-			if (ujson_obj_skip(buf))
-				return 1;
-		break;
-		case UJSON_ARR:
-			if (ujson_arr_skip(buf))
-				return 1;
-		break;
-		default:
-		break;
+	if (str) {
+		if (len >= size - *pos) {
+			ujson_err(buf, "%s", too_long);
+			return 1;
 		}
+
+		memcpy(str + *pos, buf->json + buf->off, len);
+		*pos += len;
 	}
 
+	buf->off += len;
+
 	return 0;
 }
 
-int ujson_arr_skip(ujson_reader *buf)
+/*
+ * Copies a text string, str NULL means that the string is only skipped.
+ */
+static int cbor_copy_str(ujson_reader *buf, char *str, size_t size,
+                         const char *too_long)
 {
-	struct ujson_val res = {};
+	size_t pos = 0, start = buf->off;
+	uint8_t major;
+	uint64_t len;
+	int ret;
 
-	UJSON_ARR_FOREACH(buf, &res) {
-		switch (res.type) {
-		case UJSON_OBJ:
-			if (ujson_obj_skip(buf))
-				return 1;
-		break;
-		case UJSON_ARR:
-			if (ujson_arr_skip(buf))
-				return 1;
-		break;
-		default:
-		break;
-		}
+	if (buf_empty(buf) || cbor_peek(buf) >> 5 != CBOR_TEXT) {
+		ujson_err(buf, "Expected CBOR text string");
+		return 1;
 	}
 
-	return 0;
-}
+	ret = cbor_head(buf, &major, &len);
+	if (ret < 0)
+		return 1;
 
-static enum ujson_type next_num_type(ujson_reader *buf)
-{
-	size_t off = 0;
+	if (!ret) {
+		if (cbor_copy_chunk(buf, str, size, &pos, len, too_long))
+			return 1;
+		goto done;
+	}
 
 	for (;;) {
-		char b = peekb_off(buf, off++);
-
-		switch (b) {
-		case 0:
-		case ',':
-			return UJSON_INT;
-		case '.':
-		case 'e':
-		case 'E':
-			return UJSON_FLOAT;
+		if (buf_empty(buf)) {
+			ujson_err(buf, "Unterminated string");
+			return 1;
 		}
-	}
 
-	return UJSON_VOID;
-}
+		if ((uint8_t)cbor_peek(buf) == CBOR_BREAK) {
+			buf->off++;
+			break;
+		}
 
-enum ujson_type ujson_next_type(ujson_reader *buf)
-{
-	if (eatws(buf)) {
-		ujson_err(buf, "Unexpected end");
-		return UJSON_VOID;
-	}
+		if (cbor_head(buf, &major, &len))
+			goto chunk_err;
 
-	char b = peekb(buf);
+		if (major != CBOR_TEXT)
+			goto chunk_err;
 
-	switch (b) {
-	case '{':
-		return UJSON_OBJ;
-	case '[':
-		return UJSON_ARR;
-	case '"':
-		return UJSON_STR;
-	case '-':
-	case '0' ... '9':
-		return next_num_type(buf);
-	case 'f':
-	case 't':
-		return UJSON_BOOL;
-	break;
-	case 'n':
-		return UJSON_NULL;
-	break;
-	default:
-		ujson_err(buf, "Expected object, array, number or string");
-		return UJSON_VOID;
+		if (cbor_copy_chunk(buf, str, size, &pos, len, too_long))
+			return 1;
+	}
+done:
+	if (str) {
+		str[pos] = 0;
+		STATS_ADD(buf, str_copied, pos);
+	} else {
+		STATS_ADD(buf, str_passed, buf->off - start);
 	}
+
+	return 0;
+chunk_err:
+	if (!ujson_reader_err(buf))
+		ujson_err(buf, "Invalid CBOR text string chunk");
+	return 1;
 }
 
-enum ujson_type ujson_reader_start(ujson_reader *buf)
+static int cbor_copy_id_str(ujson_reader *buf, char *str, size_t len)
 {
-	enum ujson_type type = ujson_next_type(buf);
+	if (cbor_skip_tags(buf))
+		return 1;
 
-	switch (type) {
-	case UJSON_ARR:
-	case UJSON_OBJ:
-	case UJSON_VOID:
-	break;
-	default:
-		ujson_err(buf, "JSON can start only with array or object");
-		type = UJSON_VOID;
-	break;
+	if (cbor_peek(buf) >> 5 != CBOR_TEXT) {
+		ujson_err(buf, "Expected ID string");
+		return 1;
 	}
 
-	return type;
+	return cbor_copy_str(buf, str, len, "ID string too long");
 }
 
-static int get_value(ujson_reader *buf, struct ujson_val *res)
+static int cbor_get_value(ujson_reader *buf, struct ujson_val *res)
 {
 	int ret = 0;
 
-	res->type = ujson_next_type(buf);
+	res->type = cbor_next_type(buf);
+	buf->val_off = buf->off;
+
+	STATS_ADD(buf, values[res->type], 1);
 
 	switch (res->type) {
 	case UJSON_STR:
-		if (copy_str(buf, res->buf, res->buf_size)) {
+		if (cbor_copy_str(buf, res->buf, res->buf_size,
+		                  "String buffer too short!")) {
 			res->type = UJSON_VOID;
 			return 0;
 		}
 		res->val_str = res->buf;
 		return 1;
 	case UJSON_INT:
-		ret = get_int(buf, res);
+		ret = cbor_get_int(buf, res);
 	break;
 	case UJSON_FLOAT:
-		ret = get_float(buf, res);
+		ret = cbor_get_float(buf, res);
 	break;
 	case UJSON_BOOL:
-		ret = get_bool(buf, res);
+		res->val_bool = buf->json[buf->off++] == (char)0xf5;
 	break;
 	case UJSON_NULL:
-		ret = get_null(buf);
+		buf->off++;
 	break;
 	case UJSON_VOID:
 		return 0;
 	case UJSON_ARR:
 	case UJSON_OBJ:
-		buf->sub_off = buf->off;
+		buf->sub_off = buf->base + buf->off;
 		return 1;
 	}
 
@@ -562,45 +892,595 @@ static int get_value(ujson_reader *buf, struct ujson_val *res)
 	return 1;
 }
 
-static int pre_next(ujson_reader *buf, struct ujson_val *res)
+static int cbor_stack_alloc(ujson_reader *buf)
 {
-	if (!eatb(buf, ',')) {
-		ujson_err(buf, "Expected ','");
-		res->type = UJSON_VOID;
+	if (!buf->allocated) {
+		ujson_err(buf, "CBOR reader without a container stack, see UJSON_READER_CBOR_INIT()");
 		return 1;
 	}
 
-	if (eatws(buf)) {
-		ujson_err(buf, "Unexpected end");
-		res->type = UJSON_VOID;
+	buf->cbor_left = malloc(sizeof(ujson_cbor_stack));
+	if (!buf->cbor_left) {
+		ujson_err(buf, "Out of memory");
 		return 1;
 	}
 
 	return 0;
 }
 
-static int check_end(ujson_reader *buf, struct ujson_val *res, char b)
+static int cbor_any_first(ujson_reader *buf, char b)
 {
-	if (eatws(buf)) {
-		ujson_err(buf, "Unexpected end");
+	uint8_t exp_major = b == '{' ? CBOR_MAP : CBOR_ARR;
+	uint8_t major;
+	uint64_t len;
+	int ret;
+
+	if (cbor_skip_tags(buf))
+		return 1;
+
+	if (cbor_peek(buf) >> 5 != exp_major) {
+		ujson_err(buf, "Expected CBOR %s", b == '{' ? "map" : "array");
 		return 1;
 	}
 
-	if (eatb(buf, b)) {
-		res->type = UJSON_VOID;
-		eatws(buf);
-		eatb(buf, 0);
-		buf->depth--;
+	ret = cbor_head(buf, &major, &len);
+	if (ret < 0)
+		return 1;
+
+	if (buf->depth >= UJSON_RECURSION_MAX) {
+		ujson_err(buf, "Recursion too deep");
+		return 1;
+	}
+
+	if (!ret && len >= CBOR_INDEF) {
+		ujson_err(buf, "CBOR container too long");
 		return 1;
 	}
 
+	if (!buf->cbor_left && cbor_stack_alloc(buf))
+		return 1;
+
+	buf->cbor_left[buf->depth] = ret ? CBOR_INDEF : len;
+
 	return 0;
 }
 
-/*
- * This is supposed to return a pointer to a string stored as a first member of
- * a structure given an array.
- *
+static int cbor_check_end(ujson_reader *buf, struct ujson_val *res)
+{
+	uint32_t *left = &buf->cbor_left[buf->depth - 1];
+
+	if (*left == CBOR_INDEF) {
+		if (buf_empty(buf)) {
+			ujson_err(buf, "Unexpected end");
+			return 1;
+		}
+
+		if ((uint8_t)cbor_peek(buf) != CBOR_BREAK)
+			return 0;
+
+		buf->off++;
+	} else if (*left) {
+		(*left)--;
+		return 0;
+	}
+
+	res->type = UJSON_VOID;
+	buf->depth--;
+	return 1;
+}
+
+static int copy_str(ujson_reader *buf, char *str, size_t len)
+{
+	size_t pos = 0, start = buf->off;
+	int esc = 0;
+	unsigned int l;
+
+	eatb(buf, '"');
+
+	for (;;) {
+		if (buf_empty(buf)) {
+			ujson_err(buf, "Unterminated string");
+			return 1;
+		}
+
+		if (!esc && eatb(buf, '"')) {
+			if (str) {
+				str[pos] = 0;
+				STATS_ADD(buf, str_copied, pos);
+			} else {
+				STATS_ADD(buf, str_passed, buf->off - start - 2);
+			}
+			return 0;
+		}
+
+		unsigned char b = getb(buf);
+
+		if (b < 0x20) {
+			if (!peekb(buf))
+				ujson_err(buf, "Unterminated string");
+			else
+				ujson_err(buf, "Invalid string character 0x%02x", b);
+			return 1;
+		}
+
+		if (!esc && b == '\\') {
+			esc = 1;
+			continue;
+		}
+
+		if (esc) {
+			STATS_ADD(buf, escapes, 1);
+
+			switch (b) {
+			case '"':
+			case '\\':
+			case '/':
+			break;
+			case 'b':
+				b = '\b';
+			break;
+			case 'f':
+				b = '\f';
+			break;
+			case 'n':
+				b = '\n';
+			break;
+			case 'r':
+				b = '\r';
+			break;
+			case 't':
+				b = '\t';
+			break;
+			case 'u':
+				if (!(l = parse_ucode_esc(buf, str, pos, len)))
+					return 1;
+				pos += l;
+				b = 0;
+			break;
+			default:
+				ujson_err(buf, "Invalid escape \\%c", b);
+				return 1;
+			}
+			esc = 0;
+		}
+
+		if (str && b) {
+			if (pos + 1 >= len) {
+				ujson_err(buf, "String buffer too short!");
+				return 1;
+			}
+
+			str[pos++] = b;
+		}
+	}
+
+	return 1;
+}
+
+static int copy_id_str(ujson_reader *buf, char *str, size_t len)
+{
+	size_t pos = 0;
+
+	if (is_cbor(buf))
+		return cbor_copy_id_str(buf, str, len);
+
+	if (eatws(buf))
+		goto err0;
+
+	if (!eatb(buf, '"'))
+		goto err0;
+
+	for (;;) {
+		if (buf_empty(buf)) {
+			ujson_err(buf, "Unterminated ID string");
+			return 1;
+		}
+
+		if (eatb(buf, '"')) {
+			str[pos] = 0;
+			break;
+		}
+
+		if (pos >= len-1) {
+			ujson_err(buf, "ID string too long");
+			return 1;
+		}
+
+		str[pos++] = getb(buf);
+	}
+
+	if (eatws(buf))
+		goto err1;
+
+	if (!eatb(buf, ':'))
+		goto err1;
+
+	return 0;
+err0:
+	ujson_err(buf, "Expected ID string");
+	return 1;
+err1:
+	ujson_err(buf, "Expected ':' after ID string");
+	return 1;
+}
+
+static inline int is_digit(char b)
+{
+	return char_is(b, CC_DIGIT);
+}
+
+static int get_int(ujson_reader *buf, struct ujson_val *res)
+{
+	long val = 0;
+	int sign = 1;
+
+	if (eatb(buf, '-')) {
+		sign = -1;
+		if (!is_digit(peekb(buf))) {
+			ujson_err(buf, "Expected digit(s)");
+			return 1;
+		}
+	}
+
+	if (peekb(buf) == '0' && is_digit(peekb_off(buf, 1))) {
+		ujson_err(buf, "Leading zero in number!");
+		return 1;
+	}
+
+	while (is_digit(peekb(buf))) {
+		val *= 10;
+		val += getb(buf) - '0';
+		//TODO: overflow?
+	}
+
+	if (sign < 0)
+		val = -val;
+
+	res->val_int = val;
+	res->val_float = val;
+
+	return 0;
+}
+
+static int eat_digits(ujson_reader *buf)
+{
+	if (!is_digit(peekb(buf))) {
+		ujson_err(buf, "Expected digit(s)");
+		return 1;
+	}
+
+	while (is_digit(peekb(buf)))
+		getb(buf);
+
+	return 0;
+}
+
+static int get_float(ujson_reader *buf, struct ujson_val *res)
+{
+	off_t start = buf->off;
+
+	eatb(buf, '-');
+
+	if (peekb(buf) == '0' && is_digit(peekb_off(buf, 1))) {
+		ujson_err(buf, "Leading zero in float");
+		return 1;
+	}
+
+	if (eat_digits(buf))
+		return 1;
+
+	switch (getb(buf)) {
+	case '.':
+		if (eat_digits(buf))
+			return 1;
+
+		if (!eatb2(buf, 'e', 'E'))
+			break;
+
+		/* fallthrough */
+	case 'e':
+	case 'E':
+		eatb2(buf, '+', '-');
+
+		if (eat_digits(buf))
+			return 1;
+	break;
+	}
+
+	size_t len = buf->off - start;
+	char tmp[len+1];
+
+	memcpy(tmp, buf->json + start, len);
+
+	tmp[len] = 0;
+
+	res->val_float = strtod(tmp, NULL);
+
+	return 0;
+}
+
+static int get_bool(ujson_reader *buf, struct ujson_val *res)
+{
+	switch (peekb(buf)) {
+	case 'f':
+		if (!EAT_LIT(buf, "false")) {
+			ujson_err(buf, "Expected 'false'");
+			return 1;
+		}
+
+		res->val_bool = 0;
+	break;
+	case 't':
+		if (!EAT_LIT(buf, "true")) {
+			ujson_err(buf, "Expected 'true'");
+			return 1;
+		}
+
+		res->val_bool = 1;
+	break;
+	}
+
+	return 0;
+}
+
+static int get_null(ujson_reader *buf)
+{
+	if (!EAT_LIT(buf, "null")) {
+		ujson_err(buf, "Expected 'null'");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse index, a sorted array of large containers offsets.
+ */
+struct index_entry {
+	/* Offset of the '{' or '[' */
+	uint64_t start;
+	/* Offset after the container as it would be after skipping it */
+	uint64_t end;
+};
+
+struct ujson_index {
+	struct index_entry *entries;
+	size_t cnt;
+	size_t size;
+	/* Set if the entries are mapped from the index file */
+	void *map;
+	size_t map_size;
+};
+
+/*
+ * Jumps over a container if it's in the index, returns non-zero on success.
+ */
+static int index_skip(ujson_reader *buf)
+{
+	const struct ujson_index *idx = buf->index;
+	size_t l = 0, r = idx->cnt, m;
+
+	if (ujson_reader_err(buf))
+		return 0;
+
+	while (l < r) {
+		m = l + (r - l) / 2;
+
+		if (idx->entries[m].start < buf->off)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	if (l >= idx->cnt || idx->entries[l].start != buf->off)
+		return 0;
+
+	buf->off = idx->entries[l].end;
+
+	return 1;
+}
+
+int ujson_obj_skip(ujson_reader *buf)
+{
+	struct ujson_val res = {};
+
+	if (buf->index && index_skip(buf))
+		return 0;
+
+	UJSON_OBJ_FOREACH(buf, &res) {
+		switch (res.type) {
+		case UJSON_OBJ:
+			if (ujson_obj_skip(buf))
+				return 1;
+		break;
+		case UJSON_ARR:
+			if (ujson_arr_skip(buf))
+				return 1;
+		break;
+		default:
+		break;
+		}
+	}
+
+	return 0;
+}
+
+int ujson_arr_skip(ujson_reader *buf)
+{
+	struct ujson_val res = {};
+
+	if (buf->index && index_skip(buf))
+		return 0;
+
+	UJSON_ARR_FOREACH(buf, &res) {
+		switch (res.type) {
+		case UJSON_OBJ:
+			if (ujson_obj_skip(buf))
+				return 1;
+		break;
+		case UJSON_ARR:
+			if (ujson_arr_skip(buf))
+				return 1;
+		break;
+		default:
+		break;
+		}
+	}
+
+	return 0;
+}
+
+static enum ujson_type next_num_type(ujson_reader *buf)
+{
+	size_t off;
+
+	for (off = buf->off; off < buf->len; off++) {
+		uint8_t class = char_class[(unsigned char)buf->json[off]];
+
+		if (!(class & CC_NUM))
+			break;
+
+		if (class & CC_FRAC)
+			return UJSON_FLOAT;
+	}
+
+	return UJSON_INT;
+}
+
+enum ujson_type ujson_next_type(ujson_reader *buf)
+{
+	if (is_cbor(buf))
+		return cbor_next_type(buf);
+
+	if (eatws(buf)) {
+		ujson_err(buf, "Unexpected end");
+		return UJSON_VOID;
+	}
+
+	enum ujson_type type = first_type[(unsigned char)buf->json[buf->off]];
+
+	switch (type) {
+	case UJSON_INT:
+		return next_num_type(buf);
+	case UJSON_VOID:
+		ujson_err(buf, "Expected object, array, number or string");
+		return UJSON_VOID;
+	default:
+		return type;
+	}
+}
+
+enum ujson_type ujson_reader_start(ujson_reader *buf)
+{
+	enum ujson_type type = ujson_next_type(buf);
+
+	switch (type) {
+	case UJSON_ARR:
+	case UJSON_OBJ:
+	case UJSON_VOID:
+	break;
+	default:
+		ujson_err(buf, "JSON can start only with array or object");
+		type = UJSON_VOID;
+	break;
+	}
+
+	return type;
+}
+
+static int get_value(ujson_reader *buf, struct ujson_val *res)
+{
+	int ret = 0;
+
+	if (is_cbor(buf))
+		return cbor_get_value(buf, res);
+
+	res->type = ujson_next_type(buf);
+	buf->val_off = buf->off;
+
+	STATS_ADD(buf, values[res->type], 1);
+
+	switch (res->type) {
+	case UJSON_STR:
+		if (copy_str(buf, res->buf, res->buf_size)) {
+			res->type = UJSON_VOID;
+			return 0;
+		}
+		res->val_str = res->buf;
+		return 1;
+	case UJSON_INT:
+		ret = get_int(buf, res);
+	break;
+	case UJSON_FLOAT:
+		ret = get_float(buf, res);
+	break;
+	case UJSON_BOOL:
+		ret = get_bool(buf, res);
+	break;
+	case UJSON_NULL:
+		ret = get_null(buf);
+	break;
+	case UJSON_VOID:
+		return 0;
+	case UJSON_ARR:
+	case UJSON_OBJ:
+		buf->sub_off = buf->base + buf->off;
+		return 1;
+	}
+
+	if (ret) {
+		res->type = UJSON_VOID;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int pre_next(ujson_reader *buf, struct ujson_val *res)
+{
+	if (is_cbor(buf))
+		return 0;
+
+	if (!eatb(buf, ',')) {
+		ujson_err(buf, "Expected ','");
+		res->type = UJSON_VOID;
+		return 1;
+	}
+
+	if (eatws(buf)) {
+		ujson_err(buf, "Unexpected end");
+		res->type = UJSON_VOID;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_end(ujson_reader *buf, struct ujson_val *res, char b)
+{
+	if (is_cbor(buf))
+		return cbor_check_end(buf, res);
+
+	if (eatws(buf)) {
+		ujson_err(buf, "Unexpected end");
+		return 1;
+	}
+
+	if (eatb(buf, b)) {
+		res->type = UJSON_VOID;
+		eatws(buf);
+		eatb(buf, 0);
+		buf->depth--;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * This is supposed to return a pointer to a string stored as a first member of
+ * a structure given an array.
+ *
  * e.g.
  *
  *	struct foo {
@@ -615,450 +1495,1240 @@ static int check_end(ujson_reader *buf, struct ujson_val *res, char b)
  */
 static inline const char *list_elem(const void *arr, size_t memb_size, size_t idx)
 {
-	return *(const char**)(arr + idx * memb_size);
+	return *(const char**)(arr + idx * memb_size);
+}
+
+size_t ujson_lookup(const void *arr, size_t memb_size, size_t list_len,
+                    const char *key)
+{
+	size_t l = 0;
+	size_t r = list_len-1;
+	size_t mid = -1;
+
+	if (!list_len)
+		return (size_t)-1;
+
+	while (r - l > 1) {
+		mid = (l+r)/2;
+
+		int ret = strcmp(list_elem(arr, memb_size, mid), key);
+		if (!ret)
+			return mid;
+
+		if (ret < 0)
+			l = mid;
+		else
+			r = mid;
+	}
+
+	if (r != mid && !strcmp(list_elem(arr, memb_size, r), key))
+		return r;
+
+	if (l != mid && !strcmp(list_elem(arr, memb_size, l), key))
+		return l;
+
+	return -1;
+}
+
+static int skip_obj_val(ujson_reader *buf)
+{
+	struct ujson_val dummy = {};
+	size_t start = buf->base + buf->off;
+	int ret;
+
+	if (!get_value(buf, &dummy))
+		return 0;
+
+	switch (dummy.type) {
+	case UJSON_OBJ:
+		ret = !ujson_obj_skip(buf);
+	break;
+	case UJSON_ARR:
+		ret = !ujson_arr_skip(buf);
+	break;
+	default:
+		ret = 1;
+	break;
+	}
+
+	STATS_ADD(buf, skipped, buf->base + buf->off - start);
+
+	return ret;
+}
+
+static int obj_next(ujson_reader *buf, struct ujson_val *res)
+{
+	if (copy_id_str(buf, res->id, sizeof(res->id)))
+		return 0;
+
+	return get_value(buf, res);
+}
+
+static int obj_pre_next(ujson_reader *buf, struct ujson_val *res)
+{
+	if (ujson_reader_err(buf))
+		return 1;
+
+	if (check_end(buf, res, '}'))
+		return 1;
+
+	if (pre_next(buf, res))
+		return 1;
+
+	return 0;
+}
+
+static struct ujson_diag_entry *diag_entry(ujson_reader *buf,
+                                           enum ujson_diag_code code)
+{
+	struct ujson_diag *diag = buf->diag;
+	struct ujson_diag_entry *entry;
+
+	diag->cnt[code]++;
+
+	if (diag->entries_used >= diag->entries_max)
+		return NULL;
+
+	entry = &diag->entries[diag->entries_used++];
+
+	entry->code = code;
+	entry->off = buf->base + buf->off;
+
+	return entry;
+}
+
+static void diag_msg(char *msg, size_t msg_size, enum ujson_diag_code code,
+                     const char *key, enum ujson_type expected)
+{
+	switch (code) {
+	case UJSON_DIAG_UNEXPECTED_KEY:
+		snprintf(msg, msg_size, "Unexpected key '%s'", key);
+	break;
+	case UJSON_DIAG_WRONG_TYPE:
+		snprintf(msg, msg_size, "Wrong '%s' type expected %s",
+		         key, ujson_type_name(expected));
+	break;
+	case UJSON_DIAG_GARBAGE:
+		snprintf(msg, msg_size, "Garbage after JSON string!");
+	break;
+	default:
+		msg[0] = 0;
+	break;
+	}
+}
+
+/*
+ * Records a structured warning into the diag sink if there is one, otherwise
+ * formats the message and passes it to ujson_warn().
+ */
+static void diag_warn(ujson_reader *buf, enum ujson_diag_code code,
+                      const char *key, enum ujson_type expected,
+                      enum ujson_type actual)
+{
+	struct ujson_diag_entry *entry;
+
+	if (!buf->diag || (buf->flags & UJSON_READER_STRICT)) {
+		char msg[UJSON_ERR_MAX];
+
+		diag_msg(msg, sizeof(msg), code, key, expected);
+		ujson_warn(buf, "%s", msg);
+		return;
+	}
+
+	entry = diag_entry(buf, code);
+	if (!entry)
+		return;
+
+	entry->expected = expected;
+	entry->actual = actual;
+	entry->msg[0] = 0;
+
+	if (key) {
+		strncpy(entry->key, key, sizeof(entry->key) - 1);
+		entry->key[sizeof(entry->key) - 1] = 0;
+	} else {
+		entry->key[0] = 0;
+	}
+}
+
+static int obj_next_filter(ujson_reader *buf, struct ujson_val *res,
+                           const struct ujson_obj *obj, const struct ujson_obj *ign)
+{
+	const struct ujson_obj_attr *attr;
+
+	for (;;) {
+		if (copy_id_str(buf, res->id, sizeof(res->id)))
+			return 0;
+
+		res->idx = obj ? ujson_obj_lookup(obj, res->id) : (size_t)-1;
+
+		STATS_ADD(buf, keys_lookup, !!obj);
+
+		if (res->idx != (size_t)-1) {
+			STATS_ADD(buf, keys_matched, 1);
+
+			if (!get_value(buf, res))
+				return 0;
+
+			attr = &obj->attrs[res->idx];
+
+			if (attr->type == UJSON_VOID)
+				return 1;
+
+			if (attr->type == res->type)
+				return 1;
+
+			if (attr->type == UJSON_FLOAT &&
+			    res->type == UJSON_INT)
+				return 1;
+
+			diag_warn(buf, UJSON_DIAG_WRONG_TYPE, attr->key,
+			          attr->type, res->type);
+		} else {
+			STATS_ADD(buf, keys_skipped, 1);
+
+			if (!skip_obj_val(buf))
+				return 0;
+
+			if (ign && ujson_obj_lookup(ign, res->id) == (size_t)-1) {
+				diag_warn(buf, UJSON_DIAG_UNEXPECTED_KEY, res->id,
+				          UJSON_VOID, UJSON_VOID);
+			}
+		}
+
+		if (obj_pre_next(buf, res))
+			return 0;
+	}
+}
+
+static int check_err(ujson_reader *buf, struct ujson_val *res)
+{
+	if (ujson_reader_err(buf)) {
+		res->type = UJSON_VOID;
+		return 1;
+	}
+
+	return 0;
+}
+
+int ujson_obj_next_filter(ujson_reader *buf, struct ujson_val *res,
+                            const struct ujson_obj *obj, const struct ujson_obj *ign)
+{
+	if (check_err(buf, res))
+		return 0;
+
+	if (obj_pre_next(buf, res))
+		return 0;
+
+	return obj_next_filter(buf, res, obj, ign);
+}
+
+int ujson_obj_next(ujson_reader *buf, struct ujson_val *res)
+{
+	if (check_err(buf, res))
+		return 0;
+
+	if (obj_pre_next(buf, res))
+		return 0;
+
+	return obj_next(buf, res);
+}
+
+static int any_first(ujson_reader *buf, char b)
+{
+	if (is_cbor(buf)) {
+		if (cbor_any_first(buf, b))
+			return 1;
+	} else {
+		if (eatws(buf)) {
+			ujson_err(buf, "Unexpected end");
+			return 1;
+		}
+
+		if (!eatb(buf, b)) {
+			ujson_err(buf, "Expected '%c'", b);
+			return 1;
+		}
+	}
+
+	buf->depth++;
+
+	if (buf->depth > buf->max_depth) {
+		ujson_err(buf, "Recursion too deep");
+		return 1;
+	}
+
+#ifdef UJSON_READER_STATS
+	if (buf->depth > buf->stats.max_depth)
+		buf->stats.max_depth = buf->depth;
+#endif
+
+	return 0;
+}
+
+int ujson_obj_first_filter(ujson_reader *buf, struct ujson_val *res,
+                             const struct ujson_obj *obj, const struct ujson_obj *ign)
+{
+	if (check_err(buf, res))
+		return 0;
+
+	if (any_first(buf, '{'))
+		return 0;
+
+	if (check_end(buf, res, '}'))
+		return 0;
+
+	return obj_next_filter(buf, res, obj, ign);
+}
+
+int ujson_obj_first(ujson_reader *buf, struct ujson_val *res)
+{
+	if (check_err(buf, res))
+		return 0;
+
+	if (any_first(buf, '{'))
+		return 0;
+
+	if (check_end(buf, res, '}'))
+		return 0;
+
+	return obj_next(buf, res);
+}
+
+static int arr_next(ujson_reader *buf, struct ujson_val *res)
+{
+	return get_value(buf, res);
+}
+
+int ujson_arr_first(ujson_reader *buf, struct ujson_val *res)
+{
+	if (check_err(buf, res))
+		return 0;
+
+	if (any_first(buf, '['))
+		return 0;
+
+	if (check_end(buf, res, ']'))
+		return 0;
+
+	return arr_next(buf, res);
+}
+
+int ujson_arr_next(ujson_reader *buf, struct ujson_val *res)
+{
+	if (check_err(buf, res))
+		return 0;
+
+	if (check_end(buf, res, ']'))
+		return 0;
+
+	if (pre_next(buf, res))
+		return 0;
+
+	return arr_next(buf, res);
+}
+
+static void ujson_err_va(ujson_reader *buf, const char *fmt, va_list va)
+{
+	vsnprintf(buf->err, UJSON_ERR_MAX, fmt, va);
+}
+
+void ujson_err(ujson_reader *buf, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	ujson_err_va(buf, fmt, va);
+	va_end(va);
+}
+
+static void vprintf_line(ujson_reader *buf, const char *fmt, va_list va)
+{
+	char line[UJSON_ERR_MAX+1];
+
+	vsnprintf(line, sizeof(line), fmt, va);
+
+	line[UJSON_ERR_MAX] = 0;
+
+	buf->err_print(buf->err_print_priv, line);
+}
+
+static void printf_line(ujson_reader *buf, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vprintf_line(buf, fmt, va);
+	va_end(va);
+}
+
+static void printf_json_line(ujson_reader *buf, size_t line_nr, const char *buf_pos)
+{
+	char line[UJSON_ERR_MAX+1];
+	size_t plen, i;
+
+	plen = sprintf(line, "%03zu: ", line_nr);
+
+	for (i = 0; i < UJSON_ERR_MAX-plen && buf_pos[i] && buf_pos[i] != '\n'; i++)
+		line[i+plen] = buf_pos[i];
+
+	line[i+plen] = 0;
+
+	buf->err_print(buf->err_print_priv, line);
+}
+
+static void print_arrow(ujson_reader *buf, const char *buf_pos, size_t count)
+{
+	char line[count + 7];
+	size_t i;
+
+	/* The '000: ' prefix */
+	for (i = 0; i <= 5; i++)
+		line[i] = ' ';
+
+	for (i = 0; i < count; i++)
+		line[i+5] = buf_pos[i] == '\t' ? '\t' : ' ';
+
+	line[count+5] = '^';
+	line[count+6] = 0;
+
+	buf->err_print(buf->err_print_priv, line);
+}
+
+#define ERR_LINES 10
+
+#define MIN(A, B) ((A < B) ? (A) : (B))
+
+static void print_snippet(ujson_reader *buf, const char *type, size_t off)
+{
+	ssize_t i;
+	const char *lines[ERR_LINES] = {};
+	size_t cur_line = 0;
+	size_t cur_off = 0;
+	size_t last_off = off;
+
+	/*
+	 * There are no lines to show in a binary input and segmented input is
+	 * not a single null terminated string.
+	 */
+	if (is_cbor(buf) || buf->iov) {
+		printf_line(buf, "%s at offset %zu", type, off);
+		return;
+	}
+
+	for (;;) {
+		lines[(cur_line++) % ERR_LINES] = buf->json + cur_off;
+
+		while (cur_off < buf->len && buf->json[cur_off] != '\n')
+			cur_off++;
+
+		if (cur_off >= off)
+			break;
+
+		cur_off++;
+		last_off = off - cur_off;
+	}
+
+	printf_line(buf, "%s at line %03zu", type, cur_line);
+	buf->err_print(buf->err_print_priv, "");
+
+	size_t idx = 0;
+
+	for (i = MIN(ERR_LINES, cur_line); i > 0; i--) {
+		idx = (cur_line - i) % ERR_LINES;
+		printf_json_line(buf, cur_line - i + 1, lines[idx]);
+	}
+
+	print_arrow(buf, lines[idx], last_off);
+}
+
+void ujson_err_print(ujson_reader *buf)
+{
+	if (!buf->err_print)
+		return;
+
+	print_snippet(buf, "Parse error", buf->base + buf->off);
+	buf->err_print(buf->err_print_priv, buf->err);
 }
 
-size_t ujson_lookup(const void *arr, size_t memb_size, size_t list_len,
-                    const char *key)
+void ujson_warn(ujson_reader *buf, const char *fmt, ...)
 {
-	size_t l = 0;
-	size_t r = list_len-1;
-	size_t mid = -1;
+	struct ujson_diag_entry *entry;
+	va_list va;
 
-	if (!list_len)
-		return (size_t)-1;
+	if (buf->flags & UJSON_READER_STRICT) {
+		va_start(va, fmt);
+		ujson_err_va(buf, fmt, va);
+		va_end(va);
+		return;
+	}
 
-	while (r - l > 1) {
-		mid = (l+r)/2;
+	if (buf->diag) {
+		entry = diag_entry(buf, UJSON_DIAG_WARN);
+		if (!entry)
+			return;
 
-		int ret = strcmp(list_elem(arr, memb_size, mid), key);
-		if (!ret)
-			return mid;
+		entry->key[0] = 0;
+		entry->expected = UJSON_VOID;
+		entry->actual = UJSON_VOID;
 
-		if (ret < 0)
-			l = mid;
-		else
-			r = mid;
+		va_start(va, fmt);
+		vsnprintf(entry->msg, sizeof(entry->msg), fmt, va);
+		va_end(va);
+		return;
 	}
 
-	if (r != mid && !strcmp(list_elem(arr, memb_size, r), key))
-		return r;
+	if (!buf->err_print)
+		return;
 
-	if (l != mid && !strcmp(list_elem(arr, memb_size, l), key))
-		return l;
+	print_snippet(buf, "Warning", buf->base + buf->off);
 
-	return -1;
+	va_start(va, fmt);
+	vprintf_line(buf, fmt, va);
+	va_end(va);
 }
 
-static int skip_obj_val(ujson_reader *buf)
+void ujson_diag_print(ujson_reader *buf)
 {
-	struct ujson_val dummy = {};
+	struct ujson_diag *diag = buf->diag;
+	char msg[UJSON_ERR_MAX];
+	size_t i, cnt = 0;
 
-	if (!get_value(buf, &dummy))
-		return 0;
+	if (!diag || !buf->err_print)
+		return;
 
-	switch (dummy.type) {
-	case UJSON_OBJ:
-		return !ujson_obj_skip(buf);
-	case UJSON_ARR:
-		return !ujson_arr_skip(buf);
-	default:
-		return 1;
+	for (i = 0; i < diag->entries_used; i++) {
+		struct ujson_diag_entry *entry = &diag->entries[i];
+
+		print_snippet(buf, "Warning", entry->off);
+
+		if (entry->code == UJSON_DIAG_WARN) {
+			buf->err_print(buf->err_print_priv, entry->msg);
+			continue;
+		}
+
+		diag_msg(msg, sizeof(msg), entry->code, entry->key, entry->expected);
+		buf->err_print(buf->err_print_priv, msg);
+	}
+
+	for (i = 0; i < UJSON_DIAG_MAX; i++)
+		cnt += diag->cnt[i];
+
+	if (cnt > diag->entries_used) {
+		printf_line(buf, "%zu more warning(s) not recorded",
+		            cnt - diag->entries_used);
 	}
 }
 
-static int obj_next(ujson_reader *buf, struct ujson_val *res)
+void ujson_print(void *err_print_priv, const char *line)
 {
-	if (copy_id_str(buf, res->id, sizeof(res->id)))
-		return 0;
+	fputs(line, err_print_priv);
+	putc('\n', err_print_priv);
+}
 
-	return get_value(buf, res);
+/*
+ * Initializes a reader allocated with the JSON data in the buf[].
+ */
+static void reader_init(ujson_reader *self, size_t len)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->buf[len] = 0;
+	self->len = len;
+	self->max_depth = UJSON_RECURSION_MAX;
+	self->json = self->buf;
+	self->err_print = UJSON_ERR_PRINT;
+	self->err_print_priv = UJSON_ERR_PRINT_PRIV;
+	self->allocated = 1;
 }
 
-static int obj_pre_next(ujson_reader *buf, struct ujson_val *res)
+ujson_reader *ujson_reader_load(const char *path)
 {
-	if (ujson_reader_err(buf))
-		return 1;
+	int fd = open(path, O_RDONLY);
+	ujson_reader *ret;
+	ssize_t res;
+	off_t len, off = 0;
 
-	if (check_end(buf, res, '}'))
-		return 1;
+	if (fd < 0)
+		return NULL;
 
-	if (pre_next(buf, res))
-		return 1;
+	len = lseek(fd, 0, SEEK_END);
+	if (len == (off_t)-1) {
+		fprintf(stderr, "lseek() failed\n");
+		goto err0;
+	}
 
-	return 0;
+	if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
+		fprintf(stderr, "lseek() failed\n");
+		goto err0;
+	}
+
+	ret = malloc(sizeof(ujson_reader) + len + 1);
+	if (!ret) {
+		fprintf(stderr, "malloc() failed\n");
+		goto err0;
+	}
+
+	reader_init(ret, len);
+
+	while (off < len) {
+		res = read(fd, ret->buf + off, len - off);
+		if (res < 0) {
+			fprintf(stderr, "read() failed\n");
+			goto err1;
+		}
+
+		off += res;
+	}
+
+	close(fd);
+
+	return ret;
+err1:
+	free(ret);
+err0:
+	close(fd);
+	return NULL;
 }
 
-static int obj_next_filter(ujson_reader *buf, struct ujson_val *res,
-                           const struct ujson_obj *obj, const struct ujson_obj *ign)
+#ifdef UJSON_ZLIB
+#define GZ_INIT_SIZE (64 * 1024)
+
+ujson_reader *ujson_reader_load_gz(const char *path)
 {
-	const struct ujson_obj_attr *attr;
+	gzFile gz = gzopen(path, "rb");
+	ujson_reader *ret = NULL, *tmp;
+	size_t size = GZ_INIT_SIZE, len = 0;
+	struct stat st;
+
+	if (!gz)
+		return NULL;
+
+	gzbuffer(gz, 128 * 1024);
+
+	/* Start with a guess so that well compressed files are not copied many times */
+	if (!stat(path, &st) && (size_t)st.st_size * 4 > size)
+		size = st.st_size * 4;
 
 	for (;;) {
-		if (copy_id_str(buf, res->id, sizeof(res->id)))
-			return 0;
+		if (!ret || len == size) {
+			if (ret)
+				size *= 2;
+
+			tmp = realloc(ret, sizeof(ujson_reader) + size + 1);
+			if (!tmp) {
+				fprintf(stderr, "realloc() failed\n");
+				goto err;
+			}
 
-		res->idx = obj ? ujson_obj_lookup(obj, res->id) : (size_t)-1;
+			ret = tmp;
+		}
 
-		if (res->idx != (size_t)-1) {
-			if (!get_value(buf, res))
-				return 0;
+		size_t chunk = size - len > INT_MAX ? INT_MAX : size - len;
+		int res = gzread(gz, ret->buf + len, chunk);
 
-			attr = &obj->attrs[res->idx];
+		if (res < 0) {
+			int errnum;
 
-			if (attr->type == UJSON_VOID)
-				return 1;
+			fprintf(stderr, "gzread() failed: %s\n", gzerror(gz, &errnum));
+			goto err;
+		}
 
-			if (attr->type == res->type)
-				return 1;
+		if (!res)
+			break;
 
-			if (attr->type == UJSON_FLOAT &&
-			    res->type == UJSON_INT)
-				return 1;
+		len += res;
+	}
 
-			ujson_warn(buf, "Wrong '%s' type expected %s",
-				     attr->key, ujson_type_name(attr->type));
-		} else {
-			if (!skip_obj_val(buf))
-				return 0;
+	gzclose(gz);
 
-			if (ign && ujson_obj_lookup(ign, res->id) == (size_t)-1)
-				ujson_warn(buf, "Unexpected key '%s'", res->id);
-		}
+	reader_init(ret, len);
 
-		if (obj_pre_next(buf, res))
-			return 0;
+	return ret;
+err:
+	free(ret);
+	gzclose(gz);
+	return NULL;
+}
+#else
+ujson_reader *ujson_reader_load_gz(const char *path)
+{
+	unsigned char magic[2] = {};
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	if (read(fd, magic, sizeof(magic)) < 0)
+		magic[0] = 0;
+
+	close(fd);
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b) {
+		fprintf(stderr, "gzip support not compiled in\n");
+		errno = ENOSYS;
+		return NULL;
 	}
+
+	return ujson_reader_load(path);
 }
+#endif
 
-static int check_err(ujson_reader *buf, struct ujson_val *res)
+void ujson_reader_finish(ujson_reader *self)
 {
-	if (ujson_reader_err(buf)) {
-		res->type = UJSON_VOID;
-		return 1;
-	}
+	if (ujson_reader_err(self)) {
+		ujson_err_print(self);
+	} else if (!ujson_reader_consumed(self)) {
+		diag_warn(self, UJSON_DIAG_GARBAGE, NULL, UJSON_VOID, UJSON_VOID);
 
-	return 0;
+		if (ujson_reader_err(self))
+			ujson_err_print(self);
+	}
 }
 
-int ujson_obj_next_filter(ujson_reader *buf, struct ujson_val *res,
-                            const struct ujson_obj *obj, const struct ujson_obj *ign)
+#ifdef UJSON_READER_STATS
+void ujson_reader_stats_print(ujson_reader *buf)
 {
-	if (check_err(buf, res))
-		return 0;
+	struct ujson_reader_stats *stats = &buf->stats;
+	int i;
 
-	if (obj_pre_next(buf, res))
-		return 0;
+	if (!buf->err_print)
+		return;
 
-	return obj_next_filter(buf, res, obj, ign);
+	printf_line(buf, "Bytes consumed: %zu", buf->base + buf->off);
+
+	for (i = UJSON_INT; i <= UJSON_ARR; i++)
+		printf_line(buf, "Values %s: %zu", ujson_type_name(i), stats->values[i]);
+
+	printf_line(buf, "String bytes copied: %zu", stats->str_copied);
+	printf_line(buf, "String bytes passed: %zu", stats->str_passed);
+	printf_line(buf, "Escapes decoded: %zu", stats->escapes);
+	printf_line(buf, "Keys looked up: %zu", stats->keys_lookup);
+	printf_line(buf, "Keys matched: %zu", stats->keys_matched);
+	printf_line(buf, "Keys skipped: %zu", stats->keys_skipped);
+	printf_line(buf, "Bytes skipped: %zu", stats->skipped);
+	printf_line(buf, "Max depth: %u", stats->max_depth);
+}
+#else
+void ujson_reader_stats_print(ujson_reader *buf)
+{
+	if (!buf->err_print)
+		return;
+
+	printf_line(buf, "Reader statistics not compiled in");
 }
+#endif
+
+#define INDEX_MAGIC "UJSONIDX"
+#define INDEX_VERSION 1
+
+struct index_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t min_size;
+	/* The JSON file size, mtime and content hash */
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	uint64_t cnt;
+	uint64_t reserved;
+};
 
-int ujson_obj_next(ujson_reader *buf, struct ujson_val *res)
+/*
+ * A word at a time FNV-1a like hash, the file is hashed on each load so it
+ * has to be fast rather than strong.
+ */
+static uint64_t index_hash(const char *buf, size_t len)
 {
-	if (check_err(buf, res))
-		return 0;
+	uint64_t hash = 0xcbf29ce484222325ULL, w;
+	size_t i;
 
-	if (obj_pre_next(buf, res))
-		return 0;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, buf + i, sizeof(w));
+		hash = (hash ^ w) * 0x100000001b3ULL;
+		hash ^= hash >> 32;
+	}
 
-	return obj_next(buf, res);
+	for (; i < len; i++)
+		hash = (hash ^ (uint8_t)buf[i]) * 0x100000001b3ULL;
+
+	return hash ^ len;
 }
 
-static int any_first(ujson_reader *buf, char b)
+static void index_free(struct ujson_index *idx)
 {
-	if (eatws(buf)) {
-		ujson_err(buf, "Unexpected end");
-		return 1;
-	}
+	if (idx->map)
+		munmap(idx->map, idx->map_size);
+	else
+		free(idx->entries);
 
-	if (!eatb(buf, b)) {
-		ujson_err(buf, "Expected '%c'", b);
-		return 1;
-	}
+	free(idx);
+}
 
-	buf->depth++;
+static int index_add(struct ujson_index *idx, size_t start, size_t end)
+{
+	struct index_entry *tmp;
 
-	if (buf->depth > buf->max_depth) {
-		ujson_err(buf, "Recursion too deep");
-		return 1;
+	if (idx->cnt == idx->size) {
+		idx->size = idx->size ? 2 * idx->size : 64;
+
+		tmp = realloc(idx->entries, idx->size * sizeof(*tmp));
+		if (!tmp)
+			return 1;
+
+		idx->entries = tmp;
 	}
 
+	idx->entries[idx->cnt].start = start;
+	idx->entries[idx->cnt].end = end;
+	idx->cnt++;
+
 	return 0;
 }
 
-int ujson_obj_first_filter(ujson_reader *buf, struct ujson_val *res,
-                             const struct ujson_obj *obj, const struct ujson_obj *ign)
+static int index_walk(ujson_reader *buf, struct ujson_index *idx,
+                      enum ujson_type type, size_t min_size)
 {
-	if (check_err(buf, res))
-		return 0;
+	struct ujson_val val = {};
+	size_t start = buf->off;
 
-	if (any_first(buf, '{'))
-		return 0;
+	if (type == UJSON_OBJ) {
+		UJSON_OBJ_FOREACH(buf, &val) {
+			if ((val.type == UJSON_OBJ || val.type == UJSON_ARR) &&
+			    index_walk(buf, idx, val.type, min_size))
+				return 1;
+		}
+	} else {
+		UJSON_ARR_FOREACH(buf, &val) {
+			if ((val.type == UJSON_OBJ || val.type == UJSON_ARR) &&
+			    index_walk(buf, idx, val.type, min_size))
+				return 1;
+		}
+	}
+
+	if (ujson_reader_err(buf))
+		return 1;
 
-	if (check_end(buf, res, '}'))
+	if (buf->off - start < min_size)
 		return 0;
 
-	return obj_next_filter(buf, res, obj, ign);
+	return index_add(idx, start, buf->off);
 }
 
-int ujson_obj_first(ujson_reader *buf, struct ujson_val *res)
+static int index_cmp(const void *a, const void *b)
 {
-	if (check_err(buf, res))
-		return 0;
-
-	if (any_first(buf, '{'))
-		return 0;
+	const struct index_entry *ea = a, *eb = b;
 
-	if (check_end(buf, res, '}'))
-		return 0;
-
-	return obj_next(buf, res);
+	return ea->start < eb->start ? -1 : ea->start > eb->start;
 }
 
-static int arr_next(ujson_reader *buf, struct ujson_val *res)
+static struct ujson_index *index_build(ujson_reader *buf, size_t min_size)
 {
-	return get_value(buf, res);
-}
+	struct ujson_index *idx = calloc(1, sizeof(*idx));
+	enum ujson_type type;
+	int ret = 0;
 
-int ujson_arr_first(ujson_reader *buf, struct ujson_val *res)
-{
-	if (check_err(buf, res))
-		return 0;
+	if (!idx)
+		return NULL;
 
-	if (any_first(buf, '['))
-		return 0;
+	/* Loops over documents for NDJSON */
+	while (!ret && !ujson_reader_consumed(buf)) {
+		type = ujson_reader_start(buf);
 
-	if (check_end(buf, res, ']'))
-		return 0;
+		if (type == UJSON_VOID)
+			ret = 1;
+		else
+			ret = index_walk(buf, idx, type, min_size);
+	}
 
-	return arr_next(buf, res);
-}
+	ujson_reader_reset(buf);
 
-int ujson_arr_next(ujson_reader *buf, struct ujson_val *res)
-{
-	if (check_err(buf, res))
-		return 0;
+	memset(&buf->stats, 0, sizeof(buf->stats));
 
-	if (check_end(buf, res, ']'))
-		return 0;
+	if (ret) {
+		index_free(idx);
+		return NULL;
+	}
 
-	if (pre_next(buf, res))
-		return 0;
+	/* Entries were added when the containers ended */
+	qsort(idx->entries, idx->cnt, sizeof(*idx->entries), index_cmp);
 
-	return arr_next(buf, res);
+	return idx;
 }
 
-static void ujson_err_va(ujson_reader *buf, const char *fmt, va_list va)
+static void index_hdr_init(struct index_hdr *hdr, const struct stat *st,
+                           uint64_t hash, size_t min_size)
 {
-	vsnprintf(buf->err, UJSON_ERR_MAX, fmt, va);
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->version = INDEX_VERSION;
+	hdr->min_size = min_size;
+	hdr->size = st->st_size;
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->hash = hash;
 }
 
-void ujson_err(ujson_reader *buf, const char *fmt, ...)
+static struct ujson_index *index_load(const char *path, const struct index_hdr *exp)
 {
-	va_list va;
+	const struct index_hdr *hdr;
+	struct ujson_index *idx;
+	struct index_entry *entries;
+	struct stat st;
+	void *map;
+	size_t i;
+	int fd;
 
-	va_start(va, fmt);
-	ujson_err_va(buf, fmt, va);
-	va_end(va);
-}
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-static void vprintf_line(ujson_reader *buf, const char *fmt, va_list va)
-{
-	char line[UJSON_ERR_MAX+1];
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
 
-	vsnprintf(line, sizeof(line), fmt, va);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 
-	line[UJSON_ERR_MAX] = 0;
+	if (map == MAP_FAILED)
+		return NULL;
 
-	buf->err_print(buf->err_print_priv, line);
-}
+	hdr = map;
+	entries = (void *)(hdr + 1);
 
-static void printf_line(ujson_reader *buf, const char *fmt, ...)
-{
-	va_list va;
+	if (memcmp(hdr, exp, offsetof(struct index_hdr, cnt)) ||
+	    hdr->cnt != (st.st_size - sizeof(*hdr)) / sizeof(*entries) ||
+	    (st.st_size - sizeof(*hdr)) % sizeof(*entries))
+		goto err;
 
-	va_start(va, fmt);
-	vprintf_line(buf, fmt, va);
-	va_end(va);
+	for (i = 0; i < hdr->cnt; i++) {
+		if (entries[i].start >= entries[i].end ||
+		    entries[i].end > exp->size)
+			goto err;
+
+		if (i && entries[i-1].start >= entries[i].start)
+			goto err;
+	}
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		goto err;
+
+	idx->entries = entries;
+	idx->cnt = hdr->cnt;
+	idx->map = map;
+	idx->map_size = st.st_size;
+
+	return idx;
+err:
+	munmap(map, st.st_size);
+	return NULL;
 }
 
-static void printf_json_line(ujson_reader *buf, size_t line_nr, const char *buf_pos)
+/*
+ * The index is written into a temporary file that is renamed over the old one
+ * so that concurrent loads never see a partial index.
+ */
+static void index_save(const char *path, struct index_hdr *hdr,
+                       const struct ujson_index *idx)
 {
-	char line[UJSON_ERR_MAX+1];
-	size_t plen, i;
+	char tmp_path[PATH_MAX];
+	int fd;
 
-	plen = sprintf(line, "%03zu: ", line_nr);
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.%i.tmp", path, (int)getpid())
+	    >= (int)sizeof(tmp_path))
+		return;
 
-	for (i = 0; i < UJSON_ERR_MAX-plen && buf_pos[i] && buf_pos[i] != '\n'; i++)
-		line[i+plen] = buf_pos[i];
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
 
-	line[i+plen] = 0;
+	hdr->cnt = idx->cnt;
 
-	buf->err_print(buf->err_print_priv, line);
+	if (write(fd, hdr, sizeof(*hdr)) != sizeof(*hdr))
+		goto err;
+
+	size_t len = idx->cnt * sizeof(*idx->entries), off = 0;
+	const char *data = (const char *)idx->entries;
+
+	while (off < len) {
+		ssize_t res = write(fd, data + off, len - off);
+
+		if (res <= 0)
+			goto err;
+
+		off += res;
+	}
+
+	if (close(fd)) {
+		unlink(tmp_path);
+		return;
+	}
+
+	if (rename(tmp_path, path))
+		unlink(tmp_path);
+
+	return;
+err:
+	close(fd);
+	unlink(tmp_path);
 }
 
-static void print_arrow(ujson_reader *buf, const char *buf_pos, size_t count)
+ujson_reader *ujson_reader_load_indexed(const char *path, const char *index_path,
+                                        size_t min_size)
 {
-	char line[count + 7];
-	size_t i;
+	char def_path[PATH_MAX];
+	struct index_hdr hdr;
+	struct stat st;
+	ujson_reader *ret;
 
-	/* The '000: ' prefix */
-	for (i = 0; i <= 5; i++)
-		line[i] = ' ';
+	if (!min_size)
+		min_size = UJSON_INDEX_MIN_SIZE;
 
-	for (i = 0; i < count; i++)
-		line[i+5] = buf_pos[i] == '\t' ? '\t' : ' ';
+	if (!index_path) {
+		if (snprintf(def_path, sizeof(def_path), "%s.idx", path) >= (int)sizeof(def_path)) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
 
-	line[count+5] = '^';
-	line[count+6] = 0;
+		index_path = def_path;
+	}
 
-	buf->err_print(buf->err_print_priv, line);
-}
+	if (stat(path, &st))
+		return NULL;
 
-#define ERR_LINES 10
+	ret = ujson_reader_load(path);
+	if (!ret)
+		return NULL;
 
-#define MIN(A, B) ((A < B) ? (A) : (B))
+	/* The file has changed in between, the hash would not match anyway */
+	if ((size_t)st.st_size != ret->len)
+		return ret;
 
-static void print_snippet(ujson_reader *buf, const char *type)
-{
-	ssize_t i;
-	const char *lines[ERR_LINES] = {};
-	size_t cur_line = 0;
-	size_t cur_off = 0;
-	size_t last_off = buf->off;
+	index_hdr_init(&hdr, &st, index_hash(ret->json, ret->len), min_size);
 
-	for (;;) {
-		lines[(cur_line++) % ERR_LINES] = buf->json + cur_off;
+	ret->index = index_load(index_path, &hdr);
+	if (ret->index)
+		return ret;
 
-		while (cur_off < buf->len && buf->json[cur_off] != '\n')
-			cur_off++;
+	ret->index = index_build(ret, min_size);
+	if (ret->index)
+		index_save(index_path, &hdr, ret->index);
 
-		if (cur_off >= buf->off)
-			break;
+	return ret;
+}
 
-		cur_off++;
-		last_off = buf->off - cur_off;
-	}
+static ujson_reader *iov_alloc(size_t iov_cnt)
+{
+	ujson_reader *ret;
 
-	printf_line(buf, "%s at line %03zu", type, cur_line);
-	buf->err_print(buf->err_print_priv, "");
+	ret = malloc(sizeof(ujson_reader) + 1);
+	if (!ret)
+		return NULL;
 
-	size_t idx = 0;
+	reader_init(ret, 0);
 
-	for (i = MIN(ERR_LINES, cur_line); i > 0; i--) {
-		idx = (cur_line - i) % ERR_LINES;
-		printf_json_line(buf, cur_line - i + 1, lines[idx]);
+	ret->iov = malloc(sizeof(struct ujson_iov) + iov_cnt * sizeof(struct iovec));
+	if (!ret->iov) {
+		free(ret);
+		return NULL;
 	}
 
-	print_arrow(buf, lines[idx], last_off);
+	memset(ret->iov, 0, sizeof(struct ujson_iov));
+	ret->iov->cnt = iov_cnt;
+
+	return ret;
 }
 
-void ujson_err_print(ujson_reader *buf)
+ujson_reader *ujson_reader_iov(const struct iovec *iov, size_t iov_cnt)
 {
-	if (!buf->err_print)
-		return;
+	ujson_reader *ret = iov_alloc(iov_cnt);
 
-	print_snippet(buf, "Parse error");
-	buf->err_print(buf->err_print_priv, buf->err);
+	if (!ret)
+		return NULL;
+
+	memcpy(ret->iov->vec, iov, iov_cnt * sizeof(*iov));
+
+	ujson_reader_iov_seek(ret, 0);
+
+	return ret;
 }
 
-void ujson_warn(ujson_reader *buf, const char *fmt, ...)
+void ujson_reader_iov_seek(ujson_reader *self, size_t off)
 {
-	va_list va;
+	struct ujson_iov *iov = self->iov;
+	size_t i, pos = 0;
 
-	if (buf->flags & UJSON_READER_STRICT) {
-		va_start(va, fmt);
-		ujson_err_va(buf, fmt, va);
-		va_end(va);
+	if (iov->stream) {
+		ujson_err(self, "Cannot seek in a stream");
 		return;
 	}
 
-	if (!buf->err_print)
-		return;
+	for (i = 0; i < iov->cnt; i++) {
+		if (off < pos + iov->vec[i].iov_len)
+			break;
 
-	print_snippet(buf, "Warning");
+		pos += iov->vec[i].iov_len;
+	}
 
-	va_start(va, fmt);
-	vprintf_line(buf, fmt, va);
-	va_end(va);
+	/* Offsets past the end are moved to the end */
+	if (i >= iov->cnt)
+		off = pos;
+
+	self->json = self->buf;
+	self->len = 0;
+	self->off = 0;
+	self->base = off;
+	iov->next = i;
+	iov->next_off = off - pos;
+
+	iov_next(self);
 }
 
-void ujson_print(void *err_print_priv, const char *line)
+static void stream_free(struct iov_stream *stream)
 {
-	fputs(line, err_print_priv);
-	putc('\n', err_print_priv);
+#ifdef UJSON_IO_URING
+	if (stream->ring.fd >= 0) {
+		int res;
+
+		/* The kernel may be still reading into the buffer */
+		if (stream->busy)
+			stream_wait(stream, &res);
+
+		ujson_uring_free(&stream->ring);
+	}
+#endif
+
+	if (stream->close_fd)
+		close(stream->fd);
+
+	free(stream);
 }
 
-ujson_reader *ujson_reader_load(const char *path)
+ujson_reader *ujson_reader_stream_fd(int fd, size_t buf_size,
+                                     enum ujson_reader_stream_flags flags)
 {
-	int fd = open(path, O_RDONLY);
+	struct iov_stream *stream;
 	ujson_reader *ret;
-	ssize_t res;
-	off_t len, off = 0;
 
-	if (fd < 0)
+	if (!buf_size)
+		buf_size = UJSON_READER_STREAM_BUF_SIZE;
+
+	ret = iov_alloc(2);
+	if (!ret)
 		return NULL;
 
-	len = lseek(fd, 0, SEEK_END);
-	if (len == (off_t)-1) {
-		fprintf(stderr, "lseek() failed\n");
-		goto err0;
+	stream = malloc(sizeof(struct iov_stream) + 2 * buf_size);
+	if (!stream) {
+		ujson_reader_free(ret);
+		return NULL;
 	}
 
-	if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
-		fprintf(stderr, "lseek() failed\n");
-		goto err0;
-	}
+	memset(stream, 0, sizeof(*stream));
 
-	ret = malloc(sizeof(ujson_reader) + len + 1);
-	if (!ret) {
-		fprintf(stderr, "malloc() failed\n");
-		goto err0;
+	stream->fd = fd;
+	stream->buf_size = buf_size;
+
+	ret->iov->stream = stream;
+	ret->iov->vec[0].iov_base = stream->buf;
+	ret->iov->vec[1].iov_base = stream->buf + buf_size;
+
+#ifdef UJSON_IO_URING
+	struct stat st;
+
+	stream->ring.fd = -1;
+
+	if ((flags & UJSON_READER_STREAM_IO_URING) &&
+	    !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		stream->off = lseek(fd, 0, SEEK_CUR);
+		if (stream->off >= 0)
+			ujson_uring_setup(&stream->ring, 2);
 	}
+#else
+	(void)flags;
+#endif
 
-	memset(ret, 0, sizeof(*ret));
+	/* Read the first segment so that the reader is not consumed */
+	iov_next(ret);
 
-	ret->buf[len] = 0;
-	ret->len = len;
-	ret->max_depth = UJSON_RECURSION_MAX;
-	ret->json = ret->buf;
-	ret->err_print = UJSON_ERR_PRINT;
-	ret->err_print_priv = UJSON_ERR_PRINT_PRIV;
+	return ret;
+}
 
-	while (off < len) {
-		res = read(fd, ret->buf + off, len - off);
-		if (res < 0) {
-			fprintf(stderr, "read() failed\n");
-			goto err1;
-		}
+ujson_reader *ujson_reader_stream_open(const char *path, size_t buf_size,
+                                       enum ujson_reader_stream_flags flags)
+{
+	int fd = open(path, O_RDONLY);
+	ujson_reader *ret;
 
-		off += res;
+	if (fd < 0)
+		return NULL;
+
+	ret = ujson_reader_stream_fd(fd, buf_size, flags);
+	if (!ret) {
+		close(fd);
+		return NULL;
 	}
 
-	close(fd);
+	ret->iov->stream->close_fd = 1;
 
 	return ret;
-err1:
-	free(ret);
-err0:
-	close(fd);
-	return NULL;
 }
 
-void ujson_reader_finish(ujson_reader *self)
+ujson_reader *ujson_reader_fork(const ujson_reader *self, ujson_reader_state state)
 {
-	if (ujson_reader_err(self)) {
-		ujson_err_print(self);
-	} else if (!ujson_reader_consumed(self)) {
-		ujson_warn(self, "Garbage after JSON string!");
+	ujson_reader *ret;
 
-		if (ujson_reader_err(self))
-			ujson_err_print(self);
+	if (self->iov) {
+		if (self->iov->stream)
+			return NULL;
+
+		ret = iov_alloc(self->iov->cnt);
+		if (!ret)
+			return NULL;
+
+		memcpy(ret->iov->vec, self->iov->vec,
+		       self->iov->cnt * sizeof(struct iovec));
+	} else {
+		ret = malloc(sizeof(ujson_reader) + 1);
+		if (!ret)
+			return NULL;
+
+		reader_init(ret, 0);
+
+		ret->json = self->json;
+		ret->len = self->len;
 	}
+
+	ret->parent = self;
+	ret->index = self->index;
+	ret->flags = self->flags;
+	ret->max_depth = self->max_depth;
+	ret->err_print = self->err_print;
+	ret->err_print_priv = self->err_print_priv;
+
+	ujson_reader_state_load(ret, state);
+
+	return ret;
 }
 
 void ujson_reader_free(ujson_reader *buf)
 {
+	/* The index is owned by the reader the cursor was forked from */
+	if (buf->index && !buf->parent)
+		index_free(buf->index);
+
+	if (buf->iov) {
+		if (buf->iov->stream)
+			stream_free(buf->iov->stream);
+
+		free(buf->iov->scratch);
+		free(buf->iov);
+	}
+
+	free(buf->cbor_left);
+
 	free(buf);
 }
 
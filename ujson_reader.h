@@ -18,6 +18,8 @@
 #define UJSON_READER_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include <ujson_common.h>
 
 /**
@@ -38,10 +40,148 @@
 	.flags = rflags \
 }
 
+/**
+ * @brief A stack of item counts for definite length CBOR containers.
+ */
+typedef uint32_t ujson_cbor_stack[UJSON_RECURSION_MAX];
+
+/**
+ * @brief An ujson_reader initializer for CBOR input.
+ *
+ * Readers allocated by the library allocate the CBOR container stack on
+ * demand, readers initialized by this macro use the stack passed by the
+ * caller, which has to stay valid while the reader is used.
+ *
+ * @param buf A pointer to a buffer with CBOR data.
+ * @param buf_len A CBOR data buffer lenght.
+ * @param rflags enum ujson_reader_flags, UJSON_READER_CBOR is added.
+ * @param stack A ujson_cbor_stack.
+ *
+ * @return An ujson_reader initialized with default values.
+ */
+#define UJSON_READER_CBOR_INIT(buf, buf_len, rflags, stack) { \
+	.max_depth = UJSON_RECURSION_MAX, \
+	.err_print = UJSON_ERR_PRINT, \
+	.err_print_priv = UJSON_ERR_PRINT_PRIV, \
+	.json = buf, \
+	.len = buf_len, \
+	.flags = (rflags) | UJSON_READER_CBOR, \
+	.cbor_left = stack \
+}
+
 /** @brief Reader flags. */
 enum ujson_reader_flags {
 	/** @brief If set warnings are treated as errors. */
 	UJSON_READER_STRICT = 0x01,
+	/**
+	 * @brief The input is CBOR (RFC 8949) rather than JSON.
+	 *
+	 * Maps, arrays, text strings, integers, floats and simple values
+	 * true, false, null and undefined are mapped to the corresponding
+	 * ujson_type, tags are skipped and byte strings are rejected. Both
+	 * definite and indefinite length items are accepted.
+	 */
+	UJSON_READER_CBOR = 0x02,
+};
+
+/**
+ * @brief A structured warning codes.
+ *
+ * Warnings produced by the parser are recorded with these codes into the
+ * struct ujson_diag when it's attached to the reader.
+ */
+enum ujson_diag_code {
+	/** @brief A free form warning passed to ujson_warn(). */
+	UJSON_DIAG_WARN,
+	/** @brief A key that is not on the object or ignore list. */
+	UJSON_DIAG_UNEXPECTED_KEY,
+	/** @brief A value with a type different from the one in the object list. */
+	UJSON_DIAG_WRONG_TYPE,
+	/** @brief Non-whitespace characters after the end of JSON. */
+	UJSON_DIAG_GARBAGE,
+	/** @brief Number of diagnostic codes. */
+	UJSON_DIAG_MAX,
+};
+
+/**
+ * @brief A recorded warning.
+ */
+struct ujson_diag_entry {
+	/** @brief A warning code. */
+	enum ujson_diag_code code;
+	/** @brief An offset into the JSON string where the warning was raised. */
+	size_t off;
+	/** @brief Expected type for UJSON_DIAG_WRONG_TYPE. */
+	enum ujson_type expected;
+	/** @brief Parsed type for UJSON_DIAG_WRONG_TYPE. */
+	enum ujson_type actual;
+	/** @brief An object key the warning is about, if any. */
+	char key[UJSON_ID_MAX];
+	/** @brief A formatted message, set only for UJSON_DIAG_WARN. */
+	char msg[UJSON_ERR_MAX];
+};
+
+/**
+ * @brief A diagnostics sink.
+ *
+ * If attached to a reader, warnings are not formatted and printed when they
+ * happen but recorded into the entries array instead. Once the array is full
+ * only the per code counters are increased. The warnings can be printed later
+ * with ujson_diag_print().
+ *
+ * Note that warnings are still turned into errors if UJSON_READER_STRICT is
+ * set.
+ */
+struct ujson_diag {
+	/** @brief An user supplied array to record the warnings to. */
+	struct ujson_diag_entry *entries;
+	/** @brief A size of the entries array. */
+	size_t entries_max;
+	/** @brief Number of recorded entries. */
+	size_t entries_used;
+	/** @brief Number of warnings per code, including those not recorded. */
+	size_t cnt[UJSON_DIAG_MAX];
+};
+
+/**
+ * @brief An ujson_diag initializer.
+ *
+ * @param dentries An array of struct ujson_diag_entry.
+ * @param dentries_max A size of the array.
+ *
+ * @return An ujson_diag initialized with default values.
+ */
+#define UJSON_DIAG_INIT(dentries, dentries_max) { \
+	.entries = dentries, \
+	.entries_max = dentries_max, \
+}
+
+/**
+ * @brief A reader statistics.
+ *
+ * The statistics are always part of the ujson_reader, the counters are updated
+ * only when the library is built with UJSON_READER_STATS defined, e.g. with
+ * 'make STATS=1', otherwise they stay zeroed.
+ */
+struct ujson_reader_stats {
+	/** @brief Number of parsed values per enum ujson_type. */
+	size_t values[UJSON_ARR + 1];
+	/** @brief String bytes copied into the ujson_val buffer. */
+	size_t str_copied;
+	/** @brief String bytes validated but not copied, i.e. skipped strings. */
+	size_t str_passed;
+	/** @brief Number of decoded escape sequences. */
+	size_t escapes;
+	/** @brief Keys looked up in the ujson_obj attribute list. */
+	size_t keys_lookup;
+	/** @brief Keys found in the ujson_obj attribute list. */
+	size_t keys_matched;
+	/** @brief Keys whose values were skipped. */
+	size_t keys_skipped;
+	/** @brief Bytes skipped over as values of skipped keys. */
+	size_t skipped;
+	/** @brief Maximal recursion depth reached. */
+	unsigned int max_depth;
 };
 
 /**
@@ -54,8 +194,12 @@ struct ujson_reader {
 	size_t len;
 	/** A current offset into the JSON string */
 	size_t off;
-	/** An offset to the start of the last array or object */
+	/** An offset of the json string in the input, set for segmented input */
+	size_t base;
+	/** An offset to the start of the last array or object in the whole input */
 	size_t sub_off;
+	/** An offset to the start of the last value */
+	size_t val_off;
 	/** Recursion depth increased when array/object is entered decreased on leave */
 	unsigned int depth;
 	/** Maximal recursion depth */
@@ -68,7 +212,31 @@ struct ujson_reader {
 	void (*err_print)(void *err_print_priv, const char *line);
 	void *err_print_priv;
 
+	/** Optional diagnostics sink, if set warnings are recorded there */
+	struct ujson_diag *diag;
+
+	/** Optional index of large containers, see ujson_reader_load_indexed() */
+	struct ujson_index *index;
+
+	/** Segmented input, see ujson_reader_iov() and ujson_reader_stream_fd() */
+	struct ujson_iov *iov;
+
+	/** Set for cursors, see ujson_reader_fork() */
+	const struct ujson_reader *parent;
+
 	char err[UJSON_ERR_MAX];
+
+	/**
+	 * Items left in definite length CBOR containers indexed by depth, see
+	 * UJSON_READER_CBOR_INIT()
+	 */
+	uint32_t *cbor_left;
+	/** Set for readers allocated by the library, cbor_left is allocated on demand */
+	int allocated;
+
+	/** Parser statistics, see ujson_reader_stats_print() */
+	struct ujson_reader_stats stats;
+
 	char buf[];
 };
 
@@ -196,6 +364,17 @@ void ujson_err_print(ujson_reader *self);
 void ujson_warn(ujson_reader *self, const char *fmt, ...)
                __attribute__((format(printf, 2, 3)));
 
+/**
+ * @brief Prints warnings recorded in the diagnostics sink.
+ *
+ * Each recorded warning is printed along with a few lines of context from the
+ * JSON, the same way ujson_warn() does, followed by a summary of warnings that
+ * did not fit into the entries array.
+ *
+ * @param self A ujson_reader with a diag sink attached.
+ */
+void ujson_diag_print(ujson_reader *self);
+
 /**
  * @brief Returns true if error was encountered.
  *
@@ -448,6 +627,17 @@ typedef struct ujson_reader_state {
 	unsigned int depth;
 } ujson_reader_state;
 
+/**
+ * @brief Moves a reader with a segmented input to an offset.
+ *
+ * This is called by ujson_reader_state_load() and ujson_reader_reset() for
+ * readers created by ujson_reader_iov().
+ *
+ * @param self A ujson_reader created by ujson_reader_iov().
+ * @param off An offset into the input, i.e. all the segments.
+ */
+void ujson_reader_iov_seek(ujson_reader *self, size_t off);
+
 /**
  * @brief Returns a parser state at the start of current object/array.
  *
@@ -481,7 +671,11 @@ static inline void ujson_reader_state_load(ujson_reader *self, ujson_reader_stat
 	if (ujson_reader_err(self))
 		return;
 
-	self->off = state.off;
+	if (self->iov)
+		ujson_reader_iov_seek(self, state.off);
+	else
+		self->off = state.off;
+
 	self->sub_off = state.off;
 	self->depth = state.depth;
 }
@@ -493,7 +687,11 @@ static inline void ujson_reader_state_load(ujson_reader *self, ujson_reader_stat
  */
 static inline void ujson_reader_reset(ujson_reader *self)
 {
-	self->off = 0;
+	if (self->iov)
+		ujson_reader_iov_seek(self, 0);
+	else
+		self->off = 0;
+
 	self->sub_off = 0;
 	self->depth = 0;
 	self->err[0] = 0;
@@ -509,6 +707,148 @@ static inline void ujson_reader_reset(ujson_reader *self)
  */
 ujson_reader *ujson_reader_load(const char *path);
 
+/**
+ * @brief Loads a gzip compressed file into an ujson_reader buffer.
+ *
+ * The file is decompressed directly into the reader buffer, files that are
+ * not compressed are loaded as they are. Compressed files are supported only
+ * if the library was built with zlib, i.e. 'make ZLIB=1', otherwise the call
+ * fails with errno set to ENOSYS.
+ *
+ * The reader has to be later freed by ujson_reader_free().
+ *
+ * @param path A path to a file.
+ * @return A ujson_reader or NULL in a case of a failure.
+ */
+ujson_reader *ujson_reader_load_gz(const char *path);
+
+/** @brief A default minimal size of a container recorded in the index. */
+#define UJSON_INDEX_MIN_SIZE 1024
+
+/**
+ * @brief Loads a file into an ujson_reader buffer along with a parse index.
+ *
+ * The index records start and end offsets of containers larger than
+ * min_size, ujson_obj_skip() and ujson_arr_skip() then jump over these
+ * instead of parsing them, which makes filtering a large document nearly free
+ * of the skipped parts.
+ *
+ * The index is stored into a sidecar file together with the size, mtime and a
+ * hash of the JSON file. If the sidecar file matches the JSON file it's
+ * mapped into memory instead of building the index again. Otherwise the file
+ * is scanned once, which validates it as well, and the index is saved for the
+ * next time. Invalid JSON is not indexed, the parse errors are reported on
+ * parsing as usual.
+ *
+ * The reader has to be later freed by ujson_reader_free().
+ *
+ * @param path A path to a JSON file.
+ * @param index_path A path to the index file, NULL means path with ".idx"
+ *                   appended.
+ * @param min_size A minimal size of an indexed container, 0 means
+ *                 UJSON_INDEX_MIN_SIZE.
+ * @return A ujson_reader or NULL in a case of a failure.
+ */
+ujson_reader *ujson_reader_load_indexed(const char *path, const char *index_path,
+                                        size_t min_size);
+
+/**
+ * @brief Creates a reader over a JSON split into several buffers.
+ *
+ * This is meant for data received as a chain of buffers, e.g. from a network
+ * stack, that would otherwise have to be copied into a single buffer first.
+ * The buffers are parsed in place, only tokens that cross a buffer boundary
+ * are copied into a small scratch buffer. The iovec array is copied, the
+ * buffers it points to have to stay valid until the reader is freed.
+ *
+ * Only JSON input is supported, the UJSON_READER_CBOR flag must not be set.
+ * Offsets in error messages are offsets into the whole input.
+ *
+ * The reader has to be later freed by ujson_reader_free().
+ *
+ * @param iov An array of buffers.
+ * @param iov_cnt A number of buffers in the iov array.
+ * @return A ujson_reader or NULL in a case of a failure.
+ */
+ujson_reader *ujson_reader_iov(const struct iovec *iov, size_t iov_cnt);
+
+/** @brief A default stream reader buffer size. */
+#define UJSON_READER_STREAM_BUF_SIZE (64 * 1024)
+
+/** @brief Stream reader flags. */
+enum ujson_reader_stream_flags {
+	/**
+	 * @brief Reads the file ahead asynchronously with io_uring.
+	 *
+	 * The next buffer is read while the current one is being parsed.
+	 * Silently falls back to read() if io_uring support was not compiled
+	 * in, is not available or if the fd is not a regular file.
+	 */
+	UJSON_READER_STREAM_IO_URING = 0x01,
+};
+
+/**
+ * @brief Creates a reader that reads a file descriptor as it parses.
+ *
+ * The input is read into two buffers of buf_size as the parsing advances,
+ * which keeps the memory use constant regardless of the input size and works
+ * for pipes and stdin as well. Tokens that cross a buffer boundary are copied
+ * into a scratch buffer, which grows only if a single token is longer than
+ * the buffer size.
+ *
+ * Since the input is not kept in memory ujson_reader_state_load() and
+ * ujson_reader_reset() fail with an error. Only JSON input is supported.
+ *
+ * The reader has to be later freed by ujson_reader_free(), the fd is not
+ * closed.
+ *
+ * @param fd A file descriptor open for reading.
+ * @param buf_size A buffer size, pass 0 for UJSON_READER_STREAM_BUF_SIZE.
+ * @param flags A bitwise combination of enum ujson_reader_stream_flags.
+ * @return A ujson_reader or NULL in a case of a failure.
+ */
+ujson_reader *ujson_reader_stream_fd(int fd, size_t buf_size,
+                                     enum ujson_reader_stream_flags flags);
+
+/**
+ * @brief Opens a file and creates a stream reader for it.
+ *
+ * Same as ujson_reader_stream_fd() but the file is closed when the reader is
+ * freed by ujson_reader_free().
+ *
+ * @param path A path to a file.
+ * @param buf_size A buffer size, pass 0 for UJSON_READER_STREAM_BUF_SIZE.
+ * @param flags A bitwise combination of enum ujson_reader_stream_flags.
+ * @return A ujson_reader or NULL in a case of a failure.
+ */
+ujson_reader *ujson_reader_stream_open(const char *path, size_t buf_size,
+                                       enum ujson_reader_stream_flags flags);
+
+/**
+ * @brief Creates a cursor over the input of a reader.
+ *
+ * A cursor is a reader that shares the input buffer, the index and the
+ * flags with the reader it was forked from but keeps its own position,
+ * depth and error. It's positioned at a saved state, i.e. at a start of an
+ * object or an array, which is then parsed as usual starting with
+ * ujson_reader_start(). Cursors are meant for walking different parts of a
+ * single loaded document from several threads, each thread has to use its
+ * own cursor, but none of them modifies the shared input so no locking is
+ * needed.
+ *
+ * Diagnostics are not recorded for cursors, errors are stored and printed
+ * as usual. Readers created by ujson_reader_iov() can be forked as well, each
+ * cursor then has its own scratch buffer. Stream readers cannot be forked.
+ *
+ * The cursor has to be freed by ujson_reader_free() before the reader it was
+ * forked from.
+ *
+ * @param self A reader to fork.
+ * @param state A state returned by ujson_reader_state_save().
+ * @return A new cursor or NULL in a case of a failure.
+ */
+ujson_reader *ujson_reader_fork(const ujson_reader *self, ujson_reader_state state);
+
 /**
  * @brief Frees an ujson_reader buffer.
  *
@@ -529,6 +869,16 @@ void ujson_reader_free(ujson_reader *self);
  */
 void ujson_reader_finish(ujson_reader *self);
 
+/**
+ * @brief Prints reader statistics.
+ *
+ * The statistics are passed to the err_print() handler. If the library was
+ * compiled without UJSON_READER_STATS only a short note is printed.
+ *
+ * @param self A ujson_reader
+ */
+void ujson_reader_stats_print(ujson_reader *self);
+
 /**
  * @brief Returns non-zero if whole buffer has been consumed.
  *
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#include <stdlib.h>
+
+#include "ujson_reader.h"
+#include "ujson_writer.h"
+#include "ujson_transcode.h"
+
+static const struct ujson_transcode_opts no_opts;
+
+static int is_dropped(const struct ujson_transcode_opts *opts, const char *key)
+{
+	if (!opts->drop)
+		return 0;
+
+	return ujson_obj_lookup(opts->drop, key) != (size_t)-1;
+}
+
+static const char *renamed(const struct ujson_transcode_opts *opts, const char *key)
+{
+	size_t idx;
+
+	if (!opts->rename)
+		return key;
+
+	idx = ujson_lookup(opts->rename, sizeof(*opts->rename), opts->rename_cnt, key);
+	if (idx == (size_t)-1)
+		return key;
+
+	return opts->rename[idx].new_key;
+}
+
+struct transcode {
+	ujson_reader *reader;
+	ujson_writer *writer;
+	const struct ujson_transcode_opts *opts;
+	/* String buffer, set only when converting between JSON and CBOR */
+	char *buf;
+	size_t buf_size;
+};
+
+static void transcode_obj(struct transcode *t, const char *id);
+
+static void transcode_arr(struct transcode *t, const char *id);
+
+/*
+ * Scalars in a different output format are written from the parsed values.
+ */
+static void convert_val(struct transcode *t, struct ujson_val *val, const char *id)
+{
+	switch (val->type) {
+	case UJSON_STR:
+		ujson_str_add(t->writer, id, val->val_str);
+	break;
+	case UJSON_INT:
+		ujson_int64_add(t->writer, id, val->val_int);
+	break;
+	case UJSON_FLOAT:
+		ujson_float_add(t->writer, id, val->val_float);
+	break;
+	case UJSON_BOOL:
+		ujson_bool_add(t->writer, id, val->val_bool);
+	break;
+	case UJSON_NULL:
+		ujson_null_add(t->writer, id);
+	break;
+	default:
+	break;
+	}
+}
+
+static void transcode_val(struct transcode *t, struct ujson_val *val, const char *id)
+{
+	ujson_reader *reader = t->reader;
+
+	switch (val->type) {
+	case UJSON_OBJ:
+		transcode_obj(t, id);
+	break;
+	case UJSON_ARR:
+		transcode_arr(t, id);
+	break;
+	case UJSON_VOID:
+	break;
+	default:
+		if (t->buf) {
+			convert_val(t, val, id);
+			break;
+		}
+
+		/* Scalars are copied from the source as they are */
+		ujson_raw_add(t->writer, id, reader->json + reader->val_off,
+		              reader->off - reader->val_off);
+	break;
+	}
+}
+
+/*
+ * Unless the formats differ the values are read without a string buffer,
+ * strings are validated and passed but never copied. When converting all
+ * strings are unescaped into the single buffer since each of them is written
+ * out before the next value is parsed.
+ */
+static void transcode_obj(struct transcode *t, const char *id)
+{
+	struct ujson_val val = {.buf = t->buf, .buf_size = t->buf_size};
+	ujson_reader *reader = t->reader;
+
+	ujson_obj_start(t->writer, id);
+
+	UJSON_OBJ_FOREACH(reader, &val) {
+		if (is_dropped(t->opts, val.id)) {
+			if (val.type == UJSON_OBJ)
+				ujson_obj_skip(reader);
+			else if (val.type == UJSON_ARR)
+				ujson_arr_skip(reader);
+			continue;
+		}
+
+		transcode_val(t, &val, renamed(t->opts, val.id));
+	}
+
+	ujson_obj_finish(t->writer);
+}
+
+static void transcode_arr(struct transcode *t, const char *id)
+{
+	struct ujson_val val = {.buf = t->buf, .buf_size = t->buf_size};
+
+	ujson_arr_start(t->writer, id);
+
+	UJSON_ARR_FOREACH(t->reader, &val)
+		transcode_val(t, &val, NULL);
+
+	ujson_arr_finish(t->writer);
+}
+
+static int needs_convert(ujson_reader *reader, ujson_writer *writer)
+{
+	int cbor_in = !!(reader->flags & UJSON_READER_CBOR);
+	int cbor_out = !!(writer->flags & UJSON_WRITER_CBOR);
+
+	return cbor_in != cbor_out;
+}
+
+int ujson_transcode(ujson_reader *reader, ujson_writer *writer,
+                    const struct ujson_transcode_opts *opts)
+{
+	struct transcode t = {
+		.reader = reader,
+		.writer = writer,
+		.opts = opts ? opts : &no_opts,
+	};
+	int ret = 0;
+
+	if (needs_convert(reader, writer)) {
+		t.buf_size = t.opts->str_max ? t.opts->str_max : UJSON_TRANSCODE_STR_MAX;
+		t.buf = malloc(t.buf_size + 1);
+		if (!t.buf) {
+			ujson_err(reader, "Failed to allocate string buffer");
+			return 1;
+		}
+		t.buf_size++;
+	}
+
+	while (!ujson_reader_consumed(reader)) {
+		switch (ujson_reader_start(reader)) {
+		case UJSON_OBJ:
+			transcode_obj(&t, NULL);
+		break;
+		case UJSON_ARR:
+			transcode_arr(&t, NULL);
+		break;
+		default:
+			ret = 1;
+			goto exit;
+		}
+
+		if (ujson_reader_err(reader) || ujson_writer_finish(writer)) {
+			ret = 1;
+			goto exit;
+		}
+	}
+exit:
+	free(t.buf);
+	return ret;
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/**
+ * @file ujson_transcode.h
+ * @brief Streams JSON from a reader into a writer.
+ *
+ * The document is copied in a single pass without building a tree, the memory
+ * usage is bounded by the maximal recursion depth. The output format, i.e.
+ * minified or reindented, is controlled by the writer flags. Strings and
+ * numbers are copied as they are in the source, they are neither unescaped
+ * nor converted.
+ *
+ * If exactly one of the reader and writer is set to CBOR the values are
+ * parsed and written by their types instead, which converts JSON to CBOR and
+ * back.
+ */
+
+#ifndef UJSON_TRANSCODE_H
+#define UJSON_TRANSCODE_H
+
+#include <ujson_common.h>
+#include <ujson_reader.h>
+
+/** @brief A default maximal string length when converting JSON and CBOR. */
+#define UJSON_TRANSCODE_STR_MAX (64 * 1024)
+
+/**
+ * @brief An object key rename.
+ */
+typedef struct ujson_rename {
+	/** @brief A key in the source document. */
+	const char *key;
+	/** @brief A key to be written instead. */
+	const char *new_key;
+} ujson_rename;
+
+/** @brief Transcoding options. */
+struct ujson_transcode_opts {
+	/**
+	 * @brief Object keys to drop along with their values.
+	 *
+	 * The attributes have to be sorted by key, the types are ignored.
+	 * May be NULL.
+	 */
+	const ujson_obj *drop;
+
+	/**
+	 * @brief Object keys to rename.
+	 *
+	 * The array has to be sorted by key. May be NULL.
+	 */
+	const ujson_rename *rename;
+	/** @brief A size of the rename array. */
+	size_t rename_cnt;
+	/**
+	 * @brief A maximal string length when converting JSON and CBOR.
+	 *
+	 * Zero means UJSON_TRANSCODE_STR_MAX.
+	 */
+	size_t str_max;
+};
+
+/**
+ * @brief Copies JSON documents from a reader into a writer.
+ *
+ * All documents up to the end of the reader buffer are transcoded, which
+ * makes it work for NDJSON as well, and ujson_writer_finish() is called after
+ * each of them.
+ *
+ * @param reader A JSON reader.
+ * @param writer A JSON writer.
+ * @param opts Transcoding options, may be NULL.
+ *
+ * @return Zero on success, non-zero if either the reader or the writer failed.
+ */
+int ujson_transcode(ujson_reader *reader, ujson_writer *writer,
+                    const struct ujson_transcode_opts *opts);
+
+#endif /* UJSON_TRANSCODE_H */
@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+#ifdef UJSON_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ujson_uring.h"
+
+int ujson_uring_setup(struct ujson_uring *self, unsigned int entries)
+{
+	struct io_uring_params p = {};
+
+	self->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (self->fd < 0)
+		return 1;
+
+	self->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	self->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	self->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (self->cq_ring_size > self->sq_ring_size)
+			self->sq_ring_size = self->cq_ring_size;
+		self->cq_ring_size = self->sq_ring_size;
+	}
+
+	self->sq_ring = mmap(NULL, self->sq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+	if (self->sq_ring == MAP_FAILED)
+		goto err0;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		self->cq_ring = self->sq_ring;
+	} else {
+		self->cq_ring = mmap(NULL, self->cq_ring_size, PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_CQ_RING);
+		if (self->cq_ring == MAP_FAILED)
+			goto err1;
+	}
+
+	self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQES);
+	if (self->sqes == MAP_FAILED)
+		goto err2;
+
+	self->sq_tail = self->sq_ring + p.sq_off.tail;
+	self->sq_mask = self->sq_ring + p.sq_off.ring_mask;
+	self->sq_array = self->sq_ring + p.sq_off.array;
+	self->cq_head = self->cq_ring + p.cq_off.head;
+	self->cq_tail = self->cq_ring + p.cq_off.tail;
+	self->cq_mask = self->cq_ring + p.cq_off.ring_mask;
+	self->cqes = self->cq_ring + p.cq_off.cqes;
+
+	return 0;
+err2:
+	if (self->cq_ring != self->sq_ring)
+		munmap(self->cq_ring, self->cq_ring_size);
+err1:
+	munmap(self->sq_ring, self->sq_ring_size);
+err0:
+	close(self->fd);
+	self->fd = -1;
+	return 1;
+}
+
+void ujson_uring_free(struct ujson_uring *self)
+{
+	munmap(self->sqes, self->sqes_size);
+
+	if (self->cq_ring != self->sq_ring)
+		munmap(self->cq_ring, self->cq_ring_size);
+
+	munmap(self->sq_ring, self->sq_ring_size);
+	close(self->fd);
+	self->fd = -1;
+}
+
+struct io_uring_sqe *ujson_uring_sqe(struct ujson_uring *self)
+{
+	unsigned int slot = *self->sq_tail & *self->sq_mask;
+	struct io_uring_sqe *sqe = &self->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+int ujson_uring_submit(struct ujson_uring *self)
+{
+	unsigned int tail = *self->sq_tail;
+	unsigned int slot = tail & *self->sq_mask;
+
+	self->sq_array[slot] = slot;
+	__atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, self->fd, 1, 0, 0, NULL, 0) != 1)
+		return 1;
+
+	return 0;
+}
+
+int ujson_uring_wait(struct ujson_uring *self, uint64_t *user_data, int *res)
+{
+	for (;;) {
+		unsigned int head = *self->cq_head;
+
+		if (head == __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(__NR_io_uring_enter, self->fd, 0, 1,
+			            IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR)
+				return 1;
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &self->cqes[head & *self->cq_mask];
+
+		*user_data = cqe->user_data;
+		*res = cqe->res;
+
+		__atomic_store_n(self->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		return 0;
+	}
+}
+
+#endif /* UJSON_IO_URING */
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2024 Cyril Hrubis <metan@ucw.cz>
+ */
+
+/**
+ * @file ujson_uring.h
+ * @brief A minimal io_uring wrapper shared by the file reader and writer.
+ *
+ * The ring is set up with raw syscalls so that there is no dependency on
+ * liburing. Available only if the library was built with 'make IO_URING=1'.
+ */
+
+#ifndef UJSON_URING_H
+#define UJSON_URING_H
+
+#ifdef UJSON_IO_URING
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/** @brief An io_uring instance. */
+struct ujson_uring {
+	/** @brief A ring file descriptor, -1 if not set up. */
+	int fd;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/**
+ * @brief Sets up an io_uring.
+ *
+ * @param self An io_uring to set up.
+ * @param entries A number of submission queue entries.
+ *
+ * @return Zero on success, non-zero if io_uring is not available.
+ */
+int ujson_uring_setup(struct ujson_uring *self, unsigned int entries);
+
+/**
+ * @brief Frees an io_uring.
+ *
+ * @param self An io_uring to free.
+ */
+void ujson_uring_free(struct ujson_uring *self);
+
+/**
+ * @brief Returns a zeroed submission queue entry to be filled in.
+ *
+ * @param self An io_uring.
+ *
+ * @return A submission queue entry, it's passed to the kernel by
+ *         ujson_uring_submit().
+ */
+struct io_uring_sqe *ujson_uring_sqe(struct ujson_uring *self);
+
+/**
+ * @brief Submits the entry returned by ujson_uring_sqe().
+ *
+ * @param self An io_uring.
+ *
+ * @return Zero on success, non-zero on a failure and errno is set.
+ */
+int ujson_uring_submit(struct ujson_uring *self);
+
+/**
+ * @brief Waits for a completion.
+ *
+ * @param self An io_uring.
+ * @param user_data Set to the user_data of the completed entry.
+ * @param res Set to the result of the completed entry.
+ *
+ * @return Zero on success, non-zero on a failure and errno is set.
+ */
+int ujson_uring_wait(struct ujson_uring *self, uint64_t *user_data, int *res);
+
+#endif /* UJSON_IO_URING */
+
+#endif /* UJSON_URING_H */
@@ -4,12 +4,29 @@
  */
 
 #include <stddef.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include <ujson_utf.h>
 
-int8_t ujson_utf8_next_chsz(const char *str, size_t off)
+/*
+ * Number of bytes of a character by its first byte, zero for the string
+ * terminator and -1 for continuation and invalid bytes.
+ */
+static const int8_t utf8_lead_len[256] = {
+	[0x01 ... 0x7f] = 1,
+	[0x80 ... 0xbf] = -1,
+	[0xc0 ... 0xdf] = 2,
+	[0xe0 ... 0xef] = 3,
+	[0xf0 ... 0xf7] = 4,
+	[0xf8 ... 0xff] = -1,
+};
+
+int8_t ujson_utf8_next_chsz_mb(const char *str, size_t off)
 {
-	char ch = str[off];
-	uint8_t len = 0;
+	uint8_t ch = str[off];
 
 	if (!ch)
 		return 0;
@@ -17,89 +34,179 @@ int8_t ujson_utf8_next_chsz(const char *str, size_t off)
 	if (UJSON_UTF8_IS_ASCII(ch))
 		return 1;
 
-	if (UJSON_UTF8_IS_2BYTE(ch)) {
-		len = 2;
-		goto ret;
-	}
-
-	if (UJSON_UTF8_IS_3BYTE(ch)) {
-		len = 3;
-		goto ret;
-	}
-
-	if (UJSON_UTF8_IS_4BYTE(ch)) {
-		len = 4;
-		goto ret;
-	}
-
-	return -1;
-ret:
+	/*
+	 * The length is decided by branches rather than looked up in the
+	 * utf8_lead_len table so that the caller does not wait for a second
+	 * load before it can advance. A continuation byte is checked before
+	 * the next one is read, so we never read past the terminator.
+	 */
 	if (!UJSON_UTF8_IS_NBYTE(str[off+1]))
 		return -1;
 
-	if (len > 2 && !UJSON_UTF8_IS_NBYTE(str[off+2]))
+	if (UJSON_UTF8_IS_2BYTE(ch))
+		return 2;
+
+	if (!UJSON_UTF8_IS_NBYTE(str[off+2]))
 		return -1;
 
-	if (len > 3 && !UJSON_UTF8_IS_NBYTE(str[off+3]))
+	if (UJSON_UTF8_IS_3BYTE(ch))
+		return 3;
+
+	if (!UJSON_UTF8_IS_NBYTE(str[off+3]))
 		return -1;
 
-	return len;
+	if (UJSON_UTF8_IS_4BYTE(ch))
+		return 4;
+
+	return -1;
 }
 
 int8_t ujson_utf8_prev_chsz(const char *str, size_t off)
 {
+	int8_t len;
 	char ch;
 
 	if (!off)
 		return 0;
 
-	ch = str[--off];
-
-	if (UJSON_UTF8_IS_ASCII(ch))
+	if (UJSON_UTF8_IS_ASCII(str[off-1]))
 		return 1;
 
-	if (!UJSON_UTF8_IS_NBYTE(ch))
-		return -1;
-
-	if (off < 1)
-		return -1;
+	for (len = 1; len <= 4 && (size_t)len <= off; len++) {
+		ch = str[off-len];
 
-	ch = str[--off];
+		if (!UJSON_UTF8_IS_NBYTE(ch))
+			return utf8_lead_len[(uint8_t)ch] == len ? len : -1;
+	}
 
-	if (UJSON_UTF8_IS_2BYTE(ch))
-		return 2;
+	return -1;
+}
 
-	if (!UJSON_UTF8_IS_NBYTE(ch))
-		return -1;
+/*
+ * The block loads are aligned, so they never cross a page boundary and cannot
+ * fault past the string terminator. They may still read bytes past the
+ * terminator in the same block, same as the libc string functions do, which
+ * is why the address sanitizer is turned off for them.
+ */
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
 
-	if (off < 1)
-		return -1;
+static inline int block_aligned(const char *str, size_t size)
+{
+	return !((uintptr_t)str & (size - 1));
+}
 
-	ch = str[--off];
+#ifdef __SSE2__
+/*
+ * Counts characters in aligned blocks of 16 bytes starting at a character
+ * boundary.
+ *
+ * Bitmasks of continuation and lead bytes are computed for each block, the
+ * lead bytes define where continuation bytes have to be, including the ones
+ * that carry over to the next block. The block is valid if the continuation
+ * bytes are exactly where expected and there are no invalid or zero bytes.
+ * Returns the first character boundary not processed.
+ */
+static NO_SANITIZE_ADDRESS const char *utf8_count_blocks(const char *str, size_t *cnt)
+{
+	const __m128i v_zero = _mm_setzero_si128();
+	const __m128i v_cont = _mm_set1_epi8((char)0xc0);
+	const __m128i v_lead3 = _mm_set1_epi8((char)0xdf);
+	const __m128i v_lead4 = _mm_set1_epi8((char)0xef);
+	const __m128i v_inval = _mm_set1_epi8((char)0xf7);
+	const char *boundary = str;
+	size_t boundary_cnt = *cnt, n = *cnt;
+	uint32_t carry = 0;
+
+	if (!block_aligned(str, 16))
+		return str;
+
+	for (;;) {
+		__m128i v = _mm_load_si128((const __m128i *)str);
+		uint32_t high = _mm_movemask_epi8(v);
+		uint32_t zero = _mm_movemask_epi8(_mm_cmpeq_epi8(v, v_zero));
+
+		if (zero)
+			break;
+
+		/* Plain ASCII */
+		if (!high && !carry) {
+			n += 16;
+			str += 16;
+			boundary = str;
+			boundary_cnt = n;
+			continue;
+		}
+
+		/* Signed compares, masked by the high bit to exclude ASCII */
+		uint32_t cont = _mm_movemask_epi8(_mm_cmplt_epi8(v, v_cont));
+		uint32_t lead3 = _mm_movemask_epi8(_mm_cmpgt_epi8(v, v_lead3)) & high;
+		uint32_t lead4 = _mm_movemask_epi8(_mm_cmpgt_epi8(v, v_lead4)) & high;
+		uint32_t inval = _mm_movemask_epi8(_mm_cmpgt_epi8(v, v_inval)) & high;
+		uint32_t lead = high & ~cont;
+		uint32_t expect = carry | lead << 1 | lead3 << 2 | lead4 << 3;
+
+		if (inval || (expect & 0xffff) != cont)
+			break;
+
+		carry = expect >> 16;
+		n += 16 - __builtin_popcount(cont);
+		str += 16;
+
+		if (!carry) {
+			boundary = str;
+			boundary_cnt = n;
+		} else {
+			/* The last lead byte starts an unfinished character */
+			unsigned int last = 31 - __builtin_clz(~cont & 0xffff);
+
+			boundary = str - 16 + last;
+			boundary_cnt = n - 1;
+		}
+	}
 
-	if (UJSON_UTF8_IS_3BYTE(ch))
-		return 3;
+	*cnt = boundary_cnt;
+	return boundary;
+}
+#else
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH 0x8080808080808080ULL
 
-	if (!UJSON_UTF8_IS_NBYTE(ch))
-		return -1;
+typedef uint64_t __attribute__((may_alias)) swar_word;
 
-	if (off < 1)
-		return -1;
+/*
+ * Counts ASCII characters an aligned word at a time, stops at the first word
+ * with a zero or non-ASCII byte.
+ */
+static NO_SANITIZE_ADDRESS const char *utf8_count_blocks(const char *str, size_t *cnt)
+{
+	while (block_aligned(str, 8)) {
+		uint64_t w = *(const swar_word *)str;
 
-	ch = str[--off];
+		if (((w - SWAR_ONES) | w) & SWAR_HIGH)
+			break;
 
-	if (UJSON_UTF8_IS_4BYTE(ch))
-		return 4;
+		*cnt += 8;
+		str += 8;
+	}
 
-	return -1;
+	return str;
 }
+#endif
 
 size_t ujson_utf8_strlen(const char *str)
 {
 	size_t cnt = 0;
+	int8_t len;
 
-	while (ujson_utf8_next(&str))
-		cnt++;
+	for (;;) {
+		str = utf8_count_blocks(str, &cnt);
 
-	return cnt;
+		/* Unaligned heads, blocks with a terminator or invalid bytes */
+		len = ujson_utf8_next_chsz(str, 0);
+		if (len <= 0)
+			return cnt;
+
+		str += len;
+		cnt++;
+	}
 }
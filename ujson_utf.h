@@ -80,14 +80,34 @@ static inline uint32_t ujson_utf8_next(const char **str)
 	return 0;
 }
 
+/**
+ * @brief A slow path of ujson_utf8_next_chsz() for non-ASCII bytes and the
+ *        string terminator.
+ *
+ * @param str A pointer to a string.
+ * @param off An offset into the string, must point to a valid multibyte boundary.
+ * @return Number of bytes next character occupies, zero on string end and -1 on failure.
+ */
+int8_t ujson_utf8_next_chsz_mb(const char *str, size_t off);
+
 /**
  * @brief Returns number of bytes next character is occupying in an UTF-8 string.
  *
+ * The ASCII case is inlined, everything else is handled by
+ * ujson_utf8_next_chsz_mb().
+ *
  * @param str A pointer to a string.
  * @param off An offset into the string, must point to a valid multibyte boundary.
  * @return Number of bytes next character occupies, zero on string end and -1 on failure.
  */
-int8_t ujson_utf8_next_chsz(const char *str, size_t off);
+static inline int8_t ujson_utf8_next_chsz(const char *str, size_t off)
+{
+	/* Printable and control ASCII, i.e. 0x01 - 0x7f */
+	if ((uint8_t)(str[off] - 1) < 0x7f)
+		return 1;
+
+	return ujson_utf8_next_chsz_mb(str, off);
+}
 
 /**
  * @brief Returns number of bytes previous character is occupying in an UTF-8 string.
@@ -102,7 +122,10 @@ int8_t ujson_utf8_prev_chsz(const char *str, size_t off);
  * @brief Returns a number of characters in UTF-8 string.
  *
  * Returns number of characters in an UTF-8 string, which may be less or equal
- * to what strlen() reports.
+ * to what strlen() reports. Counting stops at the first invalid sequence.
+ *
+ * The string is validated and counted a block of bytes at a time, SSE2 is used
+ * when available.
  *
  * @param str An UTF-8 string.
  * @return Number of characters in the string.
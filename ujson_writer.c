@@ -10,8 +10,25 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <math.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef UJSON_ZLIB
+# include <limits.h>
+# include <zlib.h>
+#endif
+
+#ifdef UJSON_IO_URING
+# include <sys/stat.h>
+#endif
+
+#include "ujson_uring.h"
 #include "ujson_utf.h"
+#include "ujson_num.h"
+#include "ujson_reader.h"
 #include "ujson_writer.h"
 
 static inline int get_depth_bit(ujson_writer *self, char *mask)
@@ -82,367 +99,1358 @@ static inline int is_err(ujson_writer *buf)
 	return buf->err[0];
 }
 
-static inline int out(ujson_writer *self, const char *buf, size_t len)
+int ujson_writer_flush(ujson_writer *self)
 {
-	return self->out(self, buf, len);
-}
+	size_t used = self->buf_used;
 
-static inline int out_str(ujson_writer *self, const char *str)
-{
-	return out(self, str, strlen(str));
-}
+	if (!used)
+		return 0;
 
-static inline int out_ch(ujson_writer *self, char ch)
-{
-	return out(self, &ch, 1);
-}
+	self->buf_used = 0;
 
-#define ESC_FLUSH(esc_char) do {\
-	out(self, val, i); \
-	val += i + 1; \
-	i = 0; \
-	out_str(self, esc_char); \
-} while (0)
+	return self->out(self, self->buf, used);
+}
 
-static inline int out_esc_str(ujson_writer *self, const char *val)
+/*
+ * Writes the buffer content and a large chunk in a single call, which saves
+ * both a syscall and copying the chunk into the buffer.
+ */
+static int out_batch(ujson_writer *self, const char *buf, size_t len)
 {
-	if (out_ch(self, '"'))
-		return 1;
+	struct iovec iov[2] = {
+		{.iov_base = self->buf, .iov_len = self->buf_used},
+		{.iov_base = (void*)buf, .iov_len = len},
+	};
 
-	size_t i = 0;
-	int8_t next_chsz;
+	if (!self->buf_used)
+		return self->outv(self, iov + 1, 1);
 
-	do {
-		next_chsz = ujson_utf8_next_chsz(val, i);
+	self->buf_used = 0;
 
-		if (next_chsz == 1) {
-			switch (val[i]) {
-			case '\"':
-				ESC_FLUSH("\\\"");
-			break;
-			case '\\':
-				ESC_FLUSH("\\\\");
-			break;
-			case '/':
-				ESC_FLUSH("\\/");
-			break;
-			case '\b':
-				ESC_FLUSH("\\b");
-			break;
-			case '\f':
-				ESC_FLUSH("\\f");
-			break;
-			case '\n':
-				ESC_FLUSH("\\n");
-			break;
-			case '\r':
-				ESC_FLUSH("\\r");
-			break;
-			case '\t':
-				ESC_FLUSH("\\t");
-			break;
-			default:
-				i += next_chsz;
-			}
-		} else {
-			i += next_chsz;
-		}
-	} while (next_chsz);
+	return self->outv(self, iov, 2);
+}
 
-	if (i) {
-		if (out(self, val, i))
-			return 1;
+/*
+ * Called when data does not fit into the rest of the output buffer.
+ */
+static int out_slow(ujson_writer *self, const char *buf, size_t len)
+{
+	if (!self->buf) {
+		self->buf = self->buf__;
+		self->buf_size = sizeof(self->buf__);
+	} else if (self->outv && len >= self->buf_size / 2) {
+		return out_batch(self, buf, len);
+	} else if (ujson_writer_flush(self)) {
+		return 1;
 	}
 
-	if (out_ch(self, '"'))
-		return 1;
+	if (len > self->buf_size)
+		return self->out(self, buf, len);
+
+	memcpy(self->buf, buf, len);
+	self->buf_used = len;
 
 	return 0;
 }
 
-static int do_padd(ujson_writer *self)
+static inline int out(ujson_writer *self, const char *buf, size_t len)
 {
-	unsigned int i;
-
-	for (i = 0; i < self->depth; i++) {
-		if (out_ch(self, ' '))
-			return 1;
+	if (len <= self->buf_size - self->buf_used) {
+		memcpy(self->buf + self->buf_used, buf, len);
+		self->buf_used += len;
+		return 0;
 	}
 
-	return 0;
+	return out_slow(self, buf, len);
 }
 
-static int newline(ujson_writer *self)
+static inline int out_str(ujson_writer *self, const char *str)
 {
-	if (out_ch(self, '\n'))
-		return 0;
+	return out(self, str, strlen(str));
+}
 
-	if (do_padd(self))
-		return 1;
+static inline int out_ch(ujson_writer *self, char ch)
+{
+	if (self->buf_used < self->buf_size) {
+		self->buf[self->buf_used++] = ch;
+		return 0;
+	}
 
-	return 0;
+	return out_slow(self, &ch, 1);
 }
 
-static int add_common(ujson_writer *self, const char *id)
+/*
+ * Bytes that are not copied verbatim, i.e. characters that have to be escaped
+ * and UTF-8 multibyte sequences that have to be validated.
+ */
+#define ESC_NONE 0
+#define ESC_CHAR 1
+#define ESC_SLASH 2
+#define ESC_UTF8 3
+
+static const uint8_t esc_class[256] = {
+	[0x00 ... 0x1f] = ESC_CHAR,
+	['"'] = ESC_CHAR,
+	['\\'] = ESC_CHAR,
+	['/'] = ESC_SLASH,
+	[0x80 ... 0xff] = ESC_UTF8,
+};
+
+static inline int needs_esc(unsigned char b, int esc_slash)
 {
-	if (is_err(self))
-		return 1;
+	uint8_t class = esc_class[b];
 
-	if (!self->depth) {
-		err(self, "Object/Array has to be started first");
-		return 1;
-	}
+	return class && (class != ESC_SLASH || esc_slash);
+}
 
-	if (in_arr(self)) {
-		if (id) {
-			err(self, "Array entries can't have id");
-			return 1;
-		}
-	} else {
-		if (!id) {
-			err(self, "Object entries must have id");
-			return 1;
-		}
-	}
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH 0x8080808080808080ULL
 
-	if (!is_first(self) && out_ch(self, ','))
-		return 1;
+/*
+ * Returns non-zero if any byte in a word is less than 0x20, has the high bit
+ * set or is one of '"', '\\' and optionally '/'.
+ */
+static inline uint64_t swar_needs_esc(uint64_t w, int esc_slash)
+{
+	uint64_t quote = w ^ (SWAR_ONES * '"');
+	uint64_t bslash = w ^ (SWAR_ONES * '\\');
+	uint64_t ret;
 
-	if (self->depth && newline(self))
-		return 1;
+	ret = (w - SWAR_ONES * 0x20) & ~w;
+	ret |= (quote - SWAR_ONES) & ~quote;
+	ret |= (bslash - SWAR_ONES) & ~bslash;
 
-	if (id) {
-		if (out_esc_str(self, id))
-			return 1;
+	if (esc_slash) {
+		uint64_t slash = w ^ (SWAR_ONES * '/');
 
-		if (out_str(self, ": "))
-			return 1;
+		ret |= (slash - SWAR_ONES) & ~slash;
 	}
 
-	return 0;
+	return (ret | w) & SWAR_HIGH;
 }
 
-int ujson_obj_start(ujson_writer *self, const char *id)
+/*
+ * Returns length of the prefix of str that can be copied to the output
+ * verbatim.
+ */
+static size_t esc_scan(const char *str, size_t len, int esc_slash)
 {
-	if (self->depth >= UJSON_RECURSION_MAX)
-		return 1;
+	size_t i = 0;
 
-	if (!self->depth && id) {
-		err(self, "Top level object cannot have id");
-		return 1;
+#ifdef __SSE2__
+	const __m128i v_quote = _mm_set1_epi8('"');
+	const __m128i v_bslash = _mm_set1_epi8('\\');
+	const __m128i v_slash = _mm_set1_epi8(esc_slash ? '/' : '"');
+	const __m128i v_ctrl = _mm_set1_epi8(0x20);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+		/* Signed compare catches both bytes < 0x20 and >= 0x80 */
+		__m128i m = _mm_cmplt_epi8(v, v_ctrl);
+
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, v_quote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, v_bslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, v_slash));
+
+		int mask = _mm_movemask_epi8(m);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
 	}
+#endif
 
-	if (self->depth && add_common(self, id))
-		return 1;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
 
-	if (out_ch(self, '{'))
-		return 1;
+		memcpy(&w, str + i, sizeof(w));
 
-	set_depth_bit(self, 1);
+		if (swar_needs_esc(w, esc_slash))
+			break;
+	}
 
-	return 0;
+	for (; i < len; i++) {
+		if (needs_esc(str[i], esc_slash))
+			return i;
+	}
+
+	return len;
 }
 
-int ujson_obj_finish(ujson_writer *self)
+/*
+ * Returns size of a valid UTF-8 multibyte sequence at the start of str or
+ * zero if the sequence is not valid.
+ */
+static size_t utf8_chsz(const char *str, size_t len)
 {
-	if (is_err(self))
-		return 1;
+	unsigned char ch = str[0];
+	size_t i, chsz;
+
+	if (UJSON_UTF8_IS_2BYTE(ch))
+		chsz = 2;
+	else if (UJSON_UTF8_IS_3BYTE(ch))
+		chsz = 3;
+	else if (UJSON_UTF8_IS_4BYTE(ch))
+		chsz = 4;
+	else
+		return 0;
 
-	if (!in_obj(self)) {
-		err(self, "Not in object!");
-		return 1;
+	if (chsz > len)
+		return 0;
+
+	for (i = 1; i < chsz; i++) {
+		if (!UJSON_UTF8_IS_NBYTE(str[i]))
+			return 0;
 	}
 
-	int first = is_first(self);
+	return chsz;
+}
 
-	clear_depth_bit(self);
+static const char esc_short[0x20] = {
+	['\b'] = 'b',
+	['\f'] = 'f',
+	['\n'] = 'n',
+	['\r'] = 'r',
+	['\t'] = 't',
+};
 
-	if (!first)
-		newline(self);
+static int out_esc_ch(ujson_writer *self, unsigned char b)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6] = {'\\', b};
 
-	return out_ch(self, '}');
+	if (b >= 0x20)
+		return out(self, esc, 2);
+
+	if (esc_short[b]) {
+		esc[1] = esc_short[b];
+		return out(self, esc, 2);
+	}
+
+	esc[1] = 'u';
+	esc[2] = '0';
+	esc[3] = '0';
+	esc[4] = hex[b>>4];
+	esc[5] = hex[b & 0xf];
+
+	return out(self, esc, 6);
 }
 
-int ujson_arr_start(ujson_writer *self, const char *id)
+static void hex4(char *buf, uint32_t val)
 {
-	if (self->depth >= UJSON_RECURSION_MAX) {
-		err(self, "Recursion too deep");
-		return 1;
-	}
+	static const char hex[] = "0123456789abcdef";
 
-	if (!self->depth && id) {
-		err(self, "Top level array cannot have id");
-		return 1;
-	}
+	buf[0] = hex[(val >> 12) & 0xf];
+	buf[1] = hex[(val >> 8) & 0xf];
+	buf[2] = hex[(val >> 4) & 0xf];
+	buf[3] = hex[val & 0xf];
+}
 
-	if (self->depth && add_common(self, id))
-		return 1;
+/*
+ * Writes a valid multibyte character as \uXXXX, characters outside of the
+ * BMP are written as a surrogate pair.
+ */
+static int out_esc_ucode(ujson_writer *self, const char *str)
+{
+	uint32_t ucode = ujson_utf8_next(&str);
+	char esc[12] = {'\\', 'u', 0, 0, 0, 0, '\\', 'u'};
 
-	if (out_ch(self, '['))
-		return 1;
+	if (ucode < 0x10000) {
+		hex4(esc + 2, ucode);
+		return out(self, esc, 6);
+	}
 
-	set_depth_bit(self, 0);
+	ucode -= 0x10000;
+	hex4(esc + 2, 0xd800 | ucode >> 10);
+	hex4(esc + 8, 0xdc00 | (ucode & 0x3ff));
 
-	return 0;
+	return out(self, esc, 12);
 }
 
-int ujson_arr_finish(ujson_writer *self)
+/*
+ * Returns length of the ASCII prefix of str.
+ */
+static size_t ascii_scan(const char *str, size_t len)
 {
-	if (is_err(self))
-		return 1;
+	size_t i = 0;
 
-	if (!in_arr(self)) {
-		err(self, "Not in array!");
-		return 1;
-	}
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+		int mask = _mm_movemask_epi8(v);
 
-	int first = is_first(self);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
 
-	clear_depth_bit(self);
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
 
-	if (!first)
-		newline(self);
+		memcpy(&w, str + i, sizeof(w));
 
-	return out_ch(self, ']');
-}
+		if (w & SWAR_HIGH)
+			break;
+	}
 
-int ujson_null_add(ujson_writer *self, const char *id)
-{
-	if (add_common(self, id))
-		return 1;
+	for (; i < len; i++) {
+		if (str[i] & 0x80)
+			return i;
+	}
 
-	return out_str(self, "null");
+	return len;
 }
 
-int ujson_int_add(ujson_writer *self, const char *id, long val)
+/*
+ * Writes an already escaped string or JSON with the non-ASCII characters
+ * escaped, which is valid since they can be only inside of strings.
+ */
+static int out_ascii(ujson_writer *self, const char *buf, size_t len)
 {
-	char buf[64];
+	size_t start = 0, i = 0, chsz;
 
-	if (add_common(self, id))
-		return 1;
+	for (;;) {
+		i += ascii_scan(buf + i, len - i);
 
-	snprintf(buf, sizeof(buf), "%li", val);
+		if (i >= len)
+			break;
 
-	return out_str(self, buf);
-}
+		chsz = utf8_chsz(buf + i, len - i);
+		if (!chsz) {
+			err(self, "Invalid UTF-8 string");
+			return 1;
+		}
 
-int ujson_bool_add(ujson_writer *self, const char *id, int val)
-{
-	if (add_common(self, id))
-		return 1;
+		if (i > start && out(self, buf + start, i - start))
+			return 1;
 
-	if (val)
-		return out_str(self, "true");
-	else
-		return out_str(self, "false");
-}
+		if (out_esc_ucode(self, buf + i))
+			return 1;
 
-int ujson_str_add(ujson_writer *self, const char *id, const char *val)
-{
-	if (add_common(self, id))
-		return 1;
+		i += chsz;
+		start = i;
+	}
 
-	if (out_esc_str(self, val))
+	if (i > start && out(self, buf + start, i - start))
 		return 1;
 
 	return 0;
 }
 
-int ujson_float_add(ujson_writer *self, const char *id, double val)
+static int out_esc_str(ujson_writer *self, const char *val, size_t len)
 {
-	char buf[64];
+	int esc_slash = self->flags & UJSON_WRITER_ESC_SLASH;
+	int ascii = self->flags & UJSON_WRITER_ASCII;
+	size_t start = 0, i = 0;
 
-	if (add_common(self, id))
+	if (out_ch(self, '"'))
 		return 1;
 
-	snprintf(buf, sizeof(buf), "%lg", val);
+	for (;;) {
+		i += esc_scan(val + i, len - i, esc_slash);
 
-	return out_str(self, buf);
-}
+		if (i >= len)
+			break;
 
-int ujson_writer_finish(ujson_writer *self)
-{
-	if (is_err(self))
-		goto err;
+		unsigned char b = val[i];
 
-	if (self->depth) {
-		err(self, "Objects and/or Arrays not finished");
-		goto err;
-	}
+		if (b >= 0x80) {
+			size_t chsz = utf8_chsz(val + i, len - i);
 
-	if (newline(self))
-		return 1;
+			if (!chsz) {
+				err(self, "Invalid UTF-8 string");
+				return 1;
+			}
 
-	return 0;
-err:
-	if (self->err_print)
-		self->err_print(self->err_print_priv, self->err);
+			if (ascii) {
+				if (i > start && out(self, val + start, i - start))
+					return 1;
 
-	return 1;
-}
+				if (out_esc_ucode(self, val + i))
+					return 1;
 
-struct json_writer_file {
-	int fd;
-	size_t buf_used;
-	char buf[1024];
-};
+				start = i + chsz;
+			}
 
-static int out_writer_file_write(ujson_writer *self, int fd, const char *buf, ssize_t buf_len)
-{
-	do {
-		ssize_t ret = write(fd, buf, buf_len);
-		if (ret <= 0) {
-			err(self, "Failed to write to a file");
-			return 1;
+			i += chsz;
+			continue;
 		}
 
-		if (ret > buf_len) {
-			err(self, "Wrote more bytes than requested?!");
+		if (i > start && out(self, val + start, i - start))
 			return 1;
-		}
-
-		buf_len -= ret;
-	} while (buf_len);
-
-	return 0;
-}
-
-static int out_writer_file(ujson_writer *self, const char *buf, size_t buf_len)
-{
-	struct json_writer_file *writer_file = self->out_priv;
-	size_t buf_size = sizeof(writer_file->buf);
-	size_t buf_avail = buf_size - writer_file->buf_used;
-
-	if (buf_len > buf_size/4)
-		return out_writer_file_write(self, writer_file->fd, buf, buf_len);
 
-	if (buf_len >= buf_avail) {
-		if (out_writer_file_write(self, writer_file->fd,
-		                          writer_file->buf, writer_file->buf_used))
+		if (out_esc_ch(self, b))
 			return 1;
 
-		memcpy(writer_file->buf, buf, buf_len);
-		writer_file->buf_used = buf_len;
-		return 0;
+		start = ++i;
 	}
 
-	memcpy(writer_file->buf + writer_file->buf_used, buf, buf_len);
-	writer_file->buf_used += buf_len;
+	if (i > start && out(self, val + start, i - start))
+		return 1;
+
+	if (out_ch(self, '"'))
+		return 1;
 
 	return 0;
 }
 
-int ujson_writer_file_close(ujson_writer *self)
+/*
+ * CBOR (RFC 8949) output.
+ *
+ * The number of container entries is not known upfront so objects and arrays
+ * are written with indefinite length and terminated by a break byte.
+ */
+#define CBOR_HEAD_MAX 9
+#define CBOR_BREAK 0xff
+
+enum cbor_major {
+	CBOR_UINT,
+	CBOR_NINT,
+	CBOR_BYTES,
+	CBOR_TEXT,
+	CBOR_ARR,
+	CBOR_MAP,
+	CBOR_TAG,
+	CBOR_SIMPLE,
+};
+
+static inline int is_cbor(ujson_writer *self)
 {
-	struct json_writer_file *writer_file = self->out_priv;
-	int saved_errno = 0;
+	return self->flags & UJSON_WRITER_CBOR;
+}
 
-	if (writer_file->buf_used) {
-		if (out_writer_file_write(self, writer_file->fd,
-		                          writer_file->buf, writer_file->buf_used))
+static void cbor_be(char *buf, uint64_t val, size_t len)
+{
+	size_t i;
 
-			saved_errno = errno;
+	for (i = len; i > 0; i--) {
+		buf[i-1] = val & 0xff;
+		val >>= 8;
 	}
+}
+
+/*
+ * Encodes an item head with the shortest argument, returns the head length.
+ */
+static size_t cbor_head(char *buf, uint8_t major, uint64_t val)
+{
+	uint8_t ai;
+	size_t len;
+
+	if (val < 24) {
+		buf[0] = major << 5 | val;
+		return 1;
+	}
+
+	if (val <= UINT8_MAX) {
+		ai = 24;
+		len = 1;
+	} else if (val <= UINT16_MAX) {
+		ai = 25;
+		len = 2;
+	} else if (val <= UINT32_MAX) {
+		ai = 26;
+		len = 4;
+	} else {
+		ai = 27;
+		len = 8;
+	}
+
+	buf[0] = major << 5 | ai;
+	cbor_be(buf + 1, val, len);
+
+	return len + 1;
+}
+
+static int out_cbor_head(ujson_writer *self, uint8_t major, uint64_t val)
+{
+	char buf[CBOR_HEAD_MAX];
+
+	return out(self, buf, cbor_head(buf, major, val));
+}
+
+static int out_cbor_str(ujson_writer *self, const char *val, size_t len)
+{
+	size_t i = 0, chsz;
+
+	/* CBOR text strings must be valid UTF-8 as well */
+	for (;;) {
+		i += esc_scan(val + i, len - i, 0);
+
+		if (i >= len)
+			break;
+
+		if ((unsigned char)val[i] < 0x80) {
+			i++;
+			continue;
+		}
+
+		chsz = utf8_chsz(val + i, len - i);
+		if (!chsz) {
+			err(self, "Invalid UTF-8 string");
+			return 1;
+		}
+
+		i += chsz;
+	}
+
+	if (out_cbor_head(self, CBOR_TEXT, len))
+		return 1;
+
+	return out(self, val, len);
+}
+
+/*
+ * Floats are written in single precision if that does not lose any bits.
+ */
+static int out_cbor_float(ujson_writer *self, double val)
+{
+	char buf[CBOR_HEAD_MAX];
+	float fval = val;
+	uint64_t bits;
+	uint32_t bits32;
+
+	if (fval == val || isnan(val)) {
+		memcpy(&bits32, &fval, sizeof(bits32));
+		buf[0] = 0xfa;
+		cbor_be(buf + 1, bits32, 4);
+		return out(self, buf, 5);
+	}
+
+	memcpy(&bits, &val, sizeof(bits));
+	buf[0] = 0xfb;
+	cbor_be(buf + 1, bits, 8);
+
+	return out(self, buf, 9);
+}
+
+#define PADD_CHUNK 64
+
+static const char padd_spaces[PADD_CHUNK] = {[0 ... PADD_CHUNK-1] = ' '};
+static const char padd_tabs[PADD_CHUNK] = {[0 ... PADD_CHUNK-1] = '\t'};
+
+static int do_padd(ujson_writer *self)
+{
+	size_t len = self->depth * (self->indent ? self->indent : 1);
+	char padd_buf[PADD_CHUNK];
+	const char *padd;
+
+	switch (self->indent_ch) {
+	case 0:
+	case ' ':
+		padd = padd_spaces;
+	break;
+	case '\t':
+		padd = padd_tabs;
+	break;
+	default:
+		memset(padd_buf, self->indent_ch, sizeof(padd_buf));
+		padd = padd_buf;
+	break;
+	}
+
+	while (len) {
+		size_t chunk = len > PADD_CHUNK ? PADD_CHUNK : len;
+
+		if (out(self, padd, chunk))
+			return 1;
+
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static int newline(ujson_writer *self)
+{
+	if (self->flags & UJSON_WRITER_COMPACT)
+		return 0;
+
+	if (out_ch(self, '\n'))
+		return 1;
+
+	if (do_padd(self))
+		return 1;
+
+	return 0;
+}
+
+static int out_key(ujson_writer *self, const ujson_key *key)
+{
+	size_t len = key->len;
+
+	/* Prepared keys end with ": " */
+	if (self->flags & (UJSON_WRITER_COMPACT | UJSON_WRITER_NO_COLON_SPACE))
+		len--;
+
+	/* Keys are prepared with UTF-8 passed through */
+	if (self->flags & UJSON_WRITER_ASCII)
+		return out_ascii(self, key->buf, len);
+
+	return out(self, key->buf, len);
+}
+
+/*
+ * Object entries are named either by an id or by a prepared key.
+ */
+static int add_common_n(ujson_writer *self, const char *id, size_t id_len,
+                        const ujson_key *key)
+{
+	if (is_err(self))
+		return 1;
+
+	if (!self->depth) {
+		err(self, "Object/Array has to be started first");
+		return 1;
+	}
+
+	if (in_arr(self)) {
+		if (id || key) {
+			err(self, "Array entries can't have id");
+			return 1;
+		}
+	} else {
+		if (!id && !key) {
+			err(self, "Object entries must have id");
+			return 1;
+		}
+	}
+
+	if (key && !(is_cbor(self) ? key->cbor_len : key->len)) {
+		err(self, "Invalid prepared key");
+		return 1;
+	}
+
+	if (is_cbor(self)) {
+		/* Keeps track of empty containers for fragment joins */
+		is_first(self);
+
+		if (key)
+			return out(self, key->cbor, key->cbor_len);
+
+		if (id)
+			return out_cbor_str(self, id, id_len);
+
+		return 0;
+	}
+
+	if (!is_first(self) && out_ch(self, ','))
+		return 1;
+
+	if (self->depth && newline(self))
+		return 1;
+
+	if (key)
+		return out_key(self, key);
+
+	if (id) {
+		if (out_esc_str(self, id, id_len))
+			return 1;
+
+		if (self->flags & (UJSON_WRITER_COMPACT | UJSON_WRITER_NO_COLON_SPACE)) {
+			if (out_ch(self, ':'))
+				return 1;
+		} else {
+			if (out(self, ": ", 2))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int add_common(ujson_writer *self, const char *id, const ujson_key *key)
+{
+	return add_common_n(self, id, id ? strlen(id) : 0, key);
+}
+
+static int key_overflow(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	(void)buf;
+	(void)buf_len;
+
+	err(self, "Key too long");
+
+	return 1;
+}
+
+ujson_key ujson_key_preparen(const char *id, size_t id_len)
+{
+	ujson_key key;
+	ujson_writer writer = {
+		.out = key_overflow,
+		.buf = key.buf,
+		.buf_size = sizeof(key.buf),
+	};
+
+	if (out_esc_str(&writer, id, id_len) || out(&writer, ": ", 2))
+		key.len = 0;
+	else
+		key.len = writer.buf_used;
+
+	if (!key.len || id_len > UJSON_KEY_MAX - CBOR_HEAD_MAX) {
+		key.cbor_len = 0;
+		return key;
+	}
+
+	key.cbor_len = cbor_head(key.cbor, CBOR_TEXT, id_len);
+	memcpy(key.cbor + key.cbor_len, id, id_len);
+	key.cbor_len += id_len;
+
+	return key;
+}
+
+ujson_key ujson_key_prepare(const char *id)
+{
+	return ujson_key_preparen(id, strlen(id));
+}
+
+static int obj_start(ujson_writer *self, const char *id, const ujson_key *key)
+{
+	if (self->depth >= UJSON_RECURSION_MAX)
+		return 1;
+
+	if (!self->depth && (id || key)) {
+		err(self, "Top level object cannot have id");
+		return 1;
+	}
+
+	if (self->depth && add_common(self, id, key))
+		return 1;
+
+	if (out_ch(self, is_cbor(self) ? (char)(CBOR_MAP << 5 | 31) : '{'))
+		return 1;
+
+	set_depth_bit(self, 1);
+
+	return 0;
+}
+
+int ujson_obj_start(ujson_writer *self, const char *id)
+{
+	return obj_start(self, id, NULL);
+}
+
+int ujson_obj_start_key(ujson_writer *self, const ujson_key *key)
+{
+	return obj_start(self, NULL, key);
+}
+
+int ujson_obj_finish(ujson_writer *self)
+{
+	if (is_err(self))
+		return 1;
+
+	if (!in_obj(self)) {
+		err(self, "Not in object!");
+		return 1;
+	}
+
+	int first = is_first(self);
+
+	clear_depth_bit(self);
+
+	if (is_cbor(self))
+		return out_ch(self, (char)CBOR_BREAK);
+
+	if (!first)
+		newline(self);
+
+	return out_ch(self, '}');
+}
+
+static int arr_start(ujson_writer *self, const char *id, const ujson_key *key)
+{
+	if (self->depth >= UJSON_RECURSION_MAX) {
+		err(self, "Recursion too deep");
+		return 1;
+	}
+
+	if (!self->depth && (id || key)) {
+		err(self, "Top level array cannot have id");
+		return 1;
+	}
+
+	if (self->depth && add_common(self, id, key))
+		return 1;
+
+	if (out_ch(self, is_cbor(self) ? (char)(CBOR_ARR << 5 | 31) : '['))
+		return 1;
+
+	set_depth_bit(self, 0);
+
+	return 0;
+}
+
+int ujson_arr_start(ujson_writer *self, const char *id)
+{
+	return arr_start(self, id, NULL);
+}
+
+int ujson_arr_start_key(ujson_writer *self, const ujson_key *key)
+{
+	return arr_start(self, NULL, key);
+}
+
+int ujson_arr_finish(ujson_writer *self)
+{
+	if (is_err(self))
+		return 1;
+
+	if (!in_arr(self)) {
+		err(self, "Not in array!");
+		return 1;
+	}
+
+	int first = is_first(self);
+
+	clear_depth_bit(self);
+
+	if (is_cbor(self))
+		return out_ch(self, (char)CBOR_BREAK);
+
+	if (!first)
+		newline(self);
+
+	return out_ch(self, ']');
+}
+
+static int null_add(ujson_writer *self, const char *id, const ujson_key *key)
+{
+	if (add_common(self, id, key))
+		return 1;
+
+	if (is_cbor(self))
+		return out_ch(self, (char)0xf6);
+
+	return out_str(self, "null");
+}
+
+int ujson_null_add(ujson_writer *self, const char *id)
+{
+	return null_add(self, id, NULL);
+}
+
+int ujson_null_add_key(ujson_writer *self, const ujson_key *key)
+{
+	return null_add(self, NULL, key);
+}
+
+static int int64_add(ujson_writer *self, const char *id, const ujson_key *key,
+                     int64_t val)
+{
+	char buf[UJSON_INT_STR_MAX];
+
+	if (add_common(self, id, key))
+		return 1;
+
+	if (is_cbor(self)) {
+		if (val < 0)
+			return out_cbor_head(self, CBOR_NINT, -1 - val);
+
+		return out_cbor_head(self, CBOR_UINT, val);
+	}
+
+	return out(self, buf, ujson_i64_to_str(val, buf));
+}
+
+int ujson_int64_add(ujson_writer *self, const char *id, int64_t val)
+{
+	return int64_add(self, id, NULL, val);
+}
+
+int ujson_int64_add_key(ujson_writer *self, const ujson_key *key, int64_t val)
+{
+	return int64_add(self, NULL, key, val);
+}
+
+static int uint64_add(ujson_writer *self, const char *id, const ujson_key *key,
+                      uint64_t val)
+{
+	char buf[UJSON_INT_STR_MAX];
+
+	if (add_common(self, id, key))
+		return 1;
+
+	if (is_cbor(self))
+		return out_cbor_head(self, CBOR_UINT, val);
+
+	return out(self, buf, ujson_u64_to_str(val, buf));
+}
+
+int ujson_uint64_add(ujson_writer *self, const char *id, uint64_t val)
+{
+	return uint64_add(self, id, NULL, val);
+}
+
+int ujson_uint64_add_key(ujson_writer *self, const ujson_key *key, uint64_t val)
+{
+	return uint64_add(self, NULL, key, val);
+}
+
+int ujson_int_add(ujson_writer *self, const char *id, long val)
+{
+	return int64_add(self, id, NULL, val);
+}
+
+int ujson_int_add_key(ujson_writer *self, const ujson_key *key, long val)
+{
+	return int64_add(self, NULL, key, val);
+}
+
+static int bool_add(ujson_writer *self, const char *id, const ujson_key *key,
+                    int val)
+{
+	if (add_common(self, id, key))
+		return 1;
+
+	if (is_cbor(self))
+		return out_ch(self, val ? (char)0xf5 : (char)0xf4);
+
+	if (val)
+		return out_str(self, "true");
+	else
+		return out_str(self, "false");
+}
+
+int ujson_bool_add(ujson_writer *self, const char *id, int val)
+{
+	return bool_add(self, id, NULL, val);
+}
+
+int ujson_bool_add_key(ujson_writer *self, const ujson_key *key, int val)
+{
+	return bool_add(self, NULL, key, val);
+}
+
+static int str_add(ujson_writer *self, const char *id, size_t id_len,
+                   const ujson_key *key, const char *val, size_t len)
+{
+	if (add_common_n(self, id, id_len, key))
+		return 1;
+
+	if (is_cbor(self))
+		return out_cbor_str(self, val, len);
+
+	if (out_esc_str(self, val, len))
+		return 1;
+
+	return 0;
+}
+
+int ujson_str_add(ujson_writer *self, const char *id, const char *val)
+{
+	return str_add(self, id, id ? strlen(id) : 0, NULL, val, strlen(val));
+}
+
+int ujson_str_add_key(ujson_writer *self, const ujson_key *key, const char *val)
+{
+	return str_add(self, NULL, 0, key, val, strlen(val));
+}
+
+int ujson_strn_add(ujson_writer *self, const char *id, size_t id_len,
+                   const char *val, size_t len)
+{
+	return str_add(self, id, id_len, NULL, val, len);
+}
+
+int ujson_strn_add_key(ujson_writer *self, const ujson_key *key,
+                       const char *val, size_t len)
+{
+	return str_add(self, NULL, 0, key, val, len);
+}
+
+static int float_add(ujson_writer *self, const char *id, const ujson_key *key,
+                     double val)
+{
+	char buf[UJSON_FLOAT_STR_MAX];
+
+	if (is_cbor(self)) {
+		if (add_common(self, id, key))
+			return 1;
+
+		return out_cbor_float(self, val);
+	}
+
+	if (!isfinite(val)) {
+		if (self->flags & UJSON_WRITER_NONFINITE_NULL)
+			return null_add(self, id, key);
+
+		if (!is_err(self))
+			err(self, "Cannot write NaN or infinity");
+
+		return 1;
+	}
+
+	if (add_common(self, id, key))
+		return 1;
+
+	return out(self, buf, ujson_double_to_str(val, buf));
+}
+
+int ujson_float_add(ujson_writer *self, const char *id, double val)
+{
+	return float_add(self, id, NULL, val);
+}
+
+int ujson_float_add_key(ujson_writer *self, const ujson_key *key, double val)
+{
+	return float_add(self, NULL, key, val);
+}
+
+/*
+ * Parses the fragment wrapped in an array and checks that it contains exactly
+ * one value. For CBOR writers the fragment is wrapped in an indefinite length
+ * array and parsed as CBOR.
+ */
+static int raw_validate(ujson_writer *self, const char *json, size_t len)
+{
+	char *buf = malloc(len + 3);
+	struct ujson_val val = {};
+	enum ujson_reader_flags rflags = UJSON_READER_STRICT;
+	size_t cnt = 0;
+	int ret;
+
+	if (!buf) {
+		err(self, "Failed to allocate raw JSON validation buffer");
+		return 1;
+	}
+
+	if (is_cbor(self))
+		rflags |= UJSON_READER_CBOR;
+
+	buf[0] = is_cbor(self) ? (char)(CBOR_ARR << 5 | 31) : '[';
+	memcpy(buf + 1, json, len);
+	buf[len + 1] = is_cbor(self) ? (char)CBOR_BREAK : ']';
+	buf[len + 2] = 0;
+
+	ujson_reader reader = UJSON_READER_INIT(buf, len + 2, rflags);
+	ujson_cbor_stack stack;
+
+	reader.cbor_left = stack;
+	reader.err_print = NULL;
+
+	if (ujson_reader_start(&reader) == UJSON_ARR) {
+		UJSON_ARR_FOREACH(&reader, &val) {
+			cnt++;
+
+			if (val.type == UJSON_OBJ)
+				ujson_obj_skip(&reader);
+			else if (val.type == UJSON_ARR)
+				ujson_arr_skip(&reader);
+		}
+	}
+
+	ret = ujson_reader_err(&reader) || !ujson_reader_consumed(&reader);
+
+	if (ret)
+		err(self, "Invalid raw JSON: %s", reader.err);
+	else if (cnt != 1)
+		err(self, "Invalid raw JSON: expected exactly one value");
+
+	free(buf);
+
+	return ret || cnt != 1;
+}
+
+static int raw_add(ujson_writer *self, const char *id, const ujson_key *key,
+                   const char *json, size_t len)
+{
+	if (is_err(self))
+		return 1;
+
+	if (!len) {
+		err(self, "Empty raw JSON");
+		return 1;
+	}
+
+	if ((self->flags & UJSON_WRITER_RAW_VALIDATE) &&
+	    raw_validate(self, json, len))
+		return 1;
+
+	if (add_common(self, id, key))
+		return 1;
+
+	if ((self->flags & UJSON_WRITER_ASCII) && !is_cbor(self))
+		return out_ascii(self, json, len);
+
+	return out(self, json, len);
+}
+
+int ujson_raw_add(ujson_writer *self, const char *id, const char *json, size_t len)
+{
+	return raw_add(self, id, NULL, json, len);
+}
+
+int ujson_raw_add_key(ujson_writer *self, const ujson_key *key,
+                      const char *json, size_t len)
+{
+	return raw_add(self, NULL, key, json, len);
+}
+
+int ujson_writer_finish(ujson_writer *self)
+{
+	if (is_err(self))
+		goto err;
+
+	if (self->depth) {
+		err(self, "Objects and/or Arrays not finished");
+		goto err;
+	}
+
+	if (!is_cbor(self) && out_ch(self, '\n'))
+		return 1;
+
+	if (self->flags & UJSON_WRITER_FINISH_NO_FLUSH)
+		return 0;
+
+	return ujson_writer_flush(self);
+err:
+	if (self->err_print)
+		self->err_print(self->err_print_priv, self->err);
+
+	return 1;
+}
+
+#ifdef UJSON_IO_URING
+/*
+ * Double buffered io_uring file output.
+ *
+ * The writer serializes into one buffer while the other one is being written
+ * by the kernel. The writes are submitted with explicit offsets hence only
+ * regular files are supported.
+ */
+struct json_writer_uring {
+	struct ujson_uring ring;
+
+	/* Current file offset */
+	off_t off;
+	/* Index of the buffer being filled by the writer */
+	int cur;
+	/* Writes in flight, one per buffer */
+	int busy[2];
+	struct iovec iov[2];
+	off_t iov_off[2];
+};
+#endif
+
+struct json_writer_file {
+	int fd;
+	size_t buf_size;
+#ifdef UJSON_IO_URING
+	struct json_writer_uring uring;
+#endif
+	char buf[];
+};
+
+static int write_fd(ujson_writer *self, int fd, const char *buf, size_t buf_len)
+{
+	do {
+		ssize_t ret = write(fd, buf, buf_len);
+		if (ret <= 0) {
+			err(self, "Failed to write to a file");
+			return 1;
+		}
+
+		if ((size_t)ret > buf_len) {
+			err(self, "Wrote more bytes than requested?!");
+			return 1;
+		}
+
+		buf += ret;
+		buf_len -= ret;
+	} while (buf_len);
+
+	return 0;
+}
+
+static int out_writer_file(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	struct json_writer_file *writer_file = self->out_priv;
+
+	return write_fd(self, writer_file->fd, buf, buf_len);
+}
+
+static int outv_writer_file(ujson_writer *self, const struct iovec *iov, int iovcnt)
+{
+	struct json_writer_file *writer_file = self->out_priv;
+	struct iovec vec[iovcnt], *v = vec;
+
+	memcpy(vec, iov, sizeof(vec));
+
+	while (iovcnt) {
+		ssize_t ret = writev(writer_file->fd, v, iovcnt);
+		if (ret <= 0) {
+			err(self, "Failed to write to a file");
+			return 1;
+		}
+
+		while (iovcnt && (size_t)ret >= v->iov_len) {
+			ret -= v->iov_len;
+			v++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			v->iov_base = (char*)v->iov_base + ret;
+			v->iov_len -= ret;
+		} else if (ret) {
+			err(self, "Wrote more bytes than requested?!");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef UJSON_IO_URING
+static int uring_setup(struct json_writer_uring *uring, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return 1;
+
+	return ujson_uring_setup(&uring->ring, 2);
+}
+
+static int uring_submit(ujson_writer *self, struct json_writer_file *writer_file,
+                        int idx, size_t len)
+{
+	struct json_writer_uring *uring = &writer_file->uring;
+	struct io_uring_sqe *sqe = ujson_uring_sqe(&uring->ring);
+
+	uring->iov[idx].iov_base = writer_file->buf + idx * writer_file->buf_size;
+	uring->iov[idx].iov_len = len;
+	uring->iov_off[idx] = uring->off;
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = writer_file->fd;
+	sqe->addr = (uintptr_t)&uring->iov[idx];
+	sqe->len = 1;
+	sqe->off = uring->off;
+	sqe->user_data = idx;
+
+	if (ujson_uring_submit(&uring->ring)) {
+		err(self, "Failed to submit a write");
+		return 1;
+	}
+
+	uring->busy[idx] = 1;
+	uring->off += len;
+
+	return 0;
+}
+
+/*
+ * Finishes short writes synchronously, these happen only when the disk is
+ * full or on a signal.
+ */
+static int uring_finish_write(ujson_writer *self, struct json_writer_uring *uring,
+                              int idx, int res)
+{
+	struct json_writer_file *writer_file = self->out_priv;
+	const char *buf = uring->iov[idx].iov_base;
+	size_t len = uring->iov[idx].iov_len;
+	off_t off = uring->iov_off[idx];
+
+	for (;;) {
+		if (res <= 0) {
+			if (res < 0)
+				errno = -res;
+			err(self, "Failed to write to a file");
+			return 1;
+		}
+
+		buf += res;
+		len -= res;
+		off += res;
+
+		if (!len)
+			return 0;
+
+		res = pwrite(writer_file->fd, buf, len, off);
+		if (res < 0)
+			res = -errno;
+	}
+}
+
+static int uring_wait(ujson_writer *self, struct json_writer_uring *uring, int idx)
+{
+	int ret = 0;
+
+	while (uring->busy[idx]) {
+		uint64_t i;
+		int res;
+
+		if (ujson_uring_wait(&uring->ring, &i, &res)) {
+			err(self, "Failed to wait for a write");
+			return 1;
+		}
+
+		uring->busy[i] = 0;
+		ret |= uring_finish_write(self, uring, i, res);
+	}
+
+	return ret;
+}
+
+static int out_writer_uring(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	struct json_writer_file *writer_file = self->out_priv;
+	struct json_writer_uring *uring = &writer_file->uring;
+	size_t buf_size = writer_file->buf_size;
+
+	while (buf_len) {
+		char *cur = writer_file->buf + uring->cur * buf_size;
+		size_t len = buf_len;
+
+		/* A chunk that does not fit the buffer is copied through it */
+		if (buf != cur) {
+			len = buf_len < buf_size ? buf_len : buf_size;
+			memcpy(cur, buf, len);
+		}
+
+		if (uring_submit(self, writer_file, uring->cur, len))
+			return 1;
+
+		uring->cur = !uring->cur;
+
+		if (uring_wait(self, uring, uring->cur))
+			return 1;
+
+		buf += len;
+		buf_len -= len;
+	}
+
+	self->buf = writer_file->buf + uring->cur * buf_size;
+
+	return 0;
+}
+#endif
+
+int ujson_writer_file_close(ujson_writer *self)
+{
+	struct json_writer_file *writer_file = self->out_priv;
+	int saved_errno = 0;
+
+	if (ujson_writer_flush(self))
+		saved_errno = errno;
+
+#ifdef UJSON_IO_URING
+	struct json_writer_uring *uring = &writer_file->uring;
+
+	if (uring->ring.fd >= 0) {
+		/* Both writes have to be reaped before the buffers are freed */
+		int ret = uring_wait(self, uring, 0);
+
+		ret |= uring_wait(self, uring, 1);
+
+		if (ret && !saved_errno)
+			saved_errno = errno;
+
+		ujson_uring_free(&uring->ring);
+	}
+#endif
 
 	if (close(writer_file->fd)) {
 		if (!saved_errno)
@@ -459,33 +1467,448 @@ int ujson_writer_file_close(ujson_writer *self)
 	return 0;
 }
 
-ujson_writer *ujson_writer_file_open(const char *path)
+ujson_writer *ujson_writer_file_open_ex(const char *path, size_t buf_size,
+                                        enum ujson_writer_file_flags flags)
 {
 	ujson_writer *ret;
 	struct json_writer_file *writer_file;
+	size_t bufs = 1;
+
+	if (!buf_size)
+		buf_size = UJSON_WRITER_FILE_BUF_SIZE;
 
-	ret = malloc(sizeof(ujson_writer) + sizeof(struct json_writer_file));
+#ifdef UJSON_IO_URING
+	if (flags & UJSON_WRITER_FILE_IO_URING)
+		bufs = 2;
+#else
+	(void)flags;
+#endif
+
+	ret = malloc(sizeof(ujson_writer) + sizeof(struct json_writer_file) +
+	             bufs * buf_size);
 	if (!ret)
 		return NULL;
 
 	writer_file = (void*)ret + sizeof(ujson_writer);
 
 	writer_file->fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0664);
-	if (!writer_file->fd) {
+	if (writer_file->fd < 0) {
 		free(ret);
 		return NULL;
 	}
 
-	writer_file->buf_used = 0;
-
 	memset(ret, 0, sizeof(*ret));
 
+	writer_file->buf_size = buf_size;
+
 	ret->err_print = UJSON_ERR_PRINT;
 	ret->err_print_priv = UJSON_ERR_PRINT_PRIV;
 	ret->out = out_writer_file;
+	ret->outv = outv_writer_file;
 	ret->out_priv = writer_file;
+	ret->buf = writer_file->buf;
+	ret->buf_size = buf_size;
+
+#ifdef UJSON_IO_URING
+	struct json_writer_uring *uring = &writer_file->uring;
+
+	memset(uring, 0, sizeof(*uring));
+	uring->ring.fd = -1;
+
+	if (bufs == 2 && !uring_setup(uring, writer_file->fd)) {
+		ret->out = out_writer_uring;
+		ret->outv = NULL;
+	}
+#endif
+
+	return ret;
+}
+
+ujson_writer *ujson_writer_file_open(const char *path)
+{
+	return ujson_writer_file_open_ex(path, 0, 0);
+}
+
+#ifdef UJSON_ZLIB
+/*
+ * The writer buffer is passed to deflate() directly, the compressed data are
+ * collected in the out buffer and written to the file.
+ */
+struct json_writer_gz {
+	int fd;
+	z_stream strm;
+	size_t buf_size;
+	char *out;
+	char buf[];
+};
+
+static int gz_deflate(ujson_writer *self, const char *buf, size_t buf_len, int flush)
+{
+	struct json_writer_gz *gz = self->out_priv;
+
+	do {
+		size_t chunk = buf_len > UINT_MAX ? UINT_MAX : buf_len;
+		int zflush = chunk < buf_len ? Z_NO_FLUSH : flush;
+
+		gz->strm.next_in = (Bytef *)buf;
+		gz->strm.avail_in = chunk;
+
+		do {
+			gz->strm.next_out = (Bytef *)gz->out;
+			gz->strm.avail_out = gz->buf_size;
+
+			if (deflate(&gz->strm, zflush) == Z_STREAM_ERROR) {
+				err(self, "deflate() failed");
+				return 1;
+			}
+
+			size_t have = gz->buf_size - gz->strm.avail_out;
+
+			if (have && write_fd(self, gz->fd, gz->out, have))
+				return 1;
+		} while (!gz->strm.avail_out);
+
+		buf += chunk;
+		buf_len -= chunk;
+	} while (buf_len);
+
+	return 0;
+}
+
+static int out_writer_gz(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	return gz_deflate(self, buf, buf_len, Z_NO_FLUSH);
+}
+
+ujson_writer *ujson_writer_gz_open(const char *path, int level)
+{
+	size_t buf_size = UJSON_WRITER_FILE_BUF_SIZE;
+	struct json_writer_gz *gz;
+	ujson_writer *ret;
+
+	ret = malloc(sizeof(ujson_writer) + sizeof(struct json_writer_gz) + 2 * buf_size);
+	if (!ret)
+		return NULL;
+
+	gz = (void*)ret + sizeof(ujson_writer);
+
+	memset(ret, 0, sizeof(*ret));
+	memset(gz, 0, sizeof(*gz));
+
+	/* Window bits 15 + 16 selects gzip header and trailer */
+	if (deflateInit2(&gz->strm, level, Z_DEFLATED, 15 + 16, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(ret);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	gz->fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0664);
+	if (gz->fd < 0) {
+		int saved_errno = errno;
+
+		deflateEnd(&gz->strm);
+		free(ret);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	gz->buf_size = buf_size;
+	gz->out = gz->buf + buf_size;
+
+	ret->err_print = UJSON_ERR_PRINT;
+	ret->err_print_priv = UJSON_ERR_PRINT_PRIV;
+	ret->out = out_writer_gz;
+	ret->out_priv = gz;
+	ret->buf = gz->buf;
+	ret->buf_size = buf_size;
+
+	return ret;
+}
+
+int ujson_writer_gz_close(ujson_writer *self)
+{
+	struct json_writer_gz *gz = self->out_priv;
+	int saved_errno = 0;
+
+	if (ujson_writer_flush(self) || gz_deflate(self, NULL, 0, Z_FINISH))
+		saved_errno = errno ? errno : EIO;
+
+	deflateEnd(&gz->strm);
+
+	if (close(gz->fd)) {
+		if (!saved_errno)
+			saved_errno = errno;
+	}
+
+	free(self);
+
+	if (saved_errno) {
+		errno = saved_errno;
+		return 1;
+	}
+
+	return 0;
+}
+#else
+ujson_writer *ujson_writer_gz_open(const char *path, int level)
+{
+	(void)path;
+	(void)level;
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+int ujson_writer_gz_close(ujson_writer *self)
+{
+	(void)self;
+
+	errno = ENOSYS;
+	return 1;
+}
+#endif
+
+#define WRITER_MEM_DEFAULT_SIZE 4096
+
+enum json_writer_mem_type {
+	WRITER_MEM_GROW,
+	WRITER_MEM_FIXED,
+	WRITER_MEM_MEASURE,
+};
+
+struct json_writer_mem {
+	enum json_writer_mem_type type;
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+static int writer_mem_grow(ujson_writer *self, struct json_writer_mem *mem, size_t len)
+{
+	size_t size = mem->size;
+	char *buf;
+
+	if (mem->type == WRITER_MEM_FIXED) {
+		err(self, "Memory buffer too small");
+		return 1;
+	}
+
+	while (size - mem->used < len)
+		size *= 2;
+
+	buf = realloc(mem->buf, size);
+	if (!buf) {
+		err(self, "Failed to allocate memory");
+		return 1;
+	}
+
+	mem->buf = buf;
+	mem->size = size;
+
+	return 0;
+}
+
+/*
+ * The writer buffer is a window into the unused part of the memory buffer,
+ * when the writer flushes the data are already in place and we only advance
+ * the window. Chunks that did not fit into the window are copied.
+ */
+static int out_writer_mem(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	struct json_writer_mem *mem = self->out_priv;
+	int ret = 0;
+
+	if (buf != mem->buf + mem->used) {
+		if (mem->size - mem->used < buf_len &&
+		    writer_mem_grow(self, mem, buf_len))
+			return 1;
+
+		memcpy(mem->buf + mem->used, buf, buf_len);
+	}
+
+	mem->used += buf_len;
+
+	/* Make sure there is some space in the window */
+	if (mem->type == WRITER_MEM_GROW && mem->size - mem->used < mem->size / 4)
+		ret = writer_mem_grow(self, mem, mem->size);
+
+	self->buf = mem->buf + mem->used;
+	self->buf_size = mem->size - mem->used;
+
+	return ret;
+}
+
+static int out_writer_measure(ujson_writer *self, const char *buf, size_t buf_len)
+{
+	struct json_writer_mem *mem = self->out_priv;
+
+	(void)buf;
+
+	mem->used += buf_len;
+
+	return 0;
+}
+
+static ujson_writer *writer_mem_alloc(enum json_writer_mem_type type,
+                                      char *buf, size_t size)
+{
+	ujson_writer *ret;
+	struct json_writer_mem *mem;
+
+	ret = malloc(sizeof(ujson_writer) + sizeof(struct json_writer_mem));
+	if (!ret)
+		return NULL;
+
+	mem = (void*)ret + sizeof(ujson_writer);
+
+	memset(ret, 0, sizeof(*ret));
+
+	mem->type = type;
+	mem->buf = buf;
+	mem->size = size;
+	mem->used = 0;
+
+	ret->err_print = UJSON_ERR_PRINT;
+	ret->err_print_priv = UJSON_ERR_PRINT_PRIV;
+	ret->out_priv = mem;
+
+	if (type == WRITER_MEM_MEASURE) {
+		ret->out = out_writer_measure;
+	} else {
+		ret->out = out_writer_mem;
+		ret->buf = buf;
+		ret->buf_size = size;
+	}
+
+	return ret;
+}
+
+ujson_writer *ujson_writer_mem_open(size_t size_hint)
+{
+	ujson_writer *ret;
+	char *buf;
+
+	if (!size_hint)
+		size_hint = WRITER_MEM_DEFAULT_SIZE;
+
+	buf = malloc(size_hint);
+	if (!buf)
+		return NULL;
+
+	ret = writer_mem_alloc(WRITER_MEM_GROW, buf, size_hint);
+	if (!ret)
+		free(buf);
+
+	return ret;
+}
+
+ujson_writer *ujson_writer_mem_open_fixed(char *buf, size_t buf_size)
+{
+	return writer_mem_alloc(WRITER_MEM_FIXED, buf, buf_size);
+}
+
+ujson_writer *ujson_writer_measure_open(void)
+{
+	return writer_mem_alloc(WRITER_MEM_MEASURE, NULL, 0);
+}
+
+int ujson_writer_mem_close(ujson_writer *self, char **buf, size_t *len)
+{
+	struct json_writer_mem *mem = self->out_priv;
+	int ret = 0;
+
+	if (ujson_writer_flush(self) || is_err(self))
+		ret = 1;
+
+	/* Null terminate growing buffers */
+	if (!ret && mem->type == WRITER_MEM_GROW) {
+		if (mem->used == mem->size && writer_mem_grow(self, mem, 1))
+			ret = 1;
+		else
+			mem->buf[mem->used] = 0;
+	}
+
+	if (ret && mem->type == WRITER_MEM_GROW) {
+		free(mem->buf);
+		mem->buf = NULL;
+		mem->used = 0;
+	}
+
+	if (buf)
+		*buf = mem->type == WRITER_MEM_MEASURE ? NULL : mem->buf;
+
+	if (len)
+		*len = ret ? 0 : mem->used;
+
+	free(self);
+
+	return ret;
+}
+
+ujson_writer *ujson_writer_fragment_open(ujson_writer *parent, size_t size_hint)
+{
+	ujson_writer *ret;
+
+	if (!parent->depth) {
+		err(parent, "Fragments can be written only into Object/Array");
+		return NULL;
+	}
+
+	ret = ujson_writer_mem_open(size_hint);
+	if (!ret)
+		return NULL;
+
+	ret->flags = parent->flags;
+	ret->indent = parent->indent;
+	ret->indent_ch = parent->indent_ch;
+	ret->err_print = parent->err_print;
+	ret->err_print_priv = parent->err_print_priv;
+
+	/* Start at the parent depth as if the container was just opened */
+	ret->depth = parent->depth;
+	memcpy(ret->depth_type, parent->depth_type, sizeof(ret->depth_type));
+	memcpy(ret->depth_first, parent->depth_first, sizeof(ret->depth_first));
+	ret->depth_first[(ret->depth - 1)/8] |= 1<<((ret->depth - 1)%8);
 
 	return ret;
 }
 
+int ujson_writer_fragment_join(ujson_writer *self, ujson_writer *fragment)
+{
+	struct json_writer_mem *mem = fragment->out_priv;
+	int first, ret = 1;
+
+	if (is_err(self))
+		goto exit;
+
+	if (ujson_writer_flush(fragment) || is_err(fragment)) {
+		err(self, "Fragment: %s", fragment->err);
+		goto exit;
+	}
+
+	if (fragment->depth != self->depth ||
+	    in_arr(fragment) != in_arr(self)) {
+		err(self, "Fragment does not match the Object/Array");
+		goto exit;
+	}
+
+	ret = 0;
+
+	/* Nothing was written into the fragment */
+	if (get_depth_bit(fragment, fragment->depth_first))
+		goto exit;
+
+	first = is_first(self);
 
+	if (!first && !is_cbor(self) && out_ch(self, ',')) {
+		ret = 1;
+		goto exit;
+	}
+
+	ret = out(self, mem->buf, mem->used);
+exit:
+	free(mem->buf);
+	free(fragment);
+	return ret;
+}
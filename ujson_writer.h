@@ -24,22 +24,127 @@
 #ifndef UJSON_WRITER_H
 #define UJSON_WRITER_H
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <ujson_common.h>
 
+/** @brief A size of the output buffer embedded in the writer. */
+#define UJSON_WRITER_BUF_SIZE 1024
+
+/** @brief A default size of the file writer buffer. */
+#define UJSON_WRITER_FILE_BUF_SIZE (256 * 1024)
+
+/** @brief Writer flags. */
+enum ujson_writer_flags {
+	/** @brief Compact output without any newlines and indentation. */
+	UJSON_WRITER_COMPACT = 0x01,
+	/** @brief Writes "key":value instead of "key": value. */
+	UJSON_WRITER_NO_COLON_SPACE = 0x02,
+	/** @brief Writes NaN and infinity as null instead of failing. */
+	UJSON_WRITER_NONFINITE_NULL = 0x04,
+	/** @brief Escapes '/' as "\/" in strings. */
+	UJSON_WRITER_ESC_SLASH = 0x08,
+	/**
+	 * @brief Does not flush the buffer in ujson_writer_finish().
+	 *
+	 * Useful when many documents, e.g. NDJSON, are written to a file, the
+	 * data are written once the buffer is full, on ujson_writer_flush()
+	 * and when the file writer is closed.
+	 */
+	UJSON_WRITER_FINISH_NO_FLUSH = 0x10,
+	/**
+	 * @brief Validates fragments passed to ujson_raw_add().
+	 *
+	 * The fragment is parsed before it is written, which is slow and
+	 * meant for debugging.
+	 */
+	UJSON_WRITER_RAW_VALIDATE = 0x20,
+	/**
+	 * @brief Produces CBOR (RFC 8949) instead of JSON.
+	 *
+	 * Objects and arrays are written as indefinite length maps and
+	 * arrays, integers and string lengths with the shortest encoding and
+	 * floats in single precision when lossless and in double otherwise.
+	 * Formatting flags are ignored and NaN and infinity are written as
+	 * they are. The output can be read back with UJSON_READER_CBOR.
+	 */
+	UJSON_WRITER_CBOR = 0x40,
+	/**
+	 * @brief Produces 7-bit ASCII only output.
+	 *
+	 * Non-ASCII characters in strings, keys and raw JSON are written as
+	 * \uXXXX escapes, characters outside of the Basic Multilingual Plane
+	 * as UTF-16 surrogate pairs. Ignored for CBOR output.
+	 */
+	UJSON_WRITER_ASCII = 0x80,
+};
+
+/** @brief A maximal size of a prepared key including quotes, escapes and ": ". */
+#define UJSON_KEY_MAX 128
+
+/**
+ * @brief A prepared object key.
+ *
+ * Holds the key quoted, escaped and followed by ": " so that it can be
+ * written out with a single memcpy(). The CBOR encoding of the key is stored
+ * as well for writers with UJSON_WRITER_CBOR.
+ */
+typedef struct ujson_key {
+	/** Length of the prepared key, zero if preparation failed */
+	size_t len;
+	char buf[UJSON_KEY_MAX];
+	/** Length of the CBOR encoded key, zero if preparation failed */
+	size_t cbor_len;
+	char cbor[UJSON_KEY_MAX];
+} ujson_key;
+
 /** @brief A JSON writer */
 struct ujson_writer {
 	unsigned int depth;
 	char depth_type[UJSON_RECURSION_MAX/8];
 	char depth_first[UJSON_RECURSION_MAX/8];
 
+	/** Writer flags */
+	enum ujson_writer_flags flags;
+	/** Number of indentation characters per depth, 0 means default of 1 */
+	unsigned int indent;
+	/** Indentation character, 0 means default of ' ' */
+	char indent_ch;
+
 	/** Handler to print errors and warnings */
 	void (*err_print)(void *err_print_priv, const char *line);
 	void *err_print_priv;
 	char err[UJSON_ERR_MAX];
 
-	/** Handler to produce JSON output */
+	/**
+	 * Handler to produce JSON output
+	 *
+	 * The output is buffered in the writer and the handler is called when
+	 * the buffer is full, on ujson_writer_flush() and on
+	 * ujson_writer_finish(). Chunks that do not fit into the buffer are
+	 * passed to the handler directly.
+	 */
 	int (*out)(struct ujson_writer *self, const char *buf, size_t buf_size);
 	void *out_priv;
+
+	/**
+	 * Optional handler to write out several chunks at once
+	 *
+	 * If set a large chunk that does not fit into the buffer is passed
+	 * along with the buffer content in a single call instead of flushing
+	 * the buffer first.
+	 */
+	int (*outv)(struct ujson_writer *self, const struct iovec *iov, int iovcnt);
+
+	/**
+	 * Output buffer, points to the embedded buf__ unless set by the
+	 * backend before first write.
+	 */
+	char *buf;
+	size_t buf_size;
+	size_t buf_used;
+
+	char buf__[UJSON_WRITER_BUF_SIZE];
 };
 
 /**
@@ -70,15 +175,156 @@ struct ujson_writer {
  */
 ujson_writer *ujson_writer_file_open(const char *path);
 
+/** @brief File writer flags. */
+enum ujson_writer_file_flags {
+	/**
+	 * @brief Writes the file asynchronously with io_uring.
+	 *
+	 * The buffer is doubled and the output is serialized into one half
+	 * while the other one is being written. Silently falls back to
+	 * write() if io_uring support was not compiled in, is not available
+	 * or if the path is not a regular file.
+	 */
+	UJSON_WRITER_FILE_IO_URING = 0x01,
+};
+
+/**
+ * @brief Allocates a JSON file writer with a custom buffer size.
+ *
+ * @param path A path to the file, file is opened for writing and created if it
+ *             does not exist.
+ * @param buf_size An output buffer size, pass 0 for UJSON_WRITER_FILE_BUF_SIZE.
+ * @param flags A bitwise combination of enum ujson_writer_file_flags.
+ *
+ * @return A ujson_writer pointer or NULL in a case of failure.
+ */
+ujson_writer *ujson_writer_file_open_ex(const char *path, size_t buf_size,
+                                        enum ujson_writer_file_flags flags);
+
 /**
  * @brief Closes and frees a JSON file writer.
  *
+ * Flushes the buffer and waits for all outstanding writes.
+ *
  * @param self A ujson_writer file writer.
  *
  * @return Zero on success, non-zero on a failure and errno is set.
  */
 int ujson_writer_file_close(ujson_writer *self);
 
+/**
+ * @brief Allocates a gzip compressing JSON file writer.
+ *
+ * The output buffer is compressed directly without an intermediate copy.
+ * Supported only if the library was built with zlib, i.e. 'make ZLIB=1',
+ * otherwise the call fails with errno set to ENOSYS.
+ *
+ * @param path A path to the file, file is opened for writing and created if it
+ *             does not exist.
+ * @param level A compression level 0-9, -1 for the zlib default.
+ *
+ * @return A ujson_writer pointer or NULL in a case of failure.
+ */
+ujson_writer *ujson_writer_gz_open(const char *path, int level);
+
+/**
+ * @brief Finishes the compressed stream, closes and frees a gzip writer.
+ *
+ * @param self A ujson_writer gzip writer.
+ *
+ * @return Zero on success, non-zero on a failure and errno is set.
+ */
+int ujson_writer_gz_close(ujson_writer *self);
+
+/**
+ * @brief Allocates a JSON memory writer.
+ *
+ * The writer writes into a memory buffer that is grown geometrically as
+ * needed. The data are written directly into the buffer, there is no
+ * intermediate copy.
+ *
+ * @param size_hint An initial buffer size, pass 0 for default.
+ *
+ * @return A ujson_writer pointer or NULL in a case of allocation failure.
+ */
+ujson_writer *ujson_writer_mem_open(size_t size_hint);
+
+/**
+ * @brief Allocates a JSON memory writer with a caller provided buffer.
+ *
+ * The writer fails with an error once the buffer is full. Combined with
+ * ujson_writer_measure_open() a JSON can be serialized with a single
+ * allocation.
+ *
+ * @param buf A buffer to write the JSON into.
+ * @param buf_size A buffer size.
+ *
+ * @return A ujson_writer pointer or NULL in a case of allocation failure.
+ */
+ujson_writer *ujson_writer_mem_open_fixed(char *buf, size_t buf_size);
+
+/**
+ * @brief Allocates a JSON writer that only measures the output size.
+ *
+ * No data are stored, ujson_writer_mem_close() returns the exact number of
+ * bytes the JSON would take.
+ *
+ * @return A ujson_writer pointer or NULL in a case of allocation failure.
+ */
+ujson_writer *ujson_writer_measure_open(void);
+
+/**
+ * @brief Closes and frees a JSON memory writer.
+ *
+ * Works for writers allocated by ujson_writer_mem_open(),
+ * ujson_writer_mem_open_fixed() and ujson_writer_measure_open().
+ *
+ * For ujson_writer_mem_open() the returned buffer is null terminated and has
+ * to be freed by the caller with free(), for ujson_writer_mem_open_fixed()
+ * the caller buffer is returned and for ujson_writer_measure_open() NULL is
+ * returned.
+ *
+ * @param self A ujson_writer memory writer.
+ * @param buf A pointer to store the buffer pointer to, may be NULL.
+ * @param len A pointer to store the JSON length to, may be NULL.
+ *
+ * @return Zero on success, non-zero if writer error has happened, in which
+ *         case the buffer is freed.
+ */
+int ujson_writer_mem_close(ujson_writer *self, char **buf, size_t *len);
+
+/**
+ * @brief Allocates a fragment writer for the current Object/Array.
+ *
+ * A fragment writer is a memory writer that starts at the depth and in the
+ * container the parent writer is currently in and inherits its flags and
+ * indentation. Entries written into fragments, e.g. slices of a large array
+ * serialized by different threads, are then joined into the parent with
+ * ujson_writer_fragment_join(). The parent must not be modified until all
+ * its fragments have been joined, fragments itself can be written
+ * concurrently.
+ *
+ * @param parent A JSON writer inside of an Object/Array.
+ * @param size_hint An initial buffer size, pass 0 for default.
+ *
+ * @return A ujson_writer pointer or NULL in a case of failure.
+ */
+ujson_writer *ujson_writer_fragment_open(ujson_writer *parent, size_t size_hint);
+
+/**
+ * @brief Appends a fragment to the writer and frees the fragment.
+ *
+ * Fragments are joined in the order of the calls, the separating comma is
+ * written as needed. All Objects/Arrays started in the fragment have to be
+ * finished.
+ *
+ * @param self A JSON writer the fragment has been opened for.
+ * @param fragment A fragment writer, always freed by the call.
+ *
+ * @return Zero on success, non-zero otherwise.
+ */
+int ujson_writer_fragment_join(ujson_writer *self, ujson_writer *fragment);
+
 /**
  * @brief Returns true if writer error happened.
  *
@@ -168,6 +414,34 @@ int ujson_null_add(ujson_writer *self, const char *id);
  */
 int ujson_int_add(ujson_writer *self, const char *id, long val);
 
+/**
+ * @brief Adds a 64bit signed integer value.
+ *
+ * The id must be NULL inside of an array, and must be non-NULL inside of an
+ * object.
+ *
+ * @param self A JSON writer.
+ * @param id An integer value name.
+ * @param val An integer value.
+ *
+ * @return Zero on success, non-zero otherwise.
+ */
+int ujson_int64_add(ujson_writer *self, const char *id, int64_t val);
+
+/**
+ * @brief Adds a 64bit unsigned integer value.
+ *
+ * The id must be NULL inside of an array, and must be non-NULL inside of an
+ * object.
+ *
+ * @param self A JSON writer.
+ * @param id An integer value name.
+ * @param val An unsigned integer value.
+ *
+ * @return Zero on success, non-zero otherwise.
+ */
+int ujson_uint64_add(ujson_writer *self, const char *id, uint64_t val);
+
 /**
  * @brief Adds a bool value.
  *
@@ -188,6 +462,11 @@ int ujson_bool_add(ujson_writer *self, const char *id, int val);
  * The id must be NULL inside of an array, and must be non-NULL inside of an
  * object.
  *
+ * The value is written as a string that parses back to the same double,
+ * usually the shortest one, see ujson_double_to_str(). Since JSON cannot represent NaN and
+ * infinity the call fails for these unless UJSON_WRITER_NONFINITE_NULL flag
+ * is set, in which case null is written instead.
+ *
  * @param self A JSON writer.
  * @param id A floating point value name.
  * @param val A floating point value.
@@ -202,6 +481,10 @@ int ujson_float_add(ujson_writer *self, const char *id, double val);
  * The id must be NULL inside of an array, and must be non-NULL inside of an
  * object.
  *
+ * Characters '"', '\\' and all characters less than 0x20 are escaped, '/' is
+ * escaped only if UJSON_WRITER_ESC_SLASH is set. The call fails if the string
+ * is not valid UTF-8.
+ *
  * @param self A JSON writer.
  * @param id A string value name.
  * @param str An UTF8 string value.
@@ -210,11 +493,120 @@ int ujson_float_add(ujson_writer *self, const char *id, double val);
  */
 int ujson_str_add(ujson_writer *self, const char *id, const char *str);
 
+/**
+ * @brief Adds a string value with explicit lengths.
+ *
+ * Same as ujson_str_add() but neither the id nor the string have to be null
+ * terminated, which allows writing slices of other buffers without copying
+ * them. Embedded null characters are escaped as \u0000.
+ *
+ * @param self A JSON writer.
+ * @param id A string value name, NULL inside of an array.
+ * @param id_len A length of the id.
+ * @param str An UTF8 string value.
+ * @param len A length of the string value.
+ *
+ * @return Zero on success, non-zero otherwise.
+ */
+int ujson_strn_add(ujson_writer *self, const char *id, size_t id_len,
+                   const char *str, size_t len);
+
+/**
+ * @brief Adds an already serialized JSON value.
+ *
+ * The id must be NULL inside of an array, and must be non-NULL inside of an
+ * object.
+ *
+ * The fragment is copied into the output as it is, it's neither escaped nor
+ * parsed nor reindented. It has to be a single valid JSON value, that is
+ * checked only if UJSON_WRITER_RAW_VALIDATE flag is set.
+ *
+ * @param self A JSON writer.
+ * @param id A value name.
+ * @param json A serialized JSON value, does not have to be null terminated.
+ * @param len A length of the JSON value.
+ *
+ * @return Zero on success, non-zero otherwise.
+ */
+int ujson_raw_add(ujson_writer *self, const char *id, const char *json, size_t len);
+
+/**
+ * @brief Prepares an object key.
+ *
+ * Serializers usually write the same keys over and over, a key prepared once
+ * is written out without any escaping by the *_add_key() variants of the add
+ * functions, which otherwise behave exactly as the variants that take an id.
+ * The '/' character is never escaped in prepared keys.
+ *
+ * @param id An object key.
+ *
+ * @return A prepared key, the key len is zero if the id is not valid UTF-8 or
+ *         if it does not fit into UJSON_KEY_MAX after escaping. Passing such
+ *         key to the writer fails.
+ */
+ujson_key ujson_key_prepare(const char *id);
+
+/**
+ * @brief Prepares an object key from an id that is not null terminated.
+ *
+ * @param id An object key.
+ * @param id_len A length of the key.
+ *
+ * @return A prepared key, see ujson_key_prepare().
+ */
+ujson_key ujson_key_preparen(const char *id, size_t id_len);
+
+/** @brief Starts a JSON object with a prepared key, see ujson_obj_start(). */
+int ujson_obj_start_key(ujson_writer *self, const ujson_key *key);
+
+/** @brief Starts a JSON array with a prepared key, see ujson_arr_start(). */
+int ujson_arr_start_key(ujson_writer *self, const ujson_key *key);
+
+/** @brief Adds a null value with a prepared key, see ujson_null_add(). */
+int ujson_null_add_key(ujson_writer *self, const ujson_key *key);
+
+/** @brief Adds an integer value with a prepared key, see ujson_int_add(). */
+int ujson_int_add_key(ujson_writer *self, const ujson_key *key, long val);
+
+/** @brief Adds a 64bit integer with a prepared key, see ujson_int64_add(). */
+int ujson_int64_add_key(ujson_writer *self, const ujson_key *key, int64_t val);
+
+/** @brief Adds a 64bit unsigned integer with a prepared key, see ujson_uint64_add(). */
+int ujson_uint64_add_key(ujson_writer *self, const ujson_key *key, uint64_t val);
+
+/** @brief Adds a bool value with a prepared key, see ujson_bool_add(). */
+int ujson_bool_add_key(ujson_writer *self, const ujson_key *key, int val);
+
+/** @brief Adds a float value with a prepared key, see ujson_float_add(). */
+int ujson_float_add_key(ujson_writer *self, const ujson_key *key, double val);
+
+/** @brief Adds a string value with a prepared key, see ujson_str_add(). */
+int ujson_str_add_key(ujson_writer *self, const ujson_key *key, const char *str);
+
+/** @brief Adds a string with a length and a prepared key, see ujson_strn_add(). */
+int ujson_strn_add_key(ujson_writer *self, const ujson_key *key,
+                       const char *str, size_t len);
+
+/** @brief Adds a raw JSON value with a prepared key, see ujson_raw_add(). */
+int ujson_raw_add_key(ujson_writer *self, const ujson_key *key,
+                      const char *json, size_t len);
+
+/**
+ * @brief Flushes the output buffer.
+ *
+ * Passes the data buffered in the writer to the out() handler.
+ *
+ * @param self A JSON writer.
+ * @return Zero on success, non-zero otherwise.
+ */
+int ujson_writer_flush(ujson_writer *self);
+
 /**
  * @brief Finalizes json writer.
  *
  * Finalizes the json writer, throws possible errors through the error printing
- * function.
+ * function. A newline is written after the JSON, in all output modes, and the
+ * output buffer is flushed.
  *
  * @param self A JSON writer.
  * @return Overall error value.